@@ -3,6 +3,10 @@
 //
 #include "bxamfilter.h"
 #include "bxcommon.h"
+#include "bxdict.h"
+#include "bxaux.h"
+#include "bxspill.h"
+#include "bxreader.h"
 #include <iostream>
 #include <unordered_map>
 #include <unordered_set>
@@ -13,7 +17,6 @@
 #include <sstream>
 #include <vector>
 #include <algorithm>
-#include "SeqLib/BamReader.h"
 #include "SeqLib/BamWriter.h"
 
 namespace opt {
@@ -43,63 +46,84 @@ static void parseOptions(int argc, char** argv);
 void runAmFilter(int argc, char** argv) {
     parseOptions(argc, argv);
 
-    SeqLib::BamReader reader;
+    BXReader reader;
     if (!reader.Open(opt::bam)) {
         std::cerr << "Failed to open bam: " << opt::bam << std::endl;
         exit(EXIT_FAILURE);
     }
+    attachThreadPool(reader);
     SeqLib::BamWriter writer;
     writer.Open(opt::output_bam);
+    attachThreadPool(writer);
     writer.SetHeader(reader.Header());
     writer.WriteHeader();
     // loop and filter
     SeqLib::BamRecord r1;
 
-    std::unordered_set<std::string> records_to_discard;
+    // read names to drop in the second pass; spills under --max-mem
+    BXSpillSet records_to_discard;
     int tag;
     std::string barcode;
 
     int distance_diff = 5000;
-    std::unordered_map<std::string, std::stack<std::pair<std::string, int>>> current_reads;
-    std::unordered_map<std::string, int> barcode_count;
-
-    while (reader.GetNextRecord(r1)) {
+    // per-barcode state, indexed by BXDict id
+    BXDict barcodes;
+    std::vector<std::stack<std::pair<std::string, int>>> current_reads;
+    std::vector<int> barcode_count;
+
+    // AM and BX in one walk of the aux block. As before, a missing
+    // tag leaves the value from the previous read in place.
+    const uint16_t aux_tags[2] = { auxTag("AM"), auxTag("BX") };
+    BXAux aux[2];
+    char buf[32];
+    size_t len;
+
+    while (readRecord(reader, r1)) {
         std::string read_id = r1.Qname();
         int pos = r1.Position();
-        r1.GetATag("AM", tag);
-        r1.GetTag("BX", barcode);
+        scanAux(r1.raw(), aux_tags, 2, aux);
+        if (aux[0].found())
+            tag = aux[0].toChar();
+        if (const char* bx = aux[1].text(buf, len))
+            barcode.assign(bx, len);
         //std::cerr << tag << std::endl;
         //std::cerr << barcode << std::endl;
 
-        barcode_count[barcode]++;
+        const uint32_t id = barcodes.intern(barcode);
+        if (id == barcode_count.size()) {
+            barcode_count.push_back(0);
+            current_reads.push_back(std::stack<std::pair<std::string, int>>());
+        }
+        barcode_count[id]++;
+        auto& reads = current_reads[id];
 
         if (tag == '0') {
             records_to_discard.insert(read_id);
         } else {
-            if (current_reads[barcode].size() == 0) {
-                current_reads[barcode].push(std::make_pair(read_id, pos));
-            } else if (current_reads[barcode].size() == 1) {
-                if (abs(pos - current_reads[barcode].top().second) < distance_diff) {
-                    current_reads[barcode].push(std::make_pair(read_id, pos));
+            if (reads.size() == 0) {
+                reads.push(std::make_pair(read_id, pos));
+            } else if (reads.size() == 1) {
+                if (abs(pos - reads.top().second) < distance_diff) {
+                    reads.push(std::make_pair(read_id, pos));
                 } else {
-                    records_to_discard.insert(current_reads[barcode].top().first);
-                    current_reads[barcode] = std::stack<std::pair<std::string, int>>();
-                    current_reads[barcode].push(std::make_pair(read_id, pos));
+                    records_to_discard.insert(reads.top().first);
+                    reads = std::stack<std::pair<std::string, int>>();
+                    reads.push(std::make_pair(read_id, pos));
                 }
             } else {
-                if (abs(pos - current_reads[barcode].top().second) < distance_diff) {
-                    current_reads[barcode].push(std::make_pair(read_id, pos));
+                if (abs(pos - reads.top().second) < distance_diff) {
+                    reads.push(std::make_pair(read_id, pos));
                 } else {
-                    current_reads[barcode] = std::stack<std::pair<std::string, int>>();
-                    current_reads[barcode].push(std::make_pair(read_id, pos));
+                    reads = std::stack<std::pair<std::string, int>>();
+                    reads.push(std::make_pair(read_id, pos));
                 }
             }
         }
     }
     std::vector<int> v;
-    for (auto it : barcode_count) {
-        std::cerr << it.first << " " << it.second << std::endl;
-        v.push_back(it.second);
+    for (uint32_t i = 0; i < barcode_count.size(); ++i) {
+        std::cerr << barcodes.name(i) << " " << barcode_count[i] << std::endl;
+        v.push_back(barcode_count[i]);
     }
 
     std::sort(v.begin(), v.end());
@@ -108,25 +132,30 @@ void runAmFilter(int argc, char** argv) {
         threshold = 4 * v[v.size() / 2];
     }
 
-    for (auto it : current_reads) {
-        if (it.second.size() == 1) {
-            records_to_discard.insert(it.first);
+    for (uint32_t i = 0; i < current_reads.size(); ++i) {
+        if (current_reads[i].size() == 1) {
+            records_to_discard.insert(barcodes.name(i));
         }
     }
+    records_to_discard.finish();
 
     reader.Close();
-    SeqLib::BamReader reader2;
+    BXReader reader2;
 
     if (!reader2.Open(opt::bam)) {
         std::cerr << "Failed to open bam: " << opt::bam << std::endl;
         exit(EXIT_FAILURE);
     }
+    attachThreadPool(reader2);
 
-    while (reader2.GetNextRecord(r1)) {
-        r1.GetTag("BX", barcode);
+    while (readRecord(reader2, r1)) {
+        if (const char* bx = scanAux(r1.raw(), aux_tags[1]).text(buf, len))
+            barcode.assign(bx, len);
 
-        if (!records_to_discard.count(r1.Qname()) && barcode_count[barcode] < threshold) {
-            writer.WriteRecord(r1);
+        const uint32_t id = barcodes.find(barcode);
+        const int n = id == BXDict::npos ? 0 : barcode_count[id];
+        if (!records_to_discard.count(r1.Qname()) && n < threshold) {
+            writeRecord(writer, r1);
         }
     }
     writer.Close();
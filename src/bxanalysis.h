@@ -0,0 +1,45 @@
+#ifndef BXTOOLS_ANALYSIS_H__
+#define BXTOOLS_ANALYSIS_H__
+
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "SeqLib/BamRecord.h"
+
+// The accumulator of an aggregating command (stats, tile, mol,
+// split-by-ref), behind one interface so that bxtools multi can feed each
+// decoded record to several of them. The commands use their accumulator
+// directly; copies and merge() are what the sharded driver (bxshard.h)
+// needs.
+class BXAnalysis {
+
+ public:
+
+  virtual ~BXAnalysis() {}
+
+  virtual void add(const SeqLib::BamRecord& r) = 0;
+
+  // fold in an accumulator of the same kind, filled from other records
+  virtual void merge(BXAnalysis& o) = 0;
+
+  virtual BXAnalysis* clone() const = 0;
+
+  // write the result in the command's usual format. "-" is stdout
+  virtual void write(const std::string& out) = 0;
+};
+
+// the stream for an output file, or stdout for "-"
+inline std::ostream& openOutput(const std::string& out, std::ofstream& file) {
+  if (out == "-")
+    return std::cout;
+  file.open(out.c_str());
+  if (!file) {
+    std::cerr << "Failed to open output file: " << out << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return file;
+}
+
+#endif
@@ -0,0 +1,35 @@
+#include "bxarena.h"
+
+#include <cstring>
+
+static inline size_t words(size_t bytes) {
+  return (bytes + sizeof(uint64_t) - 1) / sizeof(uint64_t);
+}
+
+void BXRecordArena::push_back(const bam1_t* b) {
+
+  const size_t head = words(sizeof(Head));
+  const size_t at = m_buf.size();
+  m_buf.resize(at + head + words(b->l_data));
+
+  Head h;
+  h.core = b->core;
+  h.l_data = b->l_data;
+  memcpy(&m_buf[at], &h, sizeof(h));
+  if (b->l_data)
+    memcpy(&m_buf[at + head], b->data, b->l_data);
+  m_offsets.push_back(at);
+}
+
+void BXRecordArena::view(size_t i, bam1_t& b) const {
+
+  const size_t at = m_offsets[i];
+  Head h;
+  memcpy(&h, &m_buf[at], sizeof(h));
+
+  memset(&b, 0, sizeof(b));
+  b.core = h.core;
+  b.l_data = h.l_data;
+  b.m_data = h.l_data;
+  b.data = reinterpret_cast<uint8_t*>(const_cast<uint64_t*>(&m_buf[at + words(sizeof(Head))]));
+}
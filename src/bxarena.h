@@ -0,0 +1,63 @@
+#ifndef BXTOOLS_ARENA_H__
+#define BXTOOLS_ARENA_H__
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "htslib/sam.h"
+
+// Raw BAM records stored back to back in one buffer, for records that are
+// only held and then written (split buckets, fan-out batches). Unlike a
+// vector of SeqLib::BamRecord there is no allocation or shared_ptr per
+// record, and clear() keeps the memory for the next batch.
+//
+// view() gives a bam1_t whose data points into the arena, which the
+// htslib writers (sam_write1, bam_write1) take as is. It must not be
+// destroyed or grown, and is only good until the arena next changes.
+class BXRecordArena {
+
+ public:
+
+  void push_back(const bam1_t* b);
+
+  void view(size_t i, bam1_t& b) const;
+
+  size_t size() const { return m_offsets.size(); }
+
+  bool empty() const { return m_offsets.empty(); }
+
+  // drop the records, keep the memory
+  void clear() {
+    m_buf.clear();
+    m_offsets.clear();
+  }
+
+  // memory used by the records, in bytes
+  size_t bytes() const {
+    return m_buf.size() * sizeof(uint64_t) + m_offsets.size() * sizeof(size_t);
+  }
+
+  // memory held, in bytes
+  size_t capacity() const {
+    return m_buf.capacity() * sizeof(uint64_t) + m_offsets.capacity() * sizeof(size_t);
+  }
+
+  void swap(BXRecordArena& o) {
+    m_buf.swap(o.m_buf);
+    m_offsets.swap(o.m_offsets);
+  }
+
+ private:
+
+  // in front of each record's data, which starts 8-byte aligned
+  struct Head {
+    bam1_core_t core;
+    int32_t l_data;
+  };
+
+  std::vector<uint64_t> m_buf;   // 8-byte words, so everything stays aligned
+  std::vector<size_t> m_offsets; // word offset of each record's Head
+};
+
+#endif
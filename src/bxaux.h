@@ -0,0 +1,169 @@
+#ifndef BXTOOLS_AUX_H__
+#define BXTOOLS_AUX_H__
+
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include "htslib/sam.h"
+
+#include "bxprofile.h"
+
+// Single-pass, allocation-free lookup of aux tags. scanAux walks the aux
+// block of a record once and returns non-owning views for several tags at
+// a time, comparing each 2-character tag as a uint16. The views point into
+// the bam1_t, so they are only good until the record is changed or reused.
+
+// "BX" -> uint16 in the byte order the tag has in the aux block
+inline uint16_t auxTag(const char* t) {
+  return static_cast<uint8_t>(t[0]) | static_cast<uint16_t>(static_cast<uint8_t>(t[1])) << 8;
+}
+
+inline uint16_t auxTag(const std::string& t) {
+  return t.size() == 2 ? auxTag(t.c_str()) : 0;
+}
+
+struct BXAux {
+
+  const uint8_t* p = nullptr; // the type byte, as from bam_aux_get
+  uint32_t len = 0;           // string length for Z and H values
+
+  bool found() const { return p != nullptr; }
+
+  char type() const { return p[0]; }
+
+  bool isString() const { return p && (p[0] == 'Z' || p[0] == 'H'); }
+
+  bool isInt() const {
+    if (!p)
+      return false;
+    switch (p[0]) {
+    case 'c': case 'C': case 's': case 'S': case 'i': case 'I': return true;
+    }
+    return false;
+  }
+
+  bool isFloat() const { return p && (p[0] == 'f' || p[0] == 'd'); }
+
+  // the value of a Z or H tag (NUL terminated, length len)
+  const char* str() const { return reinterpret_cast<const char*>(p + 1); }
+
+  int64_t toInt() const {
+    const uint8_t* v = p + 1;
+    switch (p[0]) {
+    case 'c': return static_cast<int8_t>(v[0]);
+    case 'C': return v[0];
+    case 's': { int16_t x; memcpy(&x, v, 2); return x; }
+    case 'S': { uint16_t x; memcpy(&x, v, 2); return x; }
+    case 'i': { int32_t x; memcpy(&x, v, 4); return x; }
+    case 'I': { uint32_t x; memcpy(&x, v, 4); return x; }
+    }
+    return 0;
+  }
+
+  double toFloat() const {
+    if (p[0] == 'f') { float x; memcpy(&x, p + 1, 4); return x; }
+    if (p[0] == 'd') { double x; memcpy(&x, p + 1, 8); return x; }
+    return isInt() ? static_cast<double>(toInt()) : 0;
+  }
+
+  char toChar() const { return p[0] == 'A' ? static_cast<char>(p[1]) : 0; }
+
+  // The value as text, the way BamRecord::GetTag renders it: strings are
+  // returned in place, ints and floats are formatted into buf (>= 32 bytes).
+  // Returns nullptr for types GetTag does not handle.
+  const char* text(char* buf, size_t& n) const {
+    if (isString()) {
+      n = len;
+      return str();
+    }
+    int w = -1;
+    if (isInt())
+      w = snprintf(buf, 32, "%d", static_cast<int32_t>(toInt()));
+    else if (isFloat())
+      w = snprintf(buf, 32, "%f", static_cast<float>(toFloat()));
+    if (w < 0)
+      return nullptr;
+    n = w;
+    return buf;
+  }
+};
+
+// size in bytes of a fixed-width aux type, or 0
+inline int auxTypeSize(uint8_t t) {
+  switch (t) {
+  case 'A': case 'c': case 'C': return 1;
+  case 's': case 'S': return 2;
+  case 'i': case 'I': case 'f': return 4;
+  case 'd': return 8;
+  }
+  return 0;
+}
+
+// Walk the aux block of b once, setting out[i] for each tags[i] that is
+// present (out[i] is cleared otherwise). Stops as soon as every requested
+// tag is found or the block is malformed. Returns the number found.
+inline int scanAux(const bam1_t* b, const uint16_t* tags, int ntags, BXAux* out) {
+
+  BXTimer timer(STAGE_TAGS);
+
+  for (int i = 0; i < ntags; ++i)
+    out[i] = BXAux();
+
+  const uint8_t* s = bam_get_aux(b);
+  const uint8_t* end = b->data + b->l_data;
+  int nfound = 0;
+
+  while (s + 3 <= end && nfound < ntags) {
+
+    const uint16_t tag = s[0] | static_cast<uint16_t>(s[1]) << 8;
+    const uint8_t* val = s + 2; // the type byte
+    const uint8_t type = *val;
+    const uint8_t* next;
+    uint32_t len = 0;
+
+    if (int sz = auxTypeSize(type)) {
+      next = val + 1 + sz;
+    } else if (type == 'Z' || type == 'H') {
+      const uint8_t* z = static_cast<const uint8_t*>(memchr(val + 1, '\0', end - val - 1));
+      if (!z)
+	return nfound;
+      len = z - val - 1;
+      next = z + 1;
+    } else if (type == 'B') {
+      if (val + 6 > end)
+	return nfound;
+      const int sz = auxTypeSize(val[1]);
+      uint32_t n;
+      memcpy(&n, val + 2, 4);
+      if (!sz || n > static_cast<uint64_t>(end - val - 6) / sz)
+	return nfound;
+      next = val + 6 + static_cast<uint64_t>(sz) * n;
+    } else {
+      return nfound;
+    }
+    if (next > end)
+      return nfound;
+
+    for (int i = 0; i < ntags; ++i) {
+      if (tags[i] == tag && !out[i].p) {
+	out[i].p = val;
+	out[i].len = len;
+	++nfound;
+      }
+    }
+    s = next;
+  }
+
+  return nfound;
+}
+
+// convenience for the common single-tag lookup
+inline BXAux scanAux(const bam1_t* b, uint16_t tag) {
+  BXAux a;
+  scanAux(b, &tag, 1, &a);
+  return a;
+}
+
+#endif
@@ -3,156 +3,210 @@
 //
 #include "bxbamtofastq.h"
 #include "bxcommon.h"
+#include "bxkernels.h"
+#include "bxcollate.h"
+#include "bxreader.h"
 #include <iostream>
-#include <fstream>
+#include <cstring>
 #include <getopt.h>
 #include <sstream>
 #include <vector>
-#include "SeqLib/BamReader.h"
+#include "htslib/bgzf.h"
 
 namespace opt {
 
     static std::string bam; // the bam to analyze
     static bool verbose = false;
     static std::string output_folder;
+    static bool collate = false; // group by read name first, whatever the sort order
+    static bool gzip = false; // BGZF-compressed .fastq.gz
+    static bool interleaved = false; // R1 and R2 in one file, or on stdout
 }
 
-/**
- * ACGT -> TGCA
- * @param char c is 'A/a/0', 'C/c/1', 'G/g/2', 'T/t/3' or 'N'
- * @return complement symbol, i.e. 'A/a/0' => 'T/t/3', 'C/c/1' => 'G/g/2', 'G/g/2' => 'C/c/1', 'T/t/3' => 'A/a/0', 'N' => 'N'
- */
-inline char nucl_complement(char c) {
-    switch (c) {
-        case 0:
-            return 3;
-        case 'a':
-            return 't';
-        case 'A':
-            return 'T';
-        case 1:
-            return 2;
-        case 'c':
-            return 'g';
-        case 'C':
-            return 'G';
-        case 2:
-            return 1;
-        case 'g':
-            return 'c';
-        case 'G':
-            return 'C';
-        case 3:
-            return 0;
-        case 't':
-            return 'a';
-        case 'T':
-            return 'A';
-        case 'N':
-            return 'N';
-        case 'n':
-            return 'n';
-        default:
-            return 'n';
-    }
-}
-
-static const char* shortopts = "hv:";
+static const char* shortopts = "hvCzi";
 static const struct option longopts[] = {
         { "help",                    no_argument, NULL, 'h' },
+        { "verbose",                 no_argument, NULL, 'v' },
+        { "collate",                 no_argument, NULL, 'C' },
+        { "gzip",                    no_argument, NULL, 'z' },
+        { "interleaved",             no_argument, NULL, 'i' },
         { NULL, 0, NULL, 0 }
 };
 
 static const char *STAT_USAGE_MESSAGE =
-        "Usage: bxtools bamtofastq in.bam <folder_to_output_reads (should exist)>\n"
+        "Usage: bxtools bamtofastq in.bam <folder_to_output_reads (should exist), or - with -i>\n"
                 "Description: Convert bam-file to fastq file and keep BX tag \n"
                 "\n"
                 "  General options\n"
                 "  -v, --verbose                        Set verbose output\n"
+                "  -C, --collate                        Group the reads by name first, for input that isn't.\n"
+                "                                       Coordinate-sorted input (SO:coordinate) is always collated,\n"
+                "                                       within --max-mem, spilling to $TMPDIR past it\n"
+                "  -z, --gzip                           Write .fastq.gz (BGZF, which gzip reads), compressed on the\n"
+                "                                       -@ threads\n"
+                "  -i, --interleaved                    Write R1 and R2 in turn to one <in>.fastq, or to stdout\n"
+                "                                       if the folder is -\n"
                 "\n";
 
 static void parseOptions(int argc, char** argv);
 
-inline const std::string ReverseComplement(const std::string &s) {
-    std::string res(s.size(), 0);
-    transform(s.begin(), s.end(), res.rbegin(), nucl_complement); // only difference with reverse is rbegin() instead of begin()
-    return res;
+/**
+ * Write a record's bases and qualities, in the orientation they were sequenced
+ * in, over [start, start + len) of read and qual, decoding straight from the bam1_t.
+ */
+static void placeRead(const bam1_t* b, int start, int len, std::string &read, std::string &qual) {
+    const size_t n = b->core.l_qseq;
+    const bool reverse = b->core.flag & BAM_FREVERSE;
+    if (static_cast<int>(n) != len) {
+        // SEQ doesn't fill the span its CIGAR gives it, splice it in instead
+        std::string sequence(n, 0), qualities(n, 0);
+        if (n) {
+            if (reverse)
+                bxDecodeSeqRevComp(bam_get_seq(b), n, &sequence[0]);
+            else
+                bxDecodeSeq(bam_get_seq(b), n, &sequence[0]);
+            bxQualToAscii(bam_get_qual(b), n, &qualities[0], reverse);
+        }
+        read.replace(start, len, sequence);
+        qual.replace(start, len, qualities);
+        return;
+    }
+    if (!n)
+        return;
+    if (reverse)
+        bxDecodeSeqRevComp(bam_get_seq(b), n, &read[start]);
+    else
+        bxDecodeSeq(bam_get_seq(b), n, &read[start]);
+    bxQualToAscii(bam_get_qual(b), n, &qual[start], reverse);
 }
 
+// bytes of FASTQ built up before each write
+static const size_t BX_FASTQ_BUFFER = 1 << 20;
+
+/**
+ * FASTQ output. Records are built in a buffer that is written out a
+ * megabyte at a time, through BGZF: plain text, or compressed (gzip
+ * compatible) on the thread pool while the next records are built.
+ */
+class BXFastqWriter {
 
-void processReadPair(std::vector<SeqLib::BamRecord> &records, std::ofstream &first, std::ofstream &second) {
-    std::string first_read = "";
-    std::string second_read = "";
-    std::string first_qual = "";
-    std::string second_qual = "";
-    std::string bx;
+public:
+
+    ~BXFastqWriter() { Close(); }
+
+    // - for stdout
+    bool Open(const std::string &file, bool compress) {
+        m_file = file;
+        m_fp = bgzf_open(file.c_str(), compress ? "w" : "wu");
+        if (m_fp && compress)
+            attachThreadPool(m_fp);
+        m_buf.reserve(BX_FASTQ_BUFFER + (1 << 16));
+        return m_fp != NULL;
+    }
+
+    // comment is empty or starts with a space
+    void Write(const char *name, const std::string &comment, const std::string &seq, const std::string &qual) {
+        m_buf += '@';
+        m_buf += name;
+        m_buf += comment;
+        m_buf += '\n';
+        m_buf += seq;
+        m_buf += "\n+\n";
+        m_buf += qual;
+        m_buf += '\n';
+        if (m_buf.size() >= BX_FASTQ_BUFFER)
+            flush();
+    }
+
+    void Close() {
+        if (!m_fp)
+            return;
+        flush();
+        if (bgzf_close(m_fp) < 0)
+            fail();
+        m_fp = NULL;
+    }
+
+private:
+
+    void flush() {
+        if (!m_buf.empty() && bgzf_write(m_fp, m_buf.data(), m_buf.size()) < 0)
+            fail();
+        m_buf.clear();
+    }
+
+    void fail() {
+        std::cerr << "Failed to write " << m_file << std::endl;
+        exit(EXIT_FAILURE);
+    }
 
-    if (records.size() == 0) {
+    std::string m_file;
+    BGZF *m_fp = NULL;
+    std::string m_buf;
+};
+
+// the mates of a template as they are put back together, kept from one
+// template to the next so their memory is reused
+struct ReadPairBuffers {
+    std::string first_read;
+    std::string second_read;
+    std::string first_qual;
+    std::string second_qual;
+    std::string comment;
+};
+
+// the records of one read name, in [begin, end)
+void processReadPair(const SeqLib::BamRecord *begin, const SeqLib::BamRecord *end, ReadPairBuffers &buf,
+                     BXFastqWriter &first, BXFastqWriter &second) {
+    if (begin == end) {
         return;
     }
-    std::string read_name = records[0].Qname();
-    bool tag_present = records[0].GetZTag("BX", bx);
+    buf.first_read.clear();
+    buf.second_read.clear();
+    buf.first_qual.clear();
+    buf.second_qual.clear();
+    buf.comment.clear();
 
-    for (auto record : records) {
-        if (record.SecondaryFlag()) {
+    const char *read_name = bam_get_qname(begin->raw());
+    const uint8_t *tag = bam_aux_get(begin->raw(), "BX");
+    if (tag && *tag == 'Z') {
+        buf.comment = " BX:Z:";
+        buf.comment += bam_aux2Z(tag);
+    }
+
+    for (const SeqLib::BamRecord *record = begin; record != end; ++record) {
+        if (record->SecondaryFlag()) {
             continue;
         }
-        auto cigar = record.GetCigar();
+        const bam1_t* b = record->raw();
+        const uint32_t* cigar = bam_get_cigar(b);
+        const uint32_t n_cigar = b->core.n_cigar;
         int start_offset = 0;
         int end_offset = 0;
-        if (cigar.size() != 0 && cigar.front().Type() == 'H') {
-            start_offset = cigar.front().Length();
+        if (n_cigar != 0 && bam_cigar_op(cigar[0]) == BAM_CHARD_CLIP) {
+            start_offset = bam_cigar_oplen(cigar[0]);
         }
-        if (cigar.size() != 0 && cigar.back().Type() == 'H') {
-            end_offset = cigar.back().Length();
+        if (n_cigar != 0 && bam_cigar_op(cigar[n_cigar - 1]) == BAM_CHARD_CLIP) {
+            end_offset = bam_cigar_oplen(cigar[n_cigar - 1]);
         }
 
-        int total_length = cigar.TotalLength();
-
-        for (auto cigar_field : cigar) {
-            if (cigar_field.Type() == 'D')
-                total_length -= cigar_field.Length();
+        // every operation but deletions, hard clips included
+        int total_length = 0;
+        for (uint32_t i = 0; i < n_cigar; ++i) {
+            if (bam_cigar_op(cigar[i]) != BAM_CDEL)
+                total_length += bam_cigar_oplen(cigar[i]);
         }
-        if (record.FirstFlag()) {
-
-            if (first_read.size() < total_length) {
-                first_read.resize(total_length, '?');
-                first_qual.resize(total_length, '?');
-            }
-            std::string sequence = record.ReverseFlag() ? ReverseComplement(record.Sequence()) : record.Sequence();
-            std::string qualities = record.Qualities();
-
-            if (record.ReverseFlag()) {
-                std::reverse(qualities.begin(), qualities.end());
-            }
-            first_read.replace(start_offset, total_length - start_offset - end_offset, sequence);
-            first_qual.replace(start_offset, total_length - start_offset - end_offset, qualities);
-        } else {
-            if (second_read.size() < total_length) {
-                second_read.resize(total_length, '?');
-                second_qual.resize(total_length, '?');
-            }
-            std::string sequence = record.ReverseFlag() ? ReverseComplement(record.Sequence()) : record.Sequence();
-            std::string qualities = record.Qualities();
-
-            if (record.ReverseFlag()) {
-                std::reverse(qualities.begin(), qualities.end());
-            }
-
-            second_read.replace(start_offset, total_length - start_offset - end_offset, sequence);
-            second_qual.replace(start_offset, total_length - start_offset - end_offset, qualities);
+        std::string &read = record->FirstFlag() ? buf.first_read : buf.second_read;
+        std::string &qual = record->FirstFlag() ? buf.first_qual : buf.second_qual;
+        if (read.size() < total_length) {
+            read.resize(total_length, '?');
+            qual.resize(total_length, '?');
         }
+        placeRead(b, start_offset, total_length - start_offset - end_offset, read, qual);
     }
 
-    first << "@" << read_name << (tag_present ? " BX:Z:" + bx : "")  << std::endl;
-    first << first_read << std::endl;
-    first << "+" << std::endl;
-    first << first_qual << std::endl;
-
-    second << "@" << read_name << (tag_present ? " BX:Z:" + bx : "") << std::endl;
-    second << second_read << std::endl;
-    second << "+" << std::endl;
-    second << second_qual << std::endl;
+    first.Write(read_name, buf.comment, buf.first_read, buf.first_qual);
+    second.Write(read_name, buf.comment, buf.second_read, buf.second_qual);
 }
 
 
@@ -162,33 +216,54 @@ void runBamToFastq(int argc, char** argv) {
 
     std::string basename = opt::bam.substr(opt::bam.rfind("/") == std::string::npos ? 0 : opt::bam.rfind("/") + 1,
                                            opt::bam.length() - (opt::bam.rfind("/") == std::string::npos ? 0 : opt::bam.rfind("/") + 1) - 4);
-    std::string left_fastq = opt::output_folder + "/" + basename + "_R1.fastq";
-    std::ofstream out(left_fastq, std::ofstream::out);
-    std::string right_fastq = opt::output_folder + "/" + basename + "_R2.fastq";
-    std::ofstream out2(right_fastq, std::ofstream::out);
+    const std::string extension = opt::gzip ? ".fastq.gz" : ".fastq";
 
-    SeqLib::BamReader reader;
+    BXReader reader;
     if (!reader.Open(opt::bam)) {
         std::cerr << "Failed to open bam: " << opt::bam << std::endl;
         exit(EXIT_FAILURE);
     }
-    SeqLib::BamRecord r;
-    std::vector<SeqLib::BamRecord> records;
-    std::string current_name = "";
-    while (reader.GetNextRecord(r)) {
-
-        if (current_name != r.Qname()) {
-            processReadPair(records, out, out2);
-            records.clear();
-            records.push_back(r);
-            current_name = r.Qname();
-        } else {
-            records.push_back(r);
+    attachThreadPool(reader);
+    if (opt::collate || coordinateSorted(reader.Header())) {
+        if (opt::verbose)
+            std::cerr << "Collating reads by name" << std::endl;
+        reader.Collate();
+    }
+
+    // interleaved, both mates go to the one writer
+    BXFastqWriter out, out2;
+    std::vector<std::string> files;
+    if (opt::interleaved)
+        files.push_back(opt::output_folder == "-" ? "-" : opt::output_folder + "/" + basename + extension);
+    else {
+        files.push_back(opt::output_folder + "/" + basename + "_R1" + extension);
+        files.push_back(opt::output_folder + "/" + basename + "_R2" + extension);
+    }
+    for (size_t i = 0; i < files.size(); ++i) {
+        if (!(i ? out2 : out).Open(files[i], opt::gzip)) {
+            std::cerr << "Failed to open " << files[i] << std::endl;
+            exit(EXIT_FAILURE);
+        }
+    }
+    BXFastqWriter &second = opt::interleaved ? out : out2;
+
+    // records[0, n) share a read name. The slots are read into in place
+    // and kept from one template to the next, so their bam1_t are reused
+    ReadPairBuffers buf;
+    std::vector<SeqLib::BamRecord> records(1);
+    size_t n = 0;
+    while (readRecord(reader, records[n])) {
+        if (n && strcmp(bam_get_qname(records[n].raw()), bam_get_qname(records[0].raw()))) {
+            processReadPair(&records[0], &records[0] + n, buf, out, second);
+            std::swap(records[0], records[n]);
+            n = 0;
         }
+        if (++n == records.size())
+            records.resize(n + 1);
     }
-    processReadPair(records, out, out2);
-    out.close();
-    out2.close();
+    processReadPair(&records[0], &records[0] + n, buf, out, second);
+    out.Close();
+    out2.Close();
 }
 
 static void parseOptions(int argc, char** argv) {
@@ -196,21 +271,31 @@ static void parseOptions(int argc, char** argv) {
     bool die = false;
     bool help = false;
 
-    if (argc != 3)
-        die = true;
-    else {
-        opt::bam = std::string(argv[1]);
-        opt::output_folder = std::string(argv[2]);
-    }
-
     for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
         std::istringstream arg(optarg != NULL ? optarg : "");
         switch (c) {
             case 'v': opt::verbose = true; break;
+            case 'C': opt::collate = true; break;
+            case 'z': opt::gzip = true; break;
+            case 'i': opt::interleaved = true; break;
             case 'h': help = true; break;
+            default: die = true; break;
         }
     }
 
+    // the bam and the folder, wherever the options were
+    if (argc - optind != 2)
+        die = true;
+    else {
+        opt::bam = std::string(argv[optind]);
+        opt::output_folder = std::string(argv[optind + 1]);
+    }
+
+    if (!die && opt::output_folder == "-" && !opt::interleaved) {
+        std::cerr << "Writing to stdout needs -i" << std::endl;
+        die = true;
+    }
+
     if (die || help) {
         std::cerr << "\n" << STAT_USAGE_MESSAGE;
         die ? exit(EXIT_FAILURE) : exit(EXIT_SUCCESS);
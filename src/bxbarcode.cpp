@@ -0,0 +1,27 @@
+#include "bxbarcode.h"
+
+#define X4 4, 4, 4, 4
+#define X16 X4, X4, X4, X4
+const uint8_t bx_base_code[256] = {
+  X16, X16, X16, X16,                          // 0x00 - 0x3f
+  4, 0, 4, 1, 4, 4, 4, 2, 4, 4, 4, 4, 4, 4, 4, 4, // 0x40 - 0x4f: A C G
+  4, 4, 4, 4, 3, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, 4, // 0x50 - 0x5f: T
+  X16, X16,                                    // 0x60 - 0x7f
+  X16, X16, X16, X16, X16, X16, X16, X16       // 0x80 - 0xff
+};
+#undef X16
+#undef X4
+
+std::string unpackBarcode(uint64_t key) {
+  static const char bases[] = "ACGT";
+  const int nbases = (key >> 32) & 0x1f;
+  const uint64_t group = key >> 37;
+  std::string out(nbases, 'N');
+  for (int i = 0; i < nbases; ++i)
+    out[i] = bases[(key >> (2 * i)) & 3];
+  if (group) {
+    out += '-';
+    out += std::to_string(group - 1);
+  }
+  return out;
+}
@@ -0,0 +1,84 @@
+#ifndef BXTOOLS_BARCODE_H__
+#define BXTOOLS_BARCODE_H__
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+
+// 10X-style barcodes (up to 16 bp of ACGT, optionally followed by a
+// "-<n>" GEM group suffix, e.g. AGTCCAAGTCGGAAGT-1) packed into a uint64:
+//
+//   bits  0-31  bases, 2 bits each (A=0 C=1 G=2 T=3), first base lowest
+//   bits 32-36  number of bases (1-16)
+//   bits 37-63  GEM group + 1, or 0 if there is no suffix
+//
+// A packed key is never 0, and packing is exact: unpackBarcode gives back
+// the original string. Anything else (N bases, lowercase, long barcodes,
+// other suffixes) does not pack and has to be stored as a string.
+
+extern const uint8_t bx_base_code[256]; // ACGT -> 0-3, everything else 4
+
+static const int BX_PACKED_MAX_BASES = 16;
+static const uint64_t BX_PACKED_MAX_GROUP = (1ULL << 27) - 2;
+
+// pack len bytes at s (e.g. a Z aux value straight from bam_get_aux)
+inline bool packBarcode(const char* s, size_t len, uint64_t& key) {
+
+  size_t nbases = 0;
+  uint64_t bases = 0;
+  for (; nbases < len && s[nbases] != '-'; ++nbases) {
+    const uint8_t c = bx_base_code[static_cast<unsigned char>(s[nbases])];
+    if (c > 3 || nbases == BX_PACKED_MAX_BASES)
+      return false;
+    bases |= static_cast<uint64_t>(c) << (2 * nbases);
+  }
+  if (nbases == 0)
+    return false;
+
+  uint64_t group = 0;
+  if (nbases < len) {
+    // "-" then a decimal group number without leading zeros
+    const char* g = s + nbases + 1;
+    const size_t glen = len - nbases - 1;
+    if (glen == 0 || glen > 9 || (g[0] == '0' && glen > 1))
+      return false;
+    uint64_t n = 0;
+    for (size_t i = 0; i < glen; ++i) {
+      if (g[i] < '0' || g[i] > '9')
+	return false;
+      n = n * 10 + (g[i] - '0');
+    }
+    if (n > BX_PACKED_MAX_GROUP)
+      return false;
+    group = n + 1;
+  }
+
+  key = bases | (static_cast<uint64_t>(nbases) << 32) | (group << 37);
+  return true;
+}
+
+inline bool packBarcode(const std::string& s, uint64_t& key) {
+  return packBarcode(s.data(), s.size(), key);
+}
+
+// the barcode string for a key made by packBarcode
+std::string unpackBarcode(uint64_t key);
+
+// Seeded 64-bit hash of a barcode string: FNV-1a from the seed, then the
+// MurmurHash3 finalizer to spread it over all 64 bits. The same on every
+// build and machine, so subsets drawn by hash are reproducible.
+inline uint64_t hashBarcode(const char* s, size_t len, uint64_t seed) {
+  uint64_t h = 14695981039346656037ULL ^ (seed * 0x9e3779b97f4a7c15ULL);
+  for (size_t i = 0; i < len; ++i) {
+    h ^= static_cast<unsigned char>(s[i]);
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+#endif
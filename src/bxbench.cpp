@@ -0,0 +1,429 @@
+/* bxbench - synthetic linked-read BAMs and end-to-end timings of bxtools
+ *
+ *   bxbench synth -o synth.bam [options]      write a 10X-like BAM
+ *   bxbench run <bxtools> <bam> [commands]     time bxtools commands on it
+ *
+ * Not installed; built by "make bench".
+ */
+
+#include <getopt.h>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <random>
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <cstdlib>
+#include <cstdio>
+#include <climits>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include "htslib/sam.h"
+
+namespace opt {
+
+  static std::string out = "synth.bam";
+  static int barcodes = 10000;     // number of distinct BX barcodes
+  static int molecules = 4;        // molecules per barcode
+  static int mol_length = 50000;   // mean molecule length (bp)
+  static long pairs = 1000000;     // number of read pairs
+  static int read_length = 151;
+  static int contigs = 4;
+  static int contig_length = 50000000;
+  static double unbarcoded = 0.02; // fraction of pairs with no BX
+  static std::string sort = "coordinate";
+  static bool mi = true;
+  static bool am = true;
+  static bool as = true;
+  static bool index = false;
+  static unsigned seed = 42;
+
+  static int threads = 1; // passed on to bxtools as -@
+}
+
+static const char *BENCH_USAGE_MESSAGE =
+"Usage: bxbench synth -o synth.bam [options]\n"
+"       bxbench run <path/to/bxtools> <BAM> [command ...]\n"
+"Description: Generate synthetic 10X-like BAMs and time bxtools on them\n"
+"\n"
+"  synth options\n"
+"  -o, --out             Output BAM [synth.bam]\n"
+"  -b, --barcodes        Number of barcodes [10000]\n"
+"  -m, --molecules       Molecules per barcode [4]\n"
+"  -l, --mol-length      Mean molecule length [50000]\n"
+"  -n, --pairs           Number of read pairs [1000000]\n"
+"  -r, --read-length     Read length [151]\n"
+"  -c, --contigs         Number of contigs [4]\n"
+"  -g, --contig-length   Length of each contig [50000000]\n"
+"  -u, --unbarcoded      Fraction of pairs with no BX tag [0.02]\n"
+"  -s, --sort            coordinate, name or unsorted [coordinate]\n"
+"  -i, --index           Index the output (coordinate sorted only)\n"
+"      --no-mi           Don't add MI tags\n"
+"      --no-am           Don't add AM tags\n"
+"      --no-as           Don't add AS tags\n"
+"      --seed            Random seed [42]\n"
+"\n"
+"  run options\n"
+"  -@, --threads         Threads to run bxtools with [1]\n"
+"  Commands default to all of: stats tile mol split split-by-ref relabel\n"
+"  convert subsample amfilter filter bamtofastq\n"
+"\n";
+
+enum { OPT_NO_MI = 1000, OPT_NO_AM, OPT_NO_AS, OPT_SEED };
+
+static const char* shortopts = "ho:b:m:l:n:r:c:g:u:s:i@:";
+static const struct option longopts[] = {
+  { "help",                    no_argument, NULL, 'h' },
+  { "out",                     required_argument, NULL, 'o' },
+  { "barcodes",                required_argument, NULL, 'b' },
+  { "molecules",               required_argument, NULL, 'm' },
+  { "mol-length",              required_argument, NULL, 'l' },
+  { "pairs",                   required_argument, NULL, 'n' },
+  { "read-length",             required_argument, NULL, 'r' },
+  { "contigs",                 required_argument, NULL, 'c' },
+  { "contig-length",           required_argument, NULL, 'g' },
+  { "unbarcoded",              required_argument, NULL, 'u' },
+  { "sort",                    required_argument, NULL, 's' },
+  { "index",                   no_argument, NULL, 'i' },
+  { "threads",                 required_argument, NULL, '@' },
+  { "no-mi",                   no_argument, NULL, OPT_NO_MI },
+  { "no-am",                   no_argument, NULL, OPT_NO_AM },
+  { "no-as",                   no_argument, NULL, OPT_NO_AS },
+  { "seed",                    required_argument, NULL, OPT_SEED },
+  { NULL, 0, NULL, 0 }
+};
+
+// one alignment to be written, kept small so that all of them fit in memory for sorting
+struct SynthRead {
+  int32_t tid;
+  int32_t pos;
+  int32_t mpos;
+  int32_t isize;
+  uint32_t pair;  // read pair number, also the read name
+  int32_t bx;     // barcode index, -1 for none
+  int32_t mi;     // molecule id
+  uint16_t flag;
+};
+
+static void barcodeString(int i, char* s) {
+  // spread the indices over the barcode space so they don't share prefixes
+  uint64_t h = static_cast<uint64_t>(i) * 0x9E3779B97F4A7C15ULL;
+  for (int k = 0; k < 16; ++k, h >>= 2)
+    s[k] = "ACGT"[h & 3];
+  strcpy(s + 16, "-1");
+}
+
+// append one aux tag to the record data
+static void appendAux(std::vector<uint8_t>& d, const char* tag, char type, const void* val, size_t n) {
+  d.push_back(tag[0]);
+  d.push_back(tag[1]);
+  d.push_back(type);
+  const uint8_t* v = static_cast<const uint8_t*>(val);
+  d.insert(d.end(), v, v + n);
+}
+
+static void fillRecord(bam1_t* b, std::vector<uint8_t>& d, const SynthRead& s, std::mt19937& rng) {
+
+  static const uint8_t nt16[4] = { 1, 2, 4, 8 }; // A C G T
+
+  d.clear();
+  char qname[16];
+  const int lq = snprintf(qname, sizeof(qname), "r%09u", s.pair) + 1;
+  d.insert(d.end(), qname, qname + lq);
+
+  const uint32_t cigar = static_cast<uint32_t>(opt::read_length) << BAM_CIGAR_SHIFT | BAM_CMATCH;
+  const uint8_t* c = reinterpret_cast<const uint8_t*>(&cigar);
+  d.insert(d.end(), c, c + 4);
+
+  for (int i = 0; i < opt::read_length; i += 2) {
+    const uint32_t r = rng();
+    uint8_t hi = nt16[r & 3], lo = i + 1 < opt::read_length ? nt16[(r >> 2) & 3] : 0;
+    d.push_back(hi << 4 | lo);
+  }
+  for (int i = 0; i < opt::read_length; ++i)
+    d.push_back(25 + rng() % 16);
+
+  if (s.bx >= 0) {
+    char bx[32];
+    barcodeString(s.bx, bx);
+    appendAux(d, "BX", 'Z', bx, strlen(bx) + 1);
+    if (opt::mi)
+      appendAux(d, "MI", 'i', &s.mi, 4);
+    if (opt::am) {
+      const char am = rng() % 50 ? '1' : '0';
+      appendAux(d, "AM", 'A', &am, 1);
+    }
+  }
+  if (opt::as) {
+    const int32_t as = opt::read_length - static_cast<int32_t>(rng() % 10);
+    appendAux(d, "AS", 'i', &as, 4);
+  }
+
+  if (b->m_data < d.size()) {
+    b->m_data = d.size();
+    b->data = static_cast<uint8_t*>(realloc(b->data, b->m_data));
+  }
+  memcpy(b->data, d.data(), d.size());
+  b->l_data = d.size();
+
+  bam1_core_t& core = b->core;
+  core.tid = s.tid;
+  core.pos = s.pos;
+  core.bin = hts_reg2bin(s.pos, s.pos + opt::read_length, 14, 5);
+  core.qual = 60;
+  core.l_qname = lq;
+  core.flag = s.flag;
+  core.n_cigar = 1;
+  core.l_qseq = opt::read_length;
+  core.mtid = s.tid;
+  core.mpos = s.mpos;
+  core.isize = s.isize;
+}
+
+static int runSynth() {
+
+  std::mt19937 rng(opt::seed);
+  std::normal_distribution<double> insert(350, 50);
+  std::exponential_distribution<double> mol_len(1.0 / opt::mol_length);
+
+  // lay down the molecules
+  const size_t nmol = static_cast<size_t>(opt::barcodes) * opt::molecules;
+  std::vector<int32_t> mol_tid(nmol), mol_start(nmol), mol_len_bp(nmol);
+  for (size_t m = 0; m < nmol; ++m) {
+    const int len = std::max(1000, std::min(static_cast<int>(mol_len(rng)), opt::contig_length / 2));
+    mol_tid[m] = rng() % opt::contigs;
+    mol_start[m] = rng() % (opt::contig_length - len);
+    mol_len_bp[m] = len;
+  }
+
+  std::vector<SynthRead> reads;
+  reads.reserve(opt::pairs * 2);
+  for (long p = 0; p < opt::pairs; ++p) {
+    const size_t m = rng() % nmol;
+    const int isize = std::max(opt::read_length, static_cast<int>(insert(rng)));
+    const int32_t pos = mol_start[m] + rng() % std::max(1, mol_len_bp[m] - isize);
+    const int32_t mpos = pos + isize - opt::read_length;
+    const int32_t bx = static_cast<double>(rng()) / rng.max() < opt::unbarcoded ? -1 : m / opt::molecules;
+    const uint16_t paired = BAM_FPAIRED | BAM_FPROPER_PAIR;
+    SynthRead r1 = { mol_tid[m], pos, mpos, isize, static_cast<uint32_t>(p), bx, static_cast<int32_t>(m),
+		     static_cast<uint16_t>(paired | BAM_FREAD1 | BAM_FMREVERSE) };
+    SynthRead r2 = { mol_tid[m], mpos, pos, -isize, static_cast<uint32_t>(p), bx, static_cast<int32_t>(m),
+		     static_cast<uint16_t>(paired | BAM_FREAD2 | BAM_FREVERSE) };
+    reads.push_back(r1);
+    reads.push_back(r2);
+  }
+
+  if (opt::sort == "coordinate") {
+    std::sort(reads.begin(), reads.end(), [](const SynthRead& a, const SynthRead& b) {
+	return a.tid != b.tid ? a.tid < b.tid : a.pos != b.pos ? a.pos < b.pos : a.pair < b.pair; });
+  } else if (opt::sort == "unsorted") {
+    std::shuffle(reads.begin(), reads.end(), rng);
+  } else if (opt::sort != "name") {
+    std::cerr << "Unknown sort order: " << opt::sort << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::stringstream ss;
+  ss << "@HD\tVN:1.4\tSO:" << (opt::sort == "name" ? "queryname" : opt::sort) << "\n";
+  for (int c = 0; c < opt::contigs; ++c)
+    ss << "@SQ\tSN:chr" << (c + 1) << "\tLN:" << opt::contig_length << "\n";
+  ss << "@PG\tID:bxbench\tPN:bxbench\n";
+  const std::string text = ss.str();
+
+  htsFile* fp = sam_open(opt::out.c_str(), "wb");
+  if (!fp) {
+    std::cerr << "Could not open BAM: " << opt::out << std::endl;
+    return EXIT_FAILURE;
+  }
+  bam_hdr_t* hdr = sam_hdr_parse(text.size(), text.c_str());
+  hdr->l_text = text.size();
+  hdr->text = strdup(text.c_str());
+  if (sam_hdr_write(fp, hdr) < 0) {
+    std::cerr << "Could not write header to " << opt::out << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  bam1_t* b = bam_init1();
+  std::vector<uint8_t> data;
+  for (const auto& r : reads) {
+    fillRecord(b, data, r, rng);
+    if (sam_write1(fp, hdr, b) < 0) {
+      std::cerr << "Failed to write to " << opt::out << std::endl;
+      return EXIT_FAILURE;
+    }
+  }
+  bam_destroy1(b);
+  bam_hdr_destroy(hdr);
+  sam_close(fp);
+
+  if (opt::index && opt::sort == "coordinate" && sam_index_build(opt::out.c_str(), 0) < 0) {
+    std::cerr << "Could not index " << opt::out << std::endl;
+    return EXIT_FAILURE;
+  }
+
+  std::cerr << "wrote " << reads.size() << " reads (" << opt::barcodes << " barcodes, "
+	    << nmol << " molecules, " << opt::sort << ") to " << opt::out << std::endl;
+  return EXIT_SUCCESS;
+}
+
+static size_t countReads(const std::string& bam) {
+  htsFile* fp = sam_open(bam.c_str(), "r");
+  if (!fp)
+    return 0;
+  bam_hdr_t* hdr = sam_hdr_read(fp);
+  bam1_t* b = bam_init1();
+  size_t n = 0;
+  while (sam_read1(fp, hdr, b) >= 0)
+    ++n;
+  bam_destroy1(b);
+  bam_hdr_destroy(hdr);
+  sam_close(fp);
+  return n;
+}
+
+// arguments for each command, run from inside a scratch directory
+static std::vector<std::string> commandArgs(const std::string& cmd, const std::string& bam) {
+  if (cmd == "split")
+    return { "split", bam, "-x" };
+  if (cmd == "split-by-ref")
+    return { "split-by-ref", bam, "-o", "split_by_ref" };
+  if (cmd == "multi")
+    return { "multi", bam, "-s", "stats.tsv", "-T", "tiles.bed", "-m", "mol.bed", "-r", "multi_split_by_ref" };
+  if (cmd == "subsample")
+    return { "subsample", bam, "-r", "0.5", "-o", "subsample.bam" };
+  if (cmd == "amfilter")
+    return { "amfilter", bam, "amfilter.bam" };
+  if (cmd == "bamtofastq")
+    return { "bamtofastq", bam, "." };
+  return { cmd, bam };
+}
+
+static int runBench(const std::string& bxtools, const std::string& bam_arg, std::vector<std::string> commands) {
+
+  if (commands.empty())
+    commands = { "stats", "tile", "mol", "split", "split-by-ref", "relabel",
+		 "convert", "subsample", "amfilter", "filter", "bamtofastq" };
+
+  char path[PATH_MAX];
+  if (!realpath(bxtools.c_str(), path)) {
+    std::cerr << "Could not find bxtools: " << bxtools << std::endl;
+    return EXIT_FAILURE;
+  }
+  const std::string exe = path;
+  if (!realpath(bam_arg.c_str(), path)) {
+    std::cerr << "Could not find bam: " << bam_arg << std::endl;
+    return EXIT_FAILURE;
+  }
+  const std::string bam = path;
+
+  const size_t nreads = countReads(bam);
+  std::cerr << "...timing on " << nreads << " reads from " << bam << std::endl;
+
+  std::cout << "command\tthreads\twall_s\treads_per_s\tmax_rss_mb\tstatus" << std::endl;
+  for (const auto& cmd : commands) {
+
+    char dir[] = "/tmp/bxbench.XXXXXX";
+    if (!mkdtemp(dir)) {
+      std::cerr << "Could not create scratch directory" << std::endl;
+      return EXIT_FAILURE;
+    }
+
+    std::vector<std::string> args = commandArgs(cmd, bam);
+    args.insert(args.begin(), exe);
+    args.push_back("-@");
+    args.push_back(std::to_string(opt::threads));
+
+    const auto start = std::chrono::steady_clock::now();
+    const pid_t pid = fork();
+    if (pid == 0) {
+      // child: run in the scratch dir, stdout to a file, quiet stderr
+      if (chdir(dir) != 0)
+	_exit(127);
+      const int out = open("stdout", O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      const int null = open("/dev/null", O_WRONLY);
+      dup2(out, STDOUT_FILENO);
+      dup2(null, STDERR_FILENO);
+      std::vector<char*> argv;
+      for (auto& a : args)
+	argv.push_back(&a[0]);
+      argv.push_back(nullptr);
+      execv(argv[0], argv.data());
+      _exit(127);
+    }
+
+    int status = 0;
+    struct rusage ru;
+    wait4(pid, &status, 0, &ru);
+    const double wall = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+    std::cout << cmd << "\t" << opt::threads << "\t" << wall << "\t"
+	      << static_cast<size_t>(nreads / wall) << "\t" << ru.ru_maxrss / 1024.0 << "\t"
+	      << (WIFEXITED(status) ? WEXITSTATUS(status) : -1) << std::endl;
+
+    const std::string rm = std::string("rm -rf ") + dir;
+    if (system(rm.c_str()) != 0)
+      std::cerr << "Could not remove " << dir << std::endl;
+  }
+  return EXIT_SUCCESS;
+}
+
+int main(int argc, char** argv) {
+
+  if (argc < 2) {
+    std::cerr << BENCH_USAGE_MESSAGE;
+    return EXIT_FAILURE;
+  }
+  const std::string mode = argv[1];
+
+  bool help = false;
+  for (int c; (c = getopt_long(argc - 1, argv + 1, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'h': help = true; break;
+    case 'o': arg >> opt::out; break;
+    case 'b': arg >> opt::barcodes; break;
+    case 'm': arg >> opt::molecules; break;
+    case 'l': arg >> opt::mol_length; break;
+    case 'n': arg >> opt::pairs; break;
+    case 'r': arg >> opt::read_length; break;
+    case 'c': arg >> opt::contigs; break;
+    case 'g': arg >> opt::contig_length; break;
+    case 'u': arg >> opt::unbarcoded; break;
+    case 's': arg >> opt::sort; break;
+    case 'i': opt::index = true; break;
+    case '@': arg >> opt::threads; break;
+    case OPT_NO_MI: opt::mi = false; break;
+    case OPT_NO_AM: opt::am = false; break;
+    case OPT_NO_AS: opt::as = false; break;
+    case OPT_SEED: arg >> opt::seed; break;
+    default: help = true; break;
+    }
+  }
+  if (help) {
+    std::cerr << BENCH_USAGE_MESSAGE;
+    return EXIT_SUCCESS;
+  }
+
+  if (opt::barcodes < 1 || opt::molecules < 1 || opt::contigs < 1 || opt::read_length < 1 ||
+      opt::contig_length < 4 * opt::mol_length) {
+    std::cerr << "Invalid synth options" << std::endl << BENCH_USAGE_MESSAGE;
+    return EXIT_FAILURE;
+  }
+
+  if (mode == "synth")
+    return runSynth();
+
+  // positional args follow the options (getopt moved them to the end)
+  std::vector<std::string> pos(argv + 1 + optind, argv + argc);
+  if (mode == "run" && pos.size() >= 2)
+    return runBench(pos[0], pos[1], std::vector<std::string>(pos.begin() + 2, pos.end()));
+
+  std::cerr << BENCH_USAGE_MESSAGE;
+  return EXIT_FAILURE;
+}
@@ -0,0 +1,218 @@
+#include "bxcollate.h"
+
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <numeric>
+#include <unordered_map>
+#include <unistd.h>
+
+#include "htslib/bgzf.h"
+
+#include "bxbarcode.h"
+#include "bxreader.h"
+#include "bxspill.h"
+
+static const size_t BX_COLLATE_DEFAULT_MEM = size_t(1) << 30;
+
+// temp files for the first spread, and for spreading one of those again
+static const size_t BX_COLLATE_BUCKETS = 256;
+static const size_t BX_COLLATE_RESPREAD = 16;
+
+// past this many spreads a temp file is read whole whatever its size (a
+// single name with that many records)
+static const int BX_COLLATE_MAX_DEPTH = 4;
+
+static inline uint64_t hashName(const bam1_t* b, uint64_t seed) {
+  const char* name = bam_get_qname(b);
+  return hashBarcode(name, strlen(name), seed);
+}
+
+// records spread over n new temp files, by a hash of their name that
+// differs at each depth
+class BXSpread {
+
+ public:
+
+  BXSpread(size_t n, int depth) : m_depth(depth) {
+    for (size_t i = 0; i < n; ++i) {
+      FILE* f = openSpillFile();
+      BGZF* bg = bgzf_dopen(dup(fileno(f)), "w1");
+      if (!bg)
+	spillError("open collate bucket");
+      m_buckets.push_back({ f, 0, depth });
+      m_out.push_back(bg);
+    }
+  }
+
+  void add(const bam1_t* b) {
+    const size_t i = hashName(b, m_depth) % m_out.size();
+    if (bam_write1(m_out[i], b) < 0)
+      spillError("write collate bucket");
+    m_buckets[i].bytes += sizeof(bam1_core_t) + b->l_data;
+  }
+
+  // done adding: the non-empty buckets go to the front of pending, in order
+  void close(std::deque<BXCollateBucket>& pending) {
+    for (auto bg : m_out)
+      if (bgzf_close(bg) < 0)
+	spillError("write collate bucket");
+    for (size_t i = m_buckets.size(); i-- > 0;) {
+      if (m_buckets[i].bytes)
+	pending.push_front(m_buckets[i]);
+      else
+	fclose(m_buckets[i].file);
+    }
+  }
+
+ private:
+
+  int m_depth;
+  std::vector<BXCollateBucket> m_buckets;
+  std::vector<BGZF*> m_out;
+};
+
+BXCollator::BXCollator(htsFile* fp, const bam_hdr_t* hdr)
+  : m_fp(fp), m_hdr(hdr), m_budget(memoryBudget() ? memoryBudget() : BX_COLLATE_DEFAULT_MEM) {}
+
+BXCollator::~BXCollator() {
+  for (const auto& b : m_pending)
+    fclose(b.file);
+}
+
+bool BXCollator::GetNextRecord(SeqLib::BamRecord& r) {
+
+  if (!m_read) {
+    m_read = true;
+    readInput();
+  }
+  while (m_next == m_order.size())
+    if (!loadNext())
+      return false;
+
+  bam1_t view;
+  m_records.view(m_order[m_next++], view);
+  return bam_copy1(reuseRecord(r), &view) != nullptr;
+}
+
+void BXCollator::readInput() {
+
+  std::unique_ptr<BXSpread> spread;
+  bam1_t* b = bam_init1();
+  int ret;
+  while ((ret = sam_read1(m_fp, const_cast<bam_hdr_t*>(m_hdr), b)) >= 0) {
+    if (spread) {
+      spread->add(b);
+      continue;
+    }
+    m_records.push_back(b);
+    if (m_records.bytes() > m_budget) {
+      spread.reset(new BXSpread(BX_COLLATE_BUCKETS, 0));
+      bam1_t view;
+      for (size_t i = 0; i < m_records.size(); ++i) {
+	m_records.view(i, view);
+	spread->add(&view);
+      }
+      m_records.clear();
+    }
+  }
+  bam_destroy1(b);
+  if (ret < -1) {
+    std::cerr << "Failed to read a record while collating" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  if (spread)
+    spread->close(m_pending);
+  else
+    group();
+}
+
+bool BXCollator::loadNext() {
+
+  m_records.clear();
+  m_order.clear();
+  m_next = 0;
+
+  bam1_t* b = bam_init1();
+  while (m_order.empty() && !m_pending.empty()) {
+    const BXCollateBucket bucket = m_pending.front();
+    m_pending.pop_front();
+
+    BGZF* in = bgzf_dopen(dup(fileno(bucket.file)), "r");
+    if (!in || bgzf_seek(in, 0, SEEK_SET) < 0)
+      spillError("read collate bucket");
+
+    int ret;
+    if (bucket.bytes > m_budget && bucket.depth < BX_COLLATE_MAX_DEPTH) {
+      BXSpread spread(BX_COLLATE_RESPREAD, bucket.depth + 1);
+      while ((ret = bam_read1(in, b)) >= 0)
+	spread.add(b);
+      spread.close(m_pending);
+    } else {
+      while ((ret = bam_read1(in, b)) >= 0)
+	m_records.push_back(b);
+      group();
+    }
+    if (ret < -1)
+      spillError("read collate bucket");
+    bgzf_close(in);
+    fclose(bucket.file);
+  }
+  bam_destroy1(b);
+  return !m_order.empty();
+}
+
+void BXCollator::group() {
+
+  const size_t n = m_records.size();
+
+  // group of each record, numbered in order of first appearance, found by
+  // name hash (probing on the rare hash collision)
+  std::unordered_map<uint64_t, uint32_t> groups;
+  groups.reserve(n);
+  std::vector<uint32_t> first; // first record of each group
+  std::vector<uint32_t> of(n);
+  bam1_t b, f;
+  for (size_t i = 0; i < n; ++i) {
+    m_records.view(i, b);
+    for (uint64_t h = hashName(&b, BX_COLLATE_MAX_DEPTH + 1);; ++h) {
+      auto it = groups.find(h);
+      if (it == groups.end()) {
+	of[i] = first.size();
+	groups.emplace(h, of[i]);
+	first.push_back(i);
+	break;
+      }
+      m_records.view(first[it->second], f);
+      if (!strcmp(bam_get_qname(&f), bam_get_qname(&b))) {
+	of[i] = it->second;
+	break;
+      }
+    }
+  }
+
+  // stable counting sort by group
+  std::vector<size_t> start(first.size() + 1, 0);
+  for (size_t i = 0; i < n; ++i)
+    ++start[of[i] + 1];
+  std::partial_sum(start.begin(), start.end(), start.begin());
+  m_order.resize(n);
+  for (size_t i = 0; i < n; ++i)
+    m_order[start[of[i]]++] = i;
+}
+
+bool coordinateSorted(const SeqLib::BamHeader& h) {
+  const std::string text = h.AsString();
+  if (text.compare(0, 3, "@HD"))
+    return false;
+  const std::string hd = text.substr(0, text.find('\n'));
+  return hd.find("\tSO:coordinate") != std::string::npos;
+}
+
+SeqLib::BamHeader collatedHeader(const SeqLib::BamHeader& h) {
+  std::string text = h.AsString();
+  if (text.compare(0, 3, "@HD") == 0)
+    text.erase(0, text.find('\n') + 1);
+  return SeqLib::BamHeader("@HD\tVN:1.6\tSO:unsorted\tGO:query\n" + text);
+}
@@ -0,0 +1,75 @@
+#ifndef BXTOOLS_COLLATE_H__
+#define BXTOOLS_COLLATE_H__
+
+#include <cstddef>
+#include <cstdio>
+#include <deque>
+#include <vector>
+
+#include "htslib/sam.h"
+#include "SeqLib/BamHeader.h"
+#include "SeqLib/BamRecord.h"
+
+#include "bxarena.h"
+
+// a temp file of records spread by name hash
+struct BXCollateBucket {
+  FILE* file;
+  size_t bytes; // of the records, uncompressed
+  int depth;    // times spread so far
+};
+
+// Regroups input of any sort order so that all the records of a read name
+// come out together, in place of a samtools collate / sort -n in front of
+// the commands that work one read name at a time (filter, bamtofastq).
+//
+// The input is read into memory up to the budget (--max-mem, else 1G). If
+// it all fits, the groups are handed out from there. If not, every record
+// is spread by a hash of its name over temp files in $TMPDIR, which are
+// then read back one at a time and grouped the same way; one that is
+// still over the budget is spread again with another hash. Groups come in
+// order of their first record (of the input, or of the temp file), and
+// records keep their input order within a group.
+class BXCollator {
+
+ public:
+
+  BXCollator(htsFile* fp, const bam_hdr_t* hdr);
+  ~BXCollator();
+
+  // the first call reads the whole input
+  bool GetNextRecord(SeqLib::BamRecord& r);
+
+ private:
+
+  BXCollator(const BXCollator&);
+  BXCollator& operator=(const BXCollator&);
+
+  void readInput();
+
+  // read the next temp file, spreading it again if it is too big
+  bool loadNext();
+
+  // m_order from the records in m_records
+  void group();
+
+  htsFile* m_fp;
+  const bam_hdr_t* m_hdr;
+  size_t m_budget;
+  bool m_read = false;
+
+  BXRecordArena m_records;
+  std::vector<uint32_t> m_order; // m_records, grouped
+  size_t m_next = 0;
+
+  std::deque<BXCollateBucket> m_pending;
+};
+
+// the header puts the records in coordinate order, so they need collating
+// before they can be read one name at a time
+bool coordinateSorted(const SeqLib::BamHeader& h);
+
+// the header for collated records: no longer sorted, grouped by name
+SeqLib::BamHeader collatedHeader(const SeqLib::BamHeader& h);
+
+#endif
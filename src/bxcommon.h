@@ -1,11 +1,15 @@
 #ifndef BXTOOLS_BXCOMMON_H__
 #define BXTOOLS_BXCOMMON_H__
 
+#include "bxthreads.h"
+#include "bxprofile.h"
+
 #define BXOPEN(reader, bam)			\
   if (!reader.Open(bam)) {				     \
     std::cerr << "Failed to open bam: " << bam << std::endl; \
     exit(EXIT_FAILURE); \
   }			\
+  attachThreadPool(reader);
 
 #define BXLOOPCHECK(r, found, tag)						\
     ++count;								\
@@ -6,11 +6,13 @@
 #include <sstream>
 #include <cassert>
 
-#include "SeqLib/BamReader.h"
 #include "SeqLib/BamWriter.h"
 #include "SeqLib/GenomicRegionCollection.h"
 
 #include "bxcommon.h"
+#include "bxaux.h"
+#include "bxpipeline.h"
+#include "bxreader.h"
 
 static const char *CONVERT_USAGE_MESSAGE =
 "Usage: bxtools convert <BAM/SAM/CRAM> > converted.bam\n"
@@ -46,7 +48,7 @@ void runConvert(int argc, char** argv) {
 
     parseOptions(argc, argv);
 
-    SeqLib::BamReader reader;
+    BXReader reader;
     BXOPEN(reader, opt::bam);
     SeqLib::BamHeader hdr = reader.Header();
     
@@ -67,7 +69,7 @@ void runConvert(int argc, char** argv) {
 
     // Loop through file once to grab all BX tags and store in string to generate header
     ss << "@HD" << "\t" << "VN:1.4" << "  " << "GO:none\tSO:unsorted" << std::endl;  
-    while (reader.GetNextRecord(r)){
+    while (readRecord(reader, r)){
       read_bx(bx, r);
 
       BXLOOPCHECK(r, unique_bx > 1, opt::tag)
@@ -82,32 +84,42 @@ void runConvert(int argc, char** argv) {
     SeqLib::BamHeader bxbamheader (ss.str());
 
     w.Open("-");
+    attachThreadPool(w);
     w.SetHeader(bxbamheader);
     w.WriteHeader();
     
     //Loop through the BAM file again
     reader.Close();
-    SeqLib::BamReader reader2;
+    BXReader reader2;
     BXOPEN(reader2, opt::bam);
     
     if (opt::verbose)
       std::cerr << "...starting second pass to flip chr and BX" << std::endl;
 
-    while (reader2.GetNextRecord(r)){
-
-      read_bx(bx, r); // read the BX tag. Set default if not present
-      BXLOOPCHECK(r, true, opt::tag) // read and check we have a BX
-      r.SetChrID(bxtags[bx]);
-
-      r.SetChrIDMate(-1);
-      r.SetPosition(0);
-
-      if (opt::keeptags) 
-	r.AddZTag("CR", r.ChrID() >= 0 ? hdr.IDtoName(r.ChrID()) : "*"); 
-      else
-	r.RemoveAllTags();
-
-      w.WriteRecord(r);
+    // bxtags is complete after the first pass, and only read from here on
+    BXPipeline pipeline(reader2, w);
+    const bool ok = pipeline.Run([&](BXBatch& batch) {
+      std::string bx;
+      for (size_t i = 0; i < batch.records.size(); ++i) {
+	SeqLib::BamRecord& r = batch.records[i];
+	size_t count = batch.first + i;
+
+	read_bx(bx, r); // read the BX tag. Set default if not present
+	BXLOOPCHECK(r, true, opt::tag) // read and check we have a BX
+	r.SetChrID(bxtags.find(bx)->second);
+
+	r.SetChrIDMate(-1);
+	r.SetPosition(0);
+
+	if (opt::keeptags) 
+	  r.AddZTag("CR", r.ChrID() >= 0 ? hdr.IDtoName(r.ChrID()) : "*"); 
+	else
+	  r.RemoveAllTags();
+      }
+    });
+    if (!ok) {
+      std::cerr << "failed to write converted reads to BAM" << std::endl;
+      exit(EXIT_FAILURE);
     }
     w.Close();
   }
@@ -145,7 +157,10 @@ void parseOptions(int argc, char** argv) {
 }
 
 static void read_bx(std::string& bx, const SeqLib::BamRecord& r) {
-  if (!r.GetZTag(opt::tag, bx))
+  const BXAux a = scanAux(r.raw(), auxTag(opt::tag));
+  if (a.isString())
+    bx.assign(a.str(), a.len);
+  else
     bx = empty_tag;
   std::replace(bx.begin(), bx.end(), '-', '_');
   assert(!bx.empty());
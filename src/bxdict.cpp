@@ -0,0 +1,114 @@
+#include "bxdict.h"
+
+#include "bxbarcode.h"
+
+#include <cstring>
+
+static inline bool isPacked(uint64_t key) {
+  return (key >> 32) & 0x1f;
+}
+
+// finalizer from MurmurHash3, folded to 32 bits
+static inline uint32_t hashKey(uint64_t k) {
+  k ^= k >> 33;
+  k *= 0xff51afd7ed558ccdULL;
+  k ^= k >> 33;
+  k *= 0xc4ceb9fe1a85ec53ULL;
+  k ^= k >> 33;
+  return static_cast<uint32_t>(k);
+}
+
+// FNV-1a, folded to 32 bits. Barcodes are short, so this is cheap.
+static inline uint32_t hashString(const char* s, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; ++i) {
+    h ^= static_cast<unsigned char>(s[i]);
+    h *= 1099511628211ULL;
+  }
+  return static_cast<uint32_t>(h ^ (h >> 32));
+}
+
+BXDict::BXDict() : m_offsets(1, 0), m_slots(1024, 0) {}
+
+uint32_t BXDict::hashOf(uint32_t id) const {
+  const uint64_t key = m_keys[id];
+  if (isPacked(key))
+    return hashKey(key);
+  return hashString(m_chars.data() + m_offsets[key], m_offsets[key + 1] - m_offsets[key]);
+}
+
+// slot holding the key, or the empty slot where it would go
+size_t BXDict::probeKey(uint64_t key) const {
+  const size_t mask = m_slots.size() - 1;
+  size_t i = hashKey(key) & mask;
+  while (m_slots[i] && m_keys[m_slots[i] - 1] != key)
+    i = (i + 1) & mask;
+  return i;
+}
+
+size_t BXDict::probeString(const char* s, size_t len, uint32_t h) const {
+  const size_t mask = m_slots.size() - 1;
+  size_t i = h & mask;
+  for (; m_slots[i]; i = (i + 1) & mask) {
+    const uint64_t key = m_keys[m_slots[i] - 1];
+    if (isPacked(key))
+      continue;
+    const uint64_t beg = m_offsets[key];
+    if (m_offsets[key + 1] - beg == len && (len == 0 || !memcmp(&m_chars[beg], s, len)))
+      break;
+  }
+  return i;
+}
+
+uint32_t BXDict::add(size_t slot, uint64_t key) {
+  const uint32_t id = m_keys.size();
+  m_keys.push_back(key);
+  m_slots[slot] = id + 1;
+
+  // keep the load factor at or below one half
+  if (m_keys.size() * 2 > m_slots.size())
+    grow();
+  return id;
+}
+
+void BXDict::grow() {
+  std::vector<uint32_t> slots(m_slots.size() * 2, 0);
+  const size_t mask = slots.size() - 1;
+  for (uint32_t id = 0; id < m_keys.size(); ++id) {
+    size_t i = hashOf(id) & mask;
+    while (slots[i])
+      i = (i + 1) & mask;
+    slots[i] = id + 1;
+  }
+  m_slots.swap(slots);
+}
+
+uint32_t BXDict::intern(const char* s, size_t len) {
+
+  uint64_t key;
+  if (packBarcode(s, len, key)) {
+    const size_t i = probeKey(key);
+    return m_slots[i] ? m_slots[i] - 1 : add(i, key);
+  }
+
+  const size_t i = probeString(s, len, hashString(s, len));
+  if (m_slots[i])
+    return m_slots[i] - 1;
+  m_chars.insert(m_chars.end(), s, s + len);
+  m_offsets.push_back(m_chars.size());
+  return add(i, m_offsets.size() - 2);
+}
+
+uint32_t BXDict::find(const char* s, size_t len) const {
+  uint64_t key;
+  const size_t i = packBarcode(s, len, key) ? probeKey(key)
+    : probeString(s, len, hashString(s, len));
+  return m_slots[i] ? m_slots[i] - 1 : npos;
+}
+
+std::string BXDict::name(uint32_t id) const {
+  const uint64_t key = m_keys[id];
+  if (isPacked(key))
+    return unpackBarcode(key);
+  return std::string(m_chars.begin() + m_offsets[key], m_chars.begin() + m_offsets[key + 1]);
+}
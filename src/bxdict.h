@@ -0,0 +1,56 @@
+#ifndef BXTOOLS_DICT_H__
+#define BXTOOLS_DICT_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+// Interns barcode strings into dense 32-bit ids, handed out in order of
+// first appearance (0, 1, 2...). Per-barcode state can then live in flat
+// vectors indexed by id instead of string-keyed hash maps.
+//
+// 10X-style barcodes are stored as 64-bit packed keys (see bxbarcode.h),
+// so the table is keyed and compared on integers. Barcodes that don't
+// pack fall back to a string kept back to back in one buffer.
+class BXDict {
+
+ public:
+
+  static const uint32_t npos = UINT32_MAX;
+
+  BXDict();
+
+  // return the id of a barcode, adding it if not seen before
+  uint32_t intern(const char* s, size_t len);
+  uint32_t intern(const std::string& s) { return intern(s.data(), s.size()); }
+
+  // return the id of a barcode, or npos if it was never interned
+  uint32_t find(const char* s, size_t len) const;
+  uint32_t find(const std::string& s) const { return find(s.data(), s.size()); }
+
+  // the barcode string for an id
+  std::string name(uint32_t id) const;
+
+  size_t size() const { return m_keys.size(); }
+
+  bool empty() const { return m_keys.empty(); }
+
+ private:
+
+  // per id: the packed barcode, or the index of its fallback string
+  // (told apart by the base count field, which is 0 for strings)
+  std::vector<uint64_t> m_keys;
+
+  std::vector<char> m_chars;       // fallback strings, back to back
+  std::vector<uint64_t> m_offsets; // string i is [m_offsets[i], m_offsets[i+1])
+
+  std::vector<uint32_t> m_slots;   // open addressing table of id + 1 (0 is empty)
+
+  uint32_t hashOf(uint32_t id) const;
+  size_t probeKey(uint64_t key) const;
+  size_t probeString(const char* s, size_t len, uint32_t h) const;
+  uint32_t add(size_t slot, uint64_t key);
+  void grow();
+};
+
+#endif
@@ -0,0 +1,323 @@
+#include "bxexpr.h"
+#include "bxkernels.h"
+
+#include <algorithm>
+#include <cctype>
+#include <cstdlib>
+#include <cstring>
+
+void BXReadFields::walk() {
+
+  if (m_walked)
+    return;
+  m_walked = true;
+
+  // the leading and trailing soft clips are the runs of S at the very ends
+  // of the CIGAR, as SeqLib's AlignmentPosition() / AlignmentEndPosition()
+  // count them: a hard clip ends the run too, so 5H10S80M has none
+  const uint32_t* c = bam_get_cigar(m_b);
+  const uint32_t n = m_b->core.n_cigar;
+  bool leading = true; // only S ops so far
+  for (uint32_t i = 0; i < n; ++i) {
+    const uint32_t len = bam_cigar_oplen(c[i]);
+    const int op = bam_cigar_op(c[i]);
+    if (op == BAM_CSOFT_CLIP) {
+      m_soft += len;
+      if (leading)
+	m_lead += len;
+      else
+	m_trail += len;
+      continue;
+    }
+    leading = false;
+    m_trail = 0;
+    switch (op) {
+    case BAM_CHARD_CLIP:
+      m_hard += len;
+      break;
+    case BAM_CMATCH: case BAM_CEQUAL: case BAM_CDIFF:
+      m_match += len;
+      break;
+    case BAM_CINS:
+      m_max_ins = std::max(m_max_ins, len);
+      break;
+    case BAM_CDEL:
+      m_max_del = std::max(m_max_del, len);
+      break;
+    }
+  }
+  if (leading) // all soft clip: one run, at both ends
+    m_trail = m_lead;
+}
+
+double BXReadFields::meanQual() const {
+  if (m_b->core.l_qseq <= 0)
+    return -1;
+  return meanQual(0, m_b->core.l_qseq);
+}
+
+double BXReadFields::meanQual(int32_t beg, int32_t end) const {
+  if (end <= beg)
+    return 0;
+  const uint64_t sum = bxQualSum(bam_get_qual(m_b) + beg, end - beg);
+  return static_cast<double>(sum) / (end - beg);
+}
+
+enum BXField {
+  F_MAPQ, F_FLAG, F_LENGTH, F_ISIZE, F_SOFTCLIP, F_HARDCLIP, F_SOFTCLIP_FRAC, F_HARDCLIP_FRAC,
+  F_MAX_INS, F_MAX_DEL, F_MAX_INDEL, F_MATCH_BASES, F_MEAN_QUAL,
+  F_MAPPED, F_MATE_MAPPED, F_PAIRED, F_PROPER_PAIR, F_REVERSE, F_READ1, F_READ2,
+  F_PRIMARY, F_SECONDARY, F_SUPPLEMENTARY, F_DUPLICATE, F_QCFAIL, F_DECOY, F_SAME_CHROM,
+  F_COUNT
+};
+
+// in BXField order
+static const struct {
+  const char* name;
+  const char* help;
+} bx_fields[F_COUNT] = {
+  { "mapq",          "mapping quality" },
+  { "flag",          "SAM flag" },
+  { "length",        "read length (bases in SEQ)" },
+  { "isize",         "absolute insert size" },
+  { "softclip",      "soft clipped bases" },
+  { "hardclip",      "hard clipped bases" },
+  { "softclip_frac", "softclip / length" },
+  { "hardclip_frac", "hardclip / length" },
+  { "max_ins",       "longest insertion" },
+  { "max_del",       "longest deletion" },
+  { "max_indel",     "longest insertion or deletion" },
+  { "match_bases",   "bases in M/=/X operations" },
+  { "mean_qual",     "mean base quality (-1 without qualities)" },
+  { "mapped",        "flag bits, 1 or 0" },
+  { "mate_mapped",   "" },
+  { "paired",        "" },
+  { "proper_pair",   "" },
+  { "reverse",       "" },
+  { "read1",         "" },
+  { "read2",         "" },
+  { "primary",       "neither secondary nor supplementary" },
+  { "secondary",     "" },
+  { "supplementary", "" },
+  { "duplicate",     "" },
+  { "qcfail",        "" },
+  { "decoy",         "on a decoy or unplaced contig (hs*, *Un*)" },
+  { "same_chrom",    "on the same reference as the first read of its name" },
+};
+
+std::string BXFilterExpr::Help() {
+  std::string s;
+  for (int f = 0; f < F_COUNT; ++f) {
+    std::string line = "    ";
+    line += bx_fields[f].name;
+    line.resize(22, ' ');
+    s += line + bx_fields[f].help + "\n";
+  }
+  return s;
+}
+
+void BXFilterExpr::SetHeader(const bam_hdr_t* h) {
+  m_decoy.assign(h->n_targets, 0);
+  for (int32_t i = 0; i < h->n_targets; ++i) {
+    const char* name = h->target_name[i];
+    m_decoy[i] = !strncmp(name, "hs", 2) || strstr(name, "Un");
+  }
+}
+
+double BXFilterExpr::field(uint8_t f, const bam1_t* b, BXReadFields& rf, int32_t group_tid) const {
+
+  const bam1_core_t& c = b->core;
+  switch (f) {
+  case F_MAPQ:          return c.qual;
+  case F_FLAG:          return c.flag;
+  case F_LENGTH:        return c.l_qseq;
+  case F_ISIZE:         return c.isize < 0 ? -static_cast<double>(c.isize) : c.isize;
+  case F_SOFTCLIP:      return rf.softClip();
+  case F_HARDCLIP:      return rf.hardClip();
+  case F_SOFTCLIP_FRAC: return c.l_qseq ? rf.softClip() / static_cast<double>(c.l_qseq) : 0;
+  case F_HARDCLIP_FRAC: return c.l_qseq ? rf.hardClip() / static_cast<double>(c.l_qseq) : 0;
+  case F_MAX_INS:       return rf.maxInsertion();
+  case F_MAX_DEL:       return rf.maxDeletion();
+  case F_MAX_INDEL:     return std::max(rf.maxInsertion(), rf.maxDeletion());
+  case F_MATCH_BASES:   return rf.matchBases();
+  case F_MEAN_QUAL:     return rf.meanQual();
+  case F_MAPPED:        return !(c.flag & BAM_FUNMAP);
+  case F_MATE_MAPPED:   return !(c.flag & BAM_FMUNMAP);
+  case F_PAIRED:        return !!(c.flag & BAM_FPAIRED);
+  case F_PROPER_PAIR:   return !!(c.flag & BAM_FPROPER_PAIR);
+  case F_REVERSE:       return !!(c.flag & BAM_FREVERSE);
+  case F_READ1:         return !!(c.flag & BAM_FREAD1);
+  case F_READ2:         return !!(c.flag & BAM_FREAD2);
+  case F_PRIMARY:       return !(c.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY));
+  case F_SECONDARY:     return !!(c.flag & BAM_FSECONDARY);
+  case F_SUPPLEMENTARY: return !!(c.flag & BAM_FSUPPLEMENTARY);
+  case F_DUPLICATE:     return !!(c.flag & BAM_FDUP);
+  case F_QCFAIL:        return !!(c.flag & BAM_FQCFAIL);
+  case F_DECOY:         return c.tid >= 0 && static_cast<size_t>(c.tid) < m_decoy.size() && m_decoy[c.tid];
+  case F_SAME_CHROM:    return c.tid == group_tid;
+  }
+  return 0;
+}
+
+bool BXFilterExpr::Match(const bam1_t* b, int32_t group_tid) const {
+
+  BXReadFields rf(b);
+  bool acc = true;
+  for (size_t i = 0; i < m_ops.size();) {
+    const Op& op = m_ops[i];
+    switch (op.code) {
+    case TEST: {
+      const double v = field(op.field, b, rf, group_tid);
+      switch (op.cmp) {
+      case LT: acc = v < op.value; break;
+      case LE: acc = v <= op.value; break;
+      case GT: acc = v > op.value; break;
+      case GE: acc = v >= op.value; break;
+      case EQ: acc = v == op.value; break;
+      case NE: acc = v != op.value; break;
+      }
+      ++i;
+      break;
+    }
+    case NOT:
+      acc = !acc;
+      ++i;
+      break;
+    case JUMP_IF_FALSE:
+      i = acc ? i + 1 : op.target;
+      break;
+    case JUMP_IF_TRUE:
+      i = acc ? op.target : i + 1;
+      break;
+    }
+  }
+  return acc;
+}
+
+bool BXFilterExpr::Parse(const std::string& text, std::string& error) {
+
+  m_ops.clear();
+  m_p = text.c_str();
+  m_error.clear();
+
+  bool ok = parseOr();
+  skipSpace();
+  if (ok && *m_p)
+    ok = fail("unexpected '" + std::string(m_p) + "'");
+
+  if (!ok) {
+    error = m_error;
+    m_ops.clear();
+  }
+  m_p = nullptr;
+  return ok;
+}
+
+bool BXFilterExpr::fail(const std::string& why) {
+  if (m_error.empty())
+    m_error = why;
+  return false;
+}
+
+void BXFilterExpr::skipSpace() {
+  while (isspace(static_cast<unsigned char>(*m_p)))
+    ++m_p;
+}
+
+bool BXFilterExpr::accept(const char* tok) {
+  skipSpace();
+  const size_t n = strlen(tok);
+  if (strncmp(m_p, tok, n))
+    return false;
+  m_p += n;
+  return true;
+}
+
+// a || b: a, jump to the end if true, b
+bool BXFilterExpr::parseOr() {
+
+  if (!parseAnd())
+    return false;
+  std::vector<size_t> jumps;
+  while (accept("||")) {
+    jumps.push_back(m_ops.size());
+    m_ops.push_back({ JUMP_IF_TRUE, 0, LT, 0, 0 });
+    if (!parseAnd())
+      return false;
+  }
+  for (size_t j : jumps)
+    m_ops[j].target = m_ops.size();
+  return true;
+}
+
+// a && b: a, jump to the end if false, b
+bool BXFilterExpr::parseAnd() {
+
+  if (!parseUnary())
+    return false;
+  std::vector<size_t> jumps;
+  while (accept("&&")) {
+    jumps.push_back(m_ops.size());
+    m_ops.push_back({ JUMP_IF_FALSE, 0, LT, 0, 0 });
+    if (!parseUnary())
+      return false;
+  }
+  for (size_t j : jumps)
+    m_ops[j].target = m_ops.size();
+  return true;
+}
+
+bool BXFilterExpr::parseUnary() {
+
+  skipSpace();
+  if (*m_p == '!' && m_p[1] != '=') {
+    ++m_p;
+    if (!parseUnary())
+      return false;
+    m_ops.push_back({ NOT, 0, LT, 0, 0 });
+    return true;
+  }
+
+  if (accept("(")) {
+    if (!parseOr())
+      return false;
+    return accept(")") || fail("missing ')'");
+  }
+
+  // a field, and maybe a comparison
+  const char* beg = m_p;
+  while (isalnum(static_cast<unsigned char>(*m_p)) || *m_p == '_')
+    ++m_p;
+  const std::string name(beg, m_p);
+  if (name.empty())
+    return fail(*m_p ? "expected a field at '" + std::string(m_p) + "'" : "expected a field at the end");
+
+  int f = 0;
+  while (f < F_COUNT && name != bx_fields[f].name)
+    ++f;
+  if (f == F_COUNT)
+    return fail("unknown field '" + name + "'");
+
+  static const struct { const char* tok; Cmp cmp; } cmps[] = {
+    { "<=", LE }, { ">=", GE }, { "==", EQ }, { "!=", NE }, { "<", LT }, { ">", GT }
+  };
+  Op op = { TEST, static_cast<uint8_t>(f), NE, 0, 0 };
+  bool compared = false;
+  for (const auto& c : cmps) {
+    if (accept(c.tok)) {
+      op.cmp = c.cmp;
+      compared = true;
+      break;
+    }
+  }
+  if (compared) {
+    skipSpace();
+    char* end = nullptr;
+    op.value = strtod(m_p, &end);
+    if (end == m_p)
+      return fail("expected a number after " + name);
+    m_p = end;
+  }
+  m_ops.push_back(op);
+  return true;
+}
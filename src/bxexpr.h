@@ -0,0 +1,99 @@
+#ifndef BXTOOLS_EXPR_H__
+#define BXTOOLS_EXPR_H__
+
+#include <cstdint>
+#include <string>
+#include <vector>
+
+#include "htslib/sam.h"
+
+// Values of one read, straight from the bam1_t with no string copies.
+// The CIGAR ones are worked out in one walk, the first time one is asked for.
+class BXReadFields {
+
+ public:
+
+  explicit BXReadFields(const bam1_t* b) : m_b(b) {}
+
+  uint32_t softClip() { walk(); return m_soft; }
+  uint32_t hardClip() { walk(); return m_hard; }
+  uint32_t leadingSoftClip() { walk(); return m_lead; }   // S ops first in the CIGAR
+  uint32_t trailingSoftClip() { walk(); return m_trail; } // S ops last in it
+  uint32_t maxInsertion() { walk(); return m_max_ins; }
+  uint32_t maxDeletion() { walk(); return m_max_del; }
+  uint32_t matchBases() { walk(); return m_match; }
+
+  // of the whole read, -1 if it has no qualities
+  double meanQual() const;
+
+  // mean of the bases [beg, end) of the read
+  double meanQual(int32_t beg, int32_t end) const;
+
+ private:
+
+  void walk();
+
+  const bam1_t* m_b;
+  bool m_walked = false;
+  uint32_t m_soft = 0, m_hard = 0, m_lead = 0, m_trail = 0;
+  uint32_t m_max_ins = 0, m_max_del = 0, m_match = 0;
+};
+
+// A filter expression over the fields of a read, e.g.
+//
+//   mapq>=20 && softclip_frac<0.2 && !decoy && max_indel<=3
+//
+// with && || ! and parentheses, and comparisons < <= > >= == != of a field
+// against a number. A field on its own is true when it is not 0. The
+// text is parsed once into a flat program of field tests and jumps, which
+// Match() runs on each read, skipping the rest of an && or || once its
+// value is known.
+class BXFilterExpr {
+
+ public:
+
+  // false, with the reason in error, if the text doesn't parse
+  bool Parse(const std::string& text, std::string& error);
+
+  // for the fields that depend on the reference names (decoy)
+  void SetHeader(const bam_hdr_t* h);
+
+  // does the read pass? group_tid is the reference of the first read of
+  // its group, for same_chrom
+  bool Match(const bam1_t* b, int32_t group_tid) const;
+
+  // the fields, with a line on each, for usage messages
+  static std::string Help();
+
+ private:
+
+  enum Code : uint8_t { TEST, NOT, JUMP_IF_FALSE, JUMP_IF_TRUE };
+  enum Cmp : uint8_t { LT, LE, GT, GE, EQ, NE };
+
+  struct Op {
+    Code code;
+    uint8_t field;
+    Cmp cmp;
+    uint32_t target; // for jumps
+    double value;
+  };
+
+  double field(uint8_t f, const bam1_t* b, BXReadFields& rf, int32_t group_tid) const;
+
+  // recursive descent, emitting ops as it goes
+  bool parseOr();
+  bool parseAnd();
+  bool parseUnary();
+  bool fail(const std::string& why);
+  void skipSpace();
+  bool accept(const char* tok);
+
+  std::vector<Op> m_ops;
+  std::vector<char> m_decoy; // per reference
+
+  // parse state
+  const char* m_p = nullptr;
+  std::string m_error;
+};
+
+#endif
@@ -1,8 +1,14 @@
 #include "bxextract.h"
+#include "bxcommon.h"
+#include "bxaux.h"
+#include "bxindex.h"
+#include "bxfanout.h"
+#include "bxarena.h"
+#include "bxreader.h"
+#include "bxspill.h"
 #include <getopt.h>
 #include <iostream>
 #include <fstream>
-#include "SeqLib/BamReader.h"
 #include "SeqLib/BamWriter.h"
 #include "dirent.h"
 
@@ -32,7 +38,11 @@ static const char *STAT_USAGE_MESSAGE =
 
 static void parseOptions(int argc, char** argv);
 
-void fillBarcodeMap(std::unordered_map<std::string, std::vector<std::string>> &barcodes_to_filter, std::unordered_map<std::string, SeqLib::BamWriter> &writers,
+// bytes of matched records held across all lists before they are written
+// out (or --max-mem if set)
+static const size_t BX_EXTRACT_BUFFER = size_t(256) << 20;
+
+void fillBarcodeMap(std::unordered_map<std::string, std::vector<std::string>> &barcodes_to_filter,
                     std::vector<std::string> &filenames) {
 
 
@@ -56,7 +66,6 @@ void fillBarcodeMap(std::unordered_map<std::string, std::vector<std::string>> &b
                 break;
         }
         if (barcodes.size() > 5) {
-            writers[filename.substr(0,filename.length() - 4)] = SeqLib::BamWriter();
             filenames.push_back(filename.substr(0,filename.length() - 4));
             for (auto barcode : barcodes) {
                 barcodes_to_filter[barcode].push_back(filename.substr(0,filename.length() - 4));
@@ -69,64 +78,95 @@ void runExtract(int argc, char** argv) {
     parseOptions(argc, argv);
 
     // open the BAM
-    SeqLib::BamReader reader;
+    BXReader reader;
     if (!reader.Open(opt::bam)) {
         std::cerr << "Failed to open bam: " << opt::bam << std::endl;
         exit(EXIT_FAILURE);
     }
+    attachThreadPool(reader);
 
     std::unordered_map<std::string, std::vector<std::string>> barcodes_to_filter;
-    std::unordered_map<std::string, SeqLib::BamWriter> writers;
-    std::unordered_map<std::string, std::vector<SeqLib::BamRecord > > records;
     std::vector<std::string> filenames;
-    fillBarcodeMap(barcodes_to_filter, writers, filenames);
-
-    for (auto& writer : writers) {
-        writer.second.Open(opt::folder_with_small_bams + writer.first + ".bam");
-        writer.second.SetHeader(reader.Header());
-        writer.second.WriteHeader();
-        writer.second.Close();
-    }
-
+    fillBarcodeMap(barcodes_to_filter, filenames);
+
+    // Matched records are held per barcode list and written out whenever
+    // they pass the buffer size, like the old 10M-read cycle: each list is an
+    // output of the fan-out for one flush, compressed and written on the -@
+    // threads, opened and closed again, so only the lists being written have
+    // a file open. The first flush creates every list's BAM, even if none of
+    // its barcodes are found; later ones append to it.
+    std::unordered_map<std::string, size_t> list_ids;
+    for (size_t i = 0; i < filenames.size(); ++i)
+        list_ids[filenames[i]] = i;
+    std::unordered_map<std::string, std::vector<size_t>> barcode_lists;
+    for (const auto& b : barcodes_to_filter)
+        for (const auto& f : b.second)
+            barcode_lists[b.first].push_back(list_ids[f]);
+
+    const size_t buffer_size = memoryBudget() ? memoryBudget() : BX_EXTRACT_BUFFER;
+    std::vector<BXRecordArena> pending(filenames.size());
+    size_t pending_bytes = 0;
+    bool created = false;
+    BXFanout fanout(reader.Header());
+    auto flush = [&]() {
+        // the last flush's outputs are the same files: they must be closed
+        // before they are opened again to append
+        if (created)
+            fanout.Wait();
+        bam1_t b;
+        for (size_t i = 0; i < filenames.size(); ++i) {
+            if (created && pending[i].empty())
+                continue;
+            const size_t out = fanout.Add(opt::folder_with_small_bams + filenames[i] + ".bam", created);
+            for (size_t j = 0; j < pending[i].size(); ++j) {
+                pending[i].view(j, b);
+                fanout.Write(out, &b);
+            }
+            fanout.Finish(out);
+            BXRecordArena().swap(pending[i]);
+        }
+        created = true;
+        pending_bytes = 0;
+    };
+
+    // with a barcode index, seek to the reads of the barcodes instead of a full pass
+    std::unordered_set<std::string> wanted;
+    for (const auto& b : barcodes_to_filter)
+        wanted.insert(b.first);
+    BXIndex index;
+    BXFetcher fetcher;
+    const bool indexed = index.Load(indexFile(opt::bam), &wanted) && index.Tag() == "BX" &&
+        fetcher.Open(opt::bam, index, wanted);
+    if (indexed)
+        std::cerr << "...fetching barcodes with index " << indexFile(opt::bam) << std::endl;
 
     // loop and filter
+    const uint16_t bx_tag = auxTag("BX");
+    std::string bx;
     SeqLib::BamRecord r;
     size_t count = 0;
-    while (reader.GetNextRecord(r)) {
+    while (indexed ? fetcher.GetNextRecord(r) : readRecord(reader, r)) {
         count++;
         if (count % 100000 == 0)
             std::cout << count << " alignments are processed" << std::endl;
-        std::string bx;
-        bool tag_present = r.GetZTag("BX", bx);
-        if (!tag_present)
+        const BXAux a = scanAux(r.raw(), bx_tag);
+        if (!a.isString())
             continue;
+        bx.assign(a.str(), a.len);
 
-        for (auto ids : barcodes_to_filter[bx]) {
-            records[ids].push_back(r);
-        }
-        if (count % 10000000 == 0) {
-            #pragma omp parallel
-            #pragma omp for
-            for (size_t i = 0; i < filenames.size(); ++i) {
-                auto &writer = writers[filenames[i]];
-                writer.Open(opt::folder_with_small_bams + filenames[i] + ".bam", "ab");
-                for (auto& rec : records[filenames[i]]) {
-                    writer.WriteRecord(rec);
-                }
-                writer.Close();
-                records[filenames[i]].clear();
+        auto it = barcode_lists.find(bx);
+        if (it != barcode_lists.end()) {
+            for (const auto list : it->second) {
+                pending[list].push_back(r.raw());
+                pending_bytes += sizeof(bam1_core_t) + r.raw()->l_data;
             }
+            if (pending_bytes >= buffer_size)
+                flush();
         }
     }
-    for (auto& writer : writers) {
-        writer.second.Open(opt::folder_with_small_bams + writer.first + ".bam", "ab");
-        for (auto& rec : records[writer.first]) {
-            writer.second.WriteRecord(rec);
-        }
-        writer.second.Close();
-        records[writer.first].clear();
-    }
-
+    flush();
+    if (!fanout.Close())
+        exit(EXIT_FAILURE);
 
 }
 
@@ -0,0 +1,202 @@
+#include "bxfanout.h"
+
+#include <iostream>
+
+#include "bxthreads.h"
+#include "bxprofile.h"
+
+BXFanout::BXFanout(const SeqLib::BamHeader& h) : m_hdr(h), m_failed(false) {
+  const int n = threadCount();
+  if (n > 1) {
+    m_max_waiting = 4 * n;
+    for (int i = 0; i < n; ++i)
+      m_workers.emplace_back(&BXFanout::work, this);
+  }
+}
+
+BXFanout::~BXFanout() {
+  Close();
+}
+
+size_t BXFanout::Add(const std::string& file, bool append) {
+
+  size_t slot;
+  {
+    std::lock_guard<std::mutex> lock(m_mutex);
+    if (m_done.empty()) {
+      slot = m_outputs.size();
+      m_outputs.push_back(Output());
+    } else {
+      slot = m_done.back();
+      m_done.pop_back();
+    }
+  }
+
+  // a closed output is no longer touched by the workers
+  Output& o = m_outputs[slot];
+  o = Output();
+  o.slot = slot;
+  o.file = file;
+  o.append = append;
+  return slot;
+}
+
+void BXFanout::Write(size_t out, const bam1_t* b) {
+  Output& o = m_outputs[out];
+  o.pending.push_back(b);
+  if (o.pending.size() >= m_batch_size)
+    submit(o, false);
+}
+
+void BXFanout::Finish(size_t out) {
+  Output& o = m_outputs[out];
+  if (!o.finish)
+    submit(o, true);
+}
+
+void BXFanout::Wait() {
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_idle.wait(lock, [&] { return m_closing == 0; });
+}
+
+bool BXFanout::Close() {
+
+  for (auto& o : m_outputs)
+    if (!o.finish)
+      submit(o, true);
+
+  if (!m_workers.empty()) {
+    {
+      std::lock_guard<std::mutex> lock(m_mutex);
+      m_stop = true;
+    }
+    m_work.notify_all();
+    for (auto& t : m_workers)
+      t.join();
+    m_workers.clear();
+  }
+
+  return !m_failed;
+}
+
+// hand the pending records of an output to the workers (or write them)
+void BXFanout::submit(Output& o, bool finish) {
+
+  if (m_workers.empty()) {
+    if (!o.pending.empty() || !o.open)
+      write(o, o.pending);
+    o.pending.clear();
+    o.finish = finish;
+    if (finish) {
+      close(o);
+      m_done.push_back(o.slot);
+    }
+    return;
+  }
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  m_space.wait(lock, [&] { return m_waiting < m_max_waiting; });
+  o.queued.push_back(Batch());
+  o.queued.back().swap(o.pending);
+  if (!finish && !m_free.empty()) {
+    o.pending.swap(m_free.back());
+    m_free.pop_back();
+  }
+  o.finish = finish;
+  if (finish)
+    ++m_closing;
+  ++m_waiting;
+  if (!o.scheduled) {
+    o.scheduled = true;
+    m_ready.push_back(&o);
+    m_work.notify_one();
+  }
+}
+
+bool BXFanout::write(Output& o, const Batch& b) {
+
+  if (o.closed)
+    return false;
+
+  BXTimer t(STAGE_WRITE);
+
+  if (!o.open) {
+    o.fp = sam_open(o.file.c_str(), o.append ? "ab" : "wb");
+    bool ok = o.fp;
+    if (ok && !o.append) {
+      std::lock_guard<std::mutex> lock(m_hdr_mutex);
+      ok = sam_hdr_write(o.fp, m_hdr.get_()) >= 0;
+    }
+    if (!ok) {
+      std::cerr << "Could not open BAM: " << o.file << std::endl;
+      m_failed = true;
+      close(o);
+      return false;
+    }
+    o.open = true;
+  }
+
+  // straight from the arena, no copy
+  bam1_t r;
+  for (size_t i = 0; i < b.size(); ++i) {
+    b.view(i, r);
+    if (sam_write1(o.fp, m_hdr.get_(), &r) < 0) {
+      std::cerr << "failed to write read " << bam_get_qname(&r) << " to BAM " << o.file << std::endl;
+      m_failed = true;
+      return false;
+    }
+  }
+  return true;
+}
+
+void BXFanout::close(Output& o) {
+  if (o.fp && sam_close(o.fp) < 0) {
+    std::cerr << "Failed to close BAM: " << o.file << std::endl;
+    m_failed = true;
+  }
+  o.fp = nullptr;
+  o.closed = true;
+}
+
+// take an output off the ready list and write its batches until there are
+// none left, then look for another
+void BXFanout::work() {
+
+  std::unique_lock<std::mutex> lock(m_mutex);
+  for (;;) {
+    m_work.wait(lock, [&] { return m_stop || !m_ready.empty(); });
+    if (m_ready.empty())
+      return;
+    Output& o = *m_ready.front();
+    m_ready.pop_front();
+
+    while (!o.queued.empty()) {
+      Batch b;
+      b.swap(o.queued.front());
+      o.queued.erase(o.queued.begin());
+      lock.unlock();
+      write(o, b);
+      b.clear();
+      lock.lock();
+      if (m_free.size() < m_max_waiting) {
+	m_free.push_back(Batch());
+	m_free.back().swap(b);
+      }
+      --m_waiting;
+      m_space.notify_one();
+    }
+
+    // nothing more will be queued once finished, and the slot can go to
+    // the next output
+    o.scheduled = false;
+    if (o.finish) {
+      lock.unlock();
+      close(o);
+      lock.lock();
+      std::vector<Batch>().swap(o.queued);
+      m_done.push_back(o.slot);
+      if (--m_closing == 0)
+	m_idle.notify_all();
+    }
+  }
+}
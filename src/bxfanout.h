@@ -0,0 +1,106 @@
+#ifndef BXTOOLS_FANOUT_H__
+#define BXTOOLS_FANOUT_H__
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "htslib/sam.h"
+#include "SeqLib/BamHeader.h"
+#include "SeqLib/BamRecord.h"
+
+#include "bxarena.h"
+
+// Writes one input out to many BAMs (split, extract), with the BGZF
+// deflate and the writes done by -@ worker threads. Records are copied
+// per output into record arenas on the calling thread and handed over in
+// batches; written batches go back to a free list for reuse. An output
+// is held by one worker at a time, which writes its batches in the order
+// they were handed over, so every file gets its records in input order.
+// The number of batches waiting is bounded, which bounds memory. With -@ 1
+// batches are written inline.
+//
+// All outputs share one header. A file is opened when its first batch is
+// written and closed once it is finished (or at Close()). The slot of a
+// closed output is reused by the next Add(), so memory grows with the
+// outputs in flight, not with the number of files written.
+class BXFanout {
+
+ public:
+
+  explicit BXFanout(const SeqLib::BamHeader& h);
+  ~BXFanout();
+
+  // records per batch [4096]
+  void SetBatchSize(size_t n) { m_batch_size = n ? n : 1; }
+
+  // A new output file; returns its number, which is only good until the
+  // output is finished. With append, the records go on the end of an
+  // existing BAM, with no header.
+  size_t Add(const std::string& file, bool append = false);
+
+  void Write(size_t out, const bam1_t* b);
+
+  void Write(size_t out, const SeqLib::BamRecord& r) { Write(out, r.raw()); }
+
+  // no more records for this output; it is closed once written
+  void Finish(size_t out);
+
+  // wait until every finished output is written and closed, eg before
+  // adding another output for the same file
+  void Wait();
+
+  // finish every output and wait for the writes. False if any failed
+  bool Close();
+
+ private:
+
+  BXFanout(const BXFanout&);
+  BXFanout& operator=(const BXFanout&);
+
+  typedef BXRecordArena Batch;
+
+  struct Output {
+    size_t slot = 0;
+    std::string file;
+    bool append = false;
+    htsFile* fp = nullptr;
+    bool open = false;
+    bool closed = false;
+    Batch pending;             // calling thread only
+    std::vector<Batch> queued; // the rest under m_mutex; empty, it holds no memory
+    bool scheduled = false;    // on m_ready or held by a worker
+    bool finish = false;
+  };
+
+  void submit(Output& o, bool finish);
+  bool write(Output& o, const Batch& b);
+  void close(Output& o);
+  void work();
+
+  SeqLib::BamHeader m_hdr;
+  size_t m_batch_size = 4096;
+
+  std::deque<Output> m_outputs; // a deque so that adding never moves one
+  std::vector<size_t> m_done;    // slots of closed outputs, under m_mutex
+
+  std::vector<std::thread> m_workers;
+  std::mutex m_mutex;
+  std::condition_variable m_work;  // a batch was queued, or stopping
+  std::condition_variable m_space; // a batch was written
+  std::condition_variable m_idle;  // a finished output was closed
+  std::deque<Output*> m_ready;
+  std::vector<Batch> m_free;       // written batches, for reuse
+  std::mutex m_hdr_mutex;          // sam_hdr_write may touch the header
+  size_t m_waiting = 0;            // queued batches, not yet written
+  size_t m_max_waiting = 0;
+  size_t m_closing = 0;            // finished outputs, not yet closed
+  bool m_stop = false;
+  std::atomic<bool> m_failed;
+};
+
+#endif
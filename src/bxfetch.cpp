@@ -0,0 +1,126 @@
+#include "bxfetch.h"
+
+#include <fstream>
+#include <getopt.h>
+#include <iostream>
+#include <sstream>
+#include <unordered_set>
+
+#include "SeqLib/BamWriter.h"
+
+#include "bxcommon.h"
+#include "bxindex.h"
+
+namespace opt {
+
+  static std::string bam;      // the indexed bam
+  static std::string index;    // default <bam>.bxi
+  static std::string barcodes; // file with one barcode per line
+  static bool verbose = false;
+}
+
+static const char* shortopts = "hvi:b:";
+static const struct option longopts[] = {
+  { "help",                    no_argument, NULL, 'h' },
+  { "verbose",                 no_argument, NULL, 'v' },
+  { "index",                   required_argument, NULL, 'i' },
+  { "barcodes",                required_argument, NULL, 'b' },
+  { NULL, 0, NULL, 0 }
+};
+
+static const char *FETCH_USAGE_MESSAGE =
+"Usage: bxtools fetch <BAM> [barcode ...] > out.bam\n"
+"Description: Write the reads of the given barcodes, seeking to them with the\n"
+"             barcode index made by bxtools index\n"
+"\n"
+"  General options\n"
+"  -v, --verbose                        Set verbose output\n"
+"  -h, --help                           Display this help and exit\n"
+"  -i, --index                          Barcode index. Default: <BAM>.bxi\n"
+"  -b, --barcodes                       File with barcodes to fetch, one per line\n"
+"\n";
+
+static std::unordered_set<std::string> wanted;
+
+static void parseOptions(int argc, char** argv);
+
+void runFetch(int argc, char** argv) {
+
+  parseOptions(argc, argv);
+
+  if (opt::index.empty())
+    opt::index = indexFile(opt::bam);
+
+  if (!opt::barcodes.empty()) {
+    std::ifstream in(opt::barcodes.c_str());
+    if (!in) {
+      std::cerr << "Failed to open barcode list: " << opt::barcodes << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    std::string bx;
+    while (in >> bx)
+      wanted.insert(bx);
+  }
+
+  BXIndex index;
+  if (!index.Load(opt::index, &wanted)) {
+    std::cerr << "Failed to read barcode index: " << opt::index 
+	      << " (make it with bxtools index)" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (opt::verbose)
+    std::cerr << "...found " << index.size() << " of " << wanted.size() << " barcodes in the index" << std::endl;
+
+  BXFetcher fetcher;
+  if (!fetcher.Open(opt::bam, index, wanted)) {
+    std::cerr << "Failed to open bam: " << opt::bam << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  SeqLib::BamWriter w;
+  if (!w.Open("-")) {
+    std::cerr << "Failed to open output stream" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  attachThreadPool(w);
+  w.SetHeader(fetcher.Header());
+  w.WriteHeader();
+
+  SeqLib::BamRecord r;
+  while (fetcher.GetNextRecord(r))
+    writeRecord(w, r);
+  w.Close();
+}
+
+static void parseOptions(int argc, char** argv) {
+
+  bool die = false;
+  bool help = false;
+
+  if (argc < 2)
+    die = true;
+  else
+    opt::bam = std::string(argv[1]);
+
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v': opt::verbose = true; break;
+    case 'h': help = true; break;
+    case 'i': arg >> opt::index; break;
+    case 'b': arg >> opt::barcodes; break;
+    }
+  }
+
+  // barcodes can also be given after the BAM
+  for (int i = optind + 1; i < argc; ++i)
+    wanted.insert(argv[i]);
+
+  if (opt::barcodes.empty() && wanted.empty())
+    die = true;
+
+  if (die || help) {
+    std::cerr << "\n" << FETCH_USAGE_MESSAGE;
+    die ? exit(EXIT_FAILURE) : exit(EXIT_SUCCESS);
+  }
+}
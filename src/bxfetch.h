@@ -0,0 +1,6 @@
+#ifndef BXTOOLS_FETCH_H__
+#define BXTOOLS_FETCH_H__
+
+void runFetch(int argc, char** argv);
+
+#endif
@@ -1,8 +1,16 @@
 #include "bxfilter.h"
+#include "bxcommon.h"
+#include "bxpipeline.h"
+#include "bxreader.h"
+#include "bxexpr.h"
+#include "bxcollate.h"
 #include <getopt.h>
 #include <iostream>
 #include <fstream>
-#include "SeqLib/BamReader.h"
+#include <atomic>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
 #include "SeqLib/BamWriter.h"
 
 namespace opt {
@@ -13,20 +21,25 @@ namespace opt {
     static double max_soft_clipping = 1.0;
     static double max_hard_clipping = 1.0;
     static bool filter_bad = false;
+    static std::string expr; // replaces -q -s -c and the indel / chromosome checks
+    static bool collate = false; // group by read name first, whatever the sort order
 }
 
-static const char* shortopts = "c:q:s:hvb";
+static const char* shortopts = "c:q:s:hvbe:C";
 static const struct option longopts[] = {
         { "help",                    no_argument, NULL, 'h' },
-        { NULL, 0, NULL, 0 },
-        {"mapping_quality", optional_argument, NULL, 'q'},
-        {"max_soft_clipping", optional_argument, NULL, 's'},
-        {"max_hard_clipping", optional_argument, NULL, 'c'},
-        {"filter_bad", optional_argument, NULL, 'b'}
+        { "verbose",                 no_argument, NULL, 'v' },
+        {"mapping_quality", required_argument, NULL, 'q'},
+        {"max_soft_clipping", required_argument, NULL, 's'},
+        {"max_hard_clipping", required_argument, NULL, 'c'},
+        {"filter_bad", no_argument, NULL, 'b'},
+        {"expr", required_argument, NULL, 'e'},
+        {"collate", no_argument, NULL, 'C'},
+        { NULL, 0, NULL, 0 }
 };
 
 
-static const char *STAT_USAGE_MESSAGE =
+static const std::string STAT_USAGE_MESSAGE =
         "Usage: bxtools filter in.bam -q X > out.bam\n"
                 "Description: Extract all reads from in.bam that satisfy parameters \n"
                 "\n"
@@ -35,46 +48,68 @@ static const char *STAT_USAGE_MESSAGE =
                 "-s, --max_soft_clipping                  Filter read pairs with any read with portion of soft clipped pairs more than [s]\n"
                 "-c, --max_hard_clipping                  Filter read pairs with any read with portion of hard clipped pairs more than [c]\n"
                 "-b, --filter_bad                         Filter read pairs that don't satisfy given conditions\n"
+                "-e, --expr                               Keep read pairs whose every read matches this expression instead, e.g.\n"
+                "                                         'mapq>=20 && softclip_frac<0.2 && !decoy && max_indel<=3'\n"
+                "                                         Default: mapq>=q && softclip_frac<=s && hardclip_frac<=c &&\n"
+                "                                         max_indel<=3 && same_chrom\n"
+                "-C, --collate                            Group the reads by name first, for input that isn't.\n"
+                "                                         Coordinate-sorted input (SO:coordinate) is always collated,\n"
+                "                                         within --max-mem, spilling to $TMPDIR past it\n"
                 "  -v, --verbose                          Set verbose output\n"
+                "\n"
+                "  Expressions combine comparisons (< <= > >= == !=) of these fields with && || ! and ( ).\n"
+                "  A field on its own is true when it is not 0\n"
+                + BXFilterExpr::Help() +
                 "\n";
 
-static void parseOptions(int argc, char** argv);
-static bool CheckConditions(const std::vector<SeqLib::BamRecord> &records);
-static bool AdditionalChecks(const SeqLib::BamRecord &record);
+// the records of one read name, a range of a batch rather than a copy
+struct RecordGroup {
+    const SeqLib::BamRecord* first;
+    const SeqLib::BamRecord* last;
+    const SeqLib::BamRecord* begin() const { return first; }
+    const SeqLib::BamRecord* end() const { return last; }
+    const SeqLib::BamRecord& operator[](size_t i) const { return first[i]; }
+};
 
+// compiled from opt::expr, or from -q -s -c
+static BXFilterExpr keep_expr;
 
+// for -b
+static BXFilterExpr good_quality_expr;
+static BXFilterExpr decoy_or_unmapped_expr;
+static BXFilterExpr soft_clipped_expr;
+
+static void parseOptions(int argc, char** argv);
+static bool CheckConditions(const RecordGroup &records);
+static bool CheckBad(const RecordGroup &records);
+static bool AdditionalChecks(const bam1_t* b, BXReadFields &fields);
+
+static void compile(BXFilterExpr& e, const std::string& text, const bam_hdr_t* h) {
+    std::string error;
+    if (!e.Parse(text, error)) {
+        std::cerr << "Bad filter expression '" << text << "': " << error << std::endl;
+        exit(EXIT_FAILURE);
+    }
+    e.SetHeader(h);
+}
 
-static bool AdditionalChecks(const SeqLib::BamRecord &record) {
-    if (record.NumMatchBases() < 50) {
+static bool AdditionalChecks(const bam1_t* b, BXReadFields &fields) {
+    if (fields.matchBases() < 50) {
         return false;
     }
-    if (record.AlignmentPosition() > 25 && record.Length() - record.AlignmentEndPosition() > 25) {
+    if (fields.leadingSoftClip() > 25 && fields.trailingSoftClip() > 25) {
         return false;
     }
 
-    auto quals = record.Qualities();
-    int start_pos = record.AlignmentPosition();
-    int end_pos = record.AlignmentEndPosition();
-    size_t sum_front = 0;
-    if (start_pos != 0) {
-        for (int i = 0; i < start_pos; ++i) {
-            sum_front += (int)quals[i];
-        }
-
-        if (sum_front / start_pos < 33 + 31) {
-            return false;
-        }
-
+    // the clipped ends must be of good quality too
+    const int32_t len = b->core.l_qseq;
+    const int32_t start_pos = fields.leadingSoftClip();
+    const int32_t end_pos = len - fields.trailingSoftClip();
+    if (start_pos != 0 && fields.meanQual(0, start_pos) < 31) {
+        return false;
     }
-    size_t sum_back = 0;
-    if (end_pos != quals.length()) {
-        for (int i = end_pos; i < quals.length(); ++i) {
-            sum_back += (int)quals[i];
-        }
-
-        if (sum_back / (quals.length() - end_pos) < 33 + 31) {
-            return false;
-        }
+    if (end_pos != len && fields.meanQual(end_pos, len) < 31) {
+        return false;
     }
 
     return true;
@@ -84,164 +119,124 @@ void runFilter(int argc, char** argv) {
     parseOptions(argc, argv);
 
     // open the BAM
-    SeqLib::BamReader reader;
+    BXReader reader;
     if (!reader.Open(opt::bam)) {
         std::cerr << "Failed to open bam: " << opt::bam << std::endl;
         exit(EXIT_FAILURE);
     }
+    attachThreadPool(reader);
+    if (opt::collate || coordinateSorted(reader.Header())) {
+        std::cerr << "Collating reads by name" << std::endl;
+        reader.Collate();
+    }
     SeqLib::BamWriter writer;
     writer.Open("-");
-    writer.SetHeader(reader.Header());
+    attachThreadPool(writer);
+    writer.SetHeader(reader.Collating() ? collatedHeader(reader.Header()) : reader.Header());
     writer.WriteHeader();
+
+    const bam_hdr_t* hdr = reader.Header().get_();
+    if (opt::filter_bad) {
+        std::ostringstream soft;
+        soft << std::setprecision(15) << "softclip_frac>" << opt::max_soft_clipping;
+        compile(good_quality_expr, "mean_qual>=31", hdr);
+        compile(decoy_or_unmapped_expr, "decoy || !mapped", hdr);
+        compile(soft_clipped_expr, soft.str(), hdr);
+    } else {
+        if (opt::expr.empty()) {
+            std::ostringstream e;
+            e << std::setprecision(15) << "mapq>=" << opt::mapping_quality
+              << " && softclip_frac<=" << opt::max_soft_clipping
+              << " && hardclip_frac<=" << opt::max_hard_clipping
+              << " && max_indel<=3 && same_chrom";
+            opt::expr = e.str();
+        }
+        compile(keep_expr, opt::expr, hdr);
+    }
+
     // loop and filter
-    SeqLib::BamRecord r1;
-    size_t count = 0;
+    std::atomic<size_t> count(0);
     std::cerr << "Max-soft-clipping " << opt::max_soft_clipping << std::endl;
     std::cerr << "Filter bad: " << opt::filter_bad << std::endl;
-
-    std::string read_id = "";
-    std::vector<SeqLib::BamRecord> bam_records;
-    while (reader.GetNextRecord(r1)) {
-        if (read_id == r1.Qname()) {
-            bam_records.push_back(r1);
-        } else {
-            if (CheckConditions(bam_records)) {
-                count++;
-                if (count % 100000 == 0) {
-                    std::cerr << count << " filtered" << std::endl;
-                }
-                for (const auto& record : bam_records) {
-                    writer.WriteRecord(record);
+    if (!opt::filter_bad)
+        std::cerr << "Filter: " << opt::expr << std::endl;
+
+    // batches always end on a read name boundary, so every group of
+    // records with the same name is checked as a whole
+    BXPipeline pipeline(reader, writer);
+    pipeline.GroupByName(true);
+    const bool ok = pipeline.Run([&](BXBatch& batch) {
+        for (size_t i = 0; i < batch.records.size();) {
+            const char* read_id = bam_get_qname(batch.records[i].raw());
+            size_t j = i + 1;
+            while (j < batch.records.size() && !strcmp(bam_get_qname(batch.records[j].raw()), read_id))
+                ++j;
+            const RecordGroup group = { &batch.records[i], &batch.records[0] + j };
+            if (opt::filter_bad ? CheckBad(group) : CheckConditions(group)) {
+                const size_t n = ++count;
+                if (n % 100000 == 0) {
+                    std::cerr << n << " filtered" << std::endl;
                 }
+            } else {
+                std::fill(batch.keep.begin() + i, batch.keep.begin() + j, 0);
             }
-            bam_records.clear();
-            bam_records.push_back(r1);
-            read_id = r1.Qname();
-        }
-    }
-    if (CheckConditions(bam_records)) {
-        if (count % 100000 == 0) {
-            std::cerr << count << " filtered" << std::endl;
-        }
-        for (const auto& record : bam_records) {
-            writer.WriteRecord(record);
+            i = j;
         }
+    });
+    if (!ok) {
+        std::cerr << "failed to write filtered reads to BAM" << std::endl;
+        exit(EXIT_FAILURE);
     }
 }
 
-static bool DecoyOrUnmapped(const std::string &chr_name) {
-    if (chr_name.substr(0, 2) == "hs") {
-        return true;
-    }
-    if (chr_name.find("Un") != std::string::npos) {
-        return true;
+// every read of the group matches the expression
+static bool CheckConditions(const RecordGroup &records) {
+    const int32_t tid = records[0].raw()->core.tid;
+    for (const auto &record : records) {
+        if (!keep_expr.Match(record.raw(), tid)) {
+            return false;
+        }
     }
-    return false;
+    return true;
 }
 
-static bool CheckConditions(const std::vector<SeqLib::BamRecord> &records) {
-    if (!opt::filter_bad) {
-        for (const auto &record : records) {
-            if (record.MapQuality() < opt::mapping_quality) {
-                return false;
-            }
-        }
-        for (const auto &record : records) {
-            if (record.NumSoftClip()/(double)record.Length() > opt::max_soft_clipping) {
-                return false;
-            }
-        }
-
-        for (const auto &record : records) {
-            if (record.NumHardClip()/(double)record.Length() > opt::max_hard_clipping) {
-                return false;
-            }
-        }
-
-        for (const auto &record : records) {
-            if (record.MaxInsertionBases() > 3 || record.MaxDeletionBases() > 3) {
-                return false;
-            }
-        }
-
+// Keep groups of good quality that are unmapped or on a decoy, and soft
+// clipped groups on one chromosome whose reads pass AdditionalChecks. All
+// in one pass over the group.
+static bool CheckBad(const RecordGroup &records) {
+    const int32_t tid = records[0].raw()->core.tid;
+    bool all_good_quality = true;
+    bool decoyed_or_unmapped = false;
+    bool soft_clipped = false;
+    bool same_chrom = true;
+    bool additional = true;
+    for (const auto &record : records) {
+        const bam1_t* b = record.raw();
+        BXReadFields fields(b);
+        all_good_quality = all_good_quality && good_quality_expr.Match(b, tid);
+        decoyed_or_unmapped = decoyed_or_unmapped || decoy_or_unmapped_expr.Match(b, tid);
+        soft_clipped = soft_clipped || soft_clipped_expr.Match(b, tid);
+        same_chrom = same_chrom && b->core.tid == tid;
+        additional = additional && AdditionalChecks(b, fields);
+    }
 
-        std::vector<std::string> chrom;
-        for (const auto &record : records) {
-            chrom.push_back(record.ChrName());
+    if (all_good_quality && decoyed_or_unmapped) {
+        if (opt::verbose) {
+            std::cerr << "Filtered: read mapped to decoy or unmapped with good quality" << std::endl;
+            std::cerr << "MeanPhred - " << records[0].MeanPhred() << std::endl;
+            std::cerr << "Sequence - " << records[0].Sequence() << std::endl;
         }
-        if (chrom.size()) {
-            bool allAreEqual =
-                    find_if(chrom.begin() + 1,
-                            chrom.end(),
-                            bind1st(std::not_equal_to<std::string>(), chrom.front())) == chrom.end();
-
-            if (!allAreEqual) {
-                return false;
-            }
-        }
-
-
         return true;
-    } else {
-        bool is_unmapped = false;
-        bool is_decoyed = false;
-        bool all_good_quality = true;
-        for (const auto &record : records) {
-            if (record.MeanPhred() < 31.0) {
-                all_good_quality = false;
-                break;
-            }
-            if (!record.MappedFlag()) {
-                is_unmapped = true;
-            }
-            if (DecoyOrUnmapped(record.ChrName())) {
-                is_decoyed = true;
-            }
-        }
-        if (all_good_quality) {
-            if (is_decoyed || is_unmapped) {
-                if (opt::verbose) {
-                    std::cerr << "Filtered: read mapped to decoy or unmapped with good quality" << std::endl;
-                    std::cerr << "MeanPhred - " << records[0].MeanPhred() << std::endl;
-                    std::cerr << "Sequence - " << records[0].Sequence() << std::endl;
-                }
-                return true;
-            }
-        }
-        for (const auto &record : records) {
-            if (record.NumSoftClip()/(double)record.Length() > opt::max_soft_clipping) {
-                std::vector<std::string> chrom;
-                for (const auto &record2 : records) {
-                    chrom.push_back(record2.ChrName());
-                }
-                bool allAreEqual =
-                        find_if(chrom.begin() + 1,
-                                chrom.end(),
-                                bind1st(std::not_equal_to<std::string>(), chrom.front())) == chrom.end();
-                if (!allAreEqual) {
-                    return false;
-                }
-
-                for (const auto &record2 : records) {
-                    if (!AdditionalChecks(record2)) {
-                        return false;
-                    }
-                }
-                if (opt::verbose)
-                    std::cerr << "Filtered: soft clips" << std::endl;
-                return true;
-            }
+    }
+    if (soft_clipped) {
+        if (!same_chrom || !additional) {
+            return false;
         }
-
-//        for (const auto &record : records) {
-//            if (record.NumHardClip()/(double)record.Length() > opt::max_hard_clipping) {
-//               std::cerr << "Filtered: hard clips" << std::endl;
-//                return true;
-//            }
-//        }
-        return false;
+        if (opt::verbose)
+            std::cerr << "Filtered: soft clips" << std::endl;
+        return true;
     }
-
+    return false;
 }
 
 static void parseOptions(int argc, char** argv) {
@@ -263,9 +258,17 @@ static void parseOptions(int argc, char** argv) {
             case 's': arg >> opt::max_soft_clipping; break;
             case 'c': arg >> opt::max_hard_clipping; break;
             case 'b' : opt::filter_bad = true; break;
+            case 'e': opt::expr = optarg; break;
+            case 'C': opt::collate = true; break;
+            case 'h': help = true; break;
         }
     }
 
+    if (opt::filter_bad && !opt::expr.empty()) {
+        std::cerr << "-e and -b can't be used together" << std::endl;
+        die = true;
+    }
+
     if (die || help) {
         std::cerr << "\n" << STAT_USAGE_MESSAGE;
         die ? exit(EXIT_FAILURE) : exit(EXIT_SUCCESS);
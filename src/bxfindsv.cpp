@@ -1,5 +1,6 @@
 #include "bxfindsv.hpp"
-#include "SeqLib/BamReader.h"
+#include "bxcommon.h"
+#include "bxreader.h"
 
 namespace opt {
     static std::vector<std::string> bams; // the bam to analyze
@@ -19,17 +20,18 @@ static void parseOptions(int argc, char** argv);
 
 void runFindSV(int argc, char** argv) {
     parseOptions(argc, argv);
-    SeqLib::BamReader reader;
+    BXReader reader;
     std::unordered_map<int, std::unordered_map<int, int>> sv_map;
     for (auto bam : opt::bams) {
         if (!reader.Open(bam)) {
             std::cerr << "Failed to open bam: " << bam << std::endl;
             exit(EXIT_FAILURE);
         }
+        attachThreadPool(reader);
 
         SeqLib::BamRecord r;
         int count = 0;
-        while (reader.GetNextRecord(r)) {
+        while (readRecord(reader, r)) {
             count++;
             if (count % 1000000 == 0) {
                 std::cout << count << " records processed." << std::endl;
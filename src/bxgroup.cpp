@@ -1,12 +1,12 @@
 #include "bxgroup.h"
 
 #include "bxcommon.h"
+#include "bxreader.h"
 #include <string>
 #include <getopt.h>
 #include <iostream>
 #include <sstream>
 
-#include "SeqLib/BamReader.h"
 #include "SeqLib/BamWriter.h"
 
 struct BXGroup {
@@ -81,17 +81,18 @@ void runGroup(int argc, char** argv) {
   parseOptions(argc, argv);
   
   // opeen the BAM
-  SeqLib::BamReader reader;
+  BXReader reader;
   if (!reader.Open(opt::bam)) {
     std::cerr << "Failed to open bam: " << opt::bam << std::endl;
     exit(EXIT_FAILURE);
   }
+  attachThreadPool(reader);
   
   // loop and write
   SeqLib::BamRecord r;
   size_t count = 0;
   bool hit = false;
-  while (reader.GetNextRecord(r)) {
+  while (readRecord(reader, r)) {
 
     ++count;
 
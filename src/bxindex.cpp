@@ -0,0 +1,310 @@
+#include "bxindex.h"
+
+#include <algorithm>
+#include <cstring>
+#include <getopt.h>
+#include <iostream>
+#include <sstream>
+
+#include "htslib/bgzf.h"
+
+#include "bxcommon.h"
+#include "bxaux.h"
+#include "bxreader.h"
+
+namespace opt {
+
+  static std::string bam;   // the bam to index
+  static std::string out;   // index file, default <bam>.bxi
+  static bool verbose = false;
+  static std::string tag = "BX"; // tag to index by
+}
+
+static const char* shortopts = "hvo:t:";
+static const struct option longopts[] = {
+  { "help",                    no_argument, NULL, 'h' },
+  { "verbose",                 no_argument, NULL, 'v' },
+  { "output",                  required_argument, NULL, 'o' },
+  { "tag",                     required_argument, NULL, 't' },
+  { NULL, 0, NULL, 0 }
+};
+
+static const char *INDEX_USAGE_MESSAGE =
+"Usage: bxtools index <BAM> \n"
+"Description: Write a barcode index (<BAM>.bxi) so that the reads of a barcode can\n"
+"             be fetched without a pass over the whole BAM (see bxtools fetch)\n"
+"\n"
+"  General options\n"
+"  -v, --verbose                        Set verbose output\n"
+"  -h, --help                           Display this help and exit\n"
+"  -o, --output                         Index file to write. Default: <BAM>.bxi\n"
+"  -t, --tag                            Tag to index by. Default: BX\n"
+"\n";
+
+static const char BXI_MAGIC[4] = { 'B', 'X', 'I', 1 };
+
+// the index must be read with the same formatting of the tag value
+static const char* tagText(const bam1_t* b, uint16_t tag, char* buf, size_t& len) {
+  return scanAux(b, tag).text(buf, len);
+}
+
+// opens a BAM for raw reading; only BGZF-compressed BAM has virtual offsets
+static htsFile* openBam(const std::string& file, bam_hdr_t*& hdr) {
+  htsFile* fp = sam_open(file.c_str(), "r");
+  if (!fp)
+    return nullptr;
+  if (hts_get_format(fp)->format != bam || !(hdr = sam_hdr_read(fp))) {
+    sam_close(fp);
+    return nullptr;
+  }
+  return fp;
+}
+
+bool BXIndex::Build(const std::string& file, const std::string& tag) {
+
+  Reset(tag);
+
+  bam_hdr_t* hdr = nullptr;
+  htsFile* fp = openBam(file, hdr);
+  if (!fp)
+    return false;
+
+  const uint16_t t = auxTag(tag);
+  char buf[32];
+  bam1_t* b = bam_init1();
+  uint64_t beg = bgzf_tell(fp->fp.bgzf);
+  int ret;
+  while ((ret = sam_read1(fp, hdr, b)) >= 0) {
+
+    const uint64_t end = bgzf_tell(fp->fp.bgzf);
+    size_t len = 0;
+    const char* bx = tagText(b, t, buf, len);
+    if (bx && len) {
+      const uint32_t id = m_barcodes.intern(bx, len);
+      if (id == m_chunks.size())
+	m_chunks.push_back(std::vector<BXChunk>());
+      std::vector<BXChunk>& c = m_chunks[id];
+      // one seek and one block inflate either way, so extend the last chunk
+      if (!c.empty() && (c.back().end >> 16) == (beg >> 16)) {
+	c.back().end = end;
+      } else {
+	BXChunk ch = { beg, end };
+	c.push_back(ch);
+      }
+    }
+    beg = end;
+  }
+
+  bam_destroy1(b);
+  bam_hdr_destroy(hdr);
+  sam_close(fp);
+  return ret == -1;
+}
+
+void BXIndex::Reset(const std::string& tag) {
+  m_tag = tag;
+  m_barcodes = BXDict();
+  m_chunks.clear();
+}
+
+void BXIndex::Add(const std::string& barcode, const BXChunk& c) {
+  const uint32_t id = m_barcodes.intern(barcode);
+  if (id == m_chunks.size())
+    m_chunks.push_back(std::vector<BXChunk>());
+  m_chunks[id].push_back(c);
+}
+
+bool BXIndex::Save(const std::string& file) const {
+
+  BGZF* fp = bgzf_open(file.c_str(), "w");
+  if (!fp)
+    return false;
+
+  bool ok = bgzf_write(fp, BXI_MAGIC, 4) == 4;
+  auto write32 = [&](uint32_t v) { ok = ok && bgzf_write(fp, &v, 4) == 4; };
+  auto write64 = [&](uint64_t v) { ok = ok && bgzf_write(fp, &v, 8) == 8; };
+  auto writeStr = [&](const std::string& s) {
+    write32(s.size());
+    ok = ok && bgzf_write(fp, s.data(), s.size()) == (ssize_t)s.size();
+  };
+
+  writeStr(m_tag);
+  write32(m_barcodes.size());
+  for (uint32_t i = 0; i < m_barcodes.size(); ++i) {
+    writeStr(m_barcodes.name(i));
+    write32(m_chunks[i].size());
+    for (const auto& c : m_chunks[i]) {
+      write64(c.beg);
+      write64(c.end);
+    }
+  }
+
+  return bgzf_close(fp) == 0 && ok;
+}
+
+bool BXIndex::Load(const std::string& file, const std::unordered_set<std::string>* only) {
+
+  m_barcodes = BXDict();
+  m_chunks.clear();
+
+  BGZF* fp = bgzf_open(file.c_str(), "r");
+  if (!fp)
+    return false;
+
+  char magic[4];
+  bool ok = bgzf_read(fp, magic, 4) == 4 && !memcmp(magic, BXI_MAGIC, 4);
+  auto read32 = [&](uint32_t& v) { ok = ok && bgzf_read(fp, &v, 4) == 4; };
+  std::string name;
+  auto readStr = [&](std::string& s) {
+    uint32_t n = 0;
+    read32(n);
+    s.resize(ok ? n : 0);
+    ok = ok && bgzf_read(fp, &s[0], n) == (ssize_t)n;
+  };
+
+  uint32_t nbarcodes = 0;
+  readStr(m_tag);
+  read32(nbarcodes);
+  std::vector<BXChunk> chunks;
+  for (uint32_t i = 0; ok && i < nbarcodes; ++i) {
+    uint32_t nchunks = 0;
+    readStr(name);
+    read32(nchunks);
+    chunks.resize(ok ? nchunks : 0);
+    const ssize_t bytes = nchunks * sizeof(BXChunk);
+    ok = ok && bgzf_read(fp, chunks.data(), bytes) == bytes;
+    if (!ok || (only && !only->count(name)))
+      continue;
+    const uint32_t id = m_barcodes.intern(name);
+    if (id == m_chunks.size())
+      m_chunks.push_back(std::vector<BXChunk>());
+    m_chunks[id].swap(chunks);
+  }
+
+  bgzf_close(fp);
+  return ok;
+}
+
+std::vector<BXChunk> BXIndex::Chunks(const std::unordered_set<std::string>& barcodes) const {
+
+  std::vector<BXChunk> all;
+  for (const auto& bx : barcodes) {
+    const uint32_t id = m_barcodes.find(bx);
+    if (id != BXDict::npos)
+      all.insert(all.end(), m_chunks[id].begin(), m_chunks[id].end());
+  }
+  std::sort(all.begin(), all.end());
+
+  // merge chunks that overlap or share a block
+  std::vector<BXChunk> merged;
+  for (const auto& c : all) {
+    if (!merged.empty() && (c.beg <= merged.back().end || (c.beg >> 16) == (merged.back().end >> 16)))
+      merged.back().end = std::max(merged.back().end, c.end);
+    else
+      merged.push_back(c);
+  }
+  return merged;
+}
+
+BXFetcher::~BXFetcher() {
+  if (m_hdr)
+    bam_hdr_destroy(m_hdr);
+  if (m_fp)
+    sam_close(m_fp);
+}
+
+bool BXFetcher::Open(const std::string& file, const BXIndex& index,
+		     const std::unordered_set<std::string>& barcodes) {
+  m_fp = openBam(file, m_hdr);
+  if (!m_fp)
+    return false;
+  m_chunks = index.Chunks(barcodes);
+  m_chunk = 0;
+  m_seeked = false;
+  m_tag = auxTag(index.Tag());
+  m_barcodes = &barcodes;
+  return true;
+}
+
+bool BXFetcher::GetNextRecord(SeqLib::BamRecord& r) {
+
+  BGZF* bg = m_fp->fp.bgzf;
+  bam1_t* b = reuseRecord(r);
+  char buf[32];
+  while (m_chunk < m_chunks.size()) {
+
+    const BXChunk& c = m_chunks[m_chunk];
+    if (!m_seeked) {
+      if (bgzf_seek(bg, c.beg, SEEK_SET) < 0) {
+	std::cerr << "Failed to seek to barcode chunk, is the .bxi index stale?" << std::endl;
+	break;
+      }
+      m_seeked = true;
+    }
+
+    if ((uint64_t)bgzf_tell(bg) >= c.end || sam_read1(m_fp, m_hdr, b) < 0) {
+      ++m_chunk;
+      m_seeked = false;
+      continue;
+    }
+
+    // chunks can hold reads of other barcodes
+    size_t len = 0;
+    const char* bx = tagText(b, m_tag, buf, len);
+    if (!bx || !len)
+      continue;
+    m_bx.assign(bx, len);
+    if (m_barcodes->count(m_bx))
+      return true;
+  }
+  return false;
+}
+
+static void parseOptions(int argc, char** argv);
+
+void runIndex(int argc, char** argv) {
+
+  parseOptions(argc, argv);
+
+  if (opt::out.empty())
+    opt::out = indexFile(opt::bam);
+
+  BXIndex index;
+  if (!index.Build(opt::bam, opt::tag)) {
+    std::cerr << "Failed to index bam (must be a BAM, not SAM/CRAM): " << opt::bam << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  if (opt::verbose)
+    std::cerr << "...indexed " << SeqLib::AddCommas(index.size()) << " barcodes" << std::endl;
+
+  if (!index.Save(opt::out)) {
+    std::cerr << "Failed to write index: " << opt::out << std::endl;
+    exit(EXIT_FAILURE);
+  }
+}
+
+static void parseOptions(int argc, char** argv) {
+
+  bool die = false;
+  bool help = false;
+
+  if (argc < 2)
+    die = true;
+  else
+    opt::bam = std::string(argv[1]);
+
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v': opt::verbose = true; break;
+    case 'h': help = true; break;
+    case 'o': arg >> opt::out; break;
+    case 't': arg >> opt::tag; break;
+    }
+  }
+
+  if (die || help) {
+    std::cerr << "\n" << INDEX_USAGE_MESSAGE;
+    die ? exit(EXIT_FAILURE) : exit(EXIT_SUCCESS);
+  }
+}
@@ -0,0 +1,105 @@
+#ifndef BXTOOLS_INDEX_H__
+#define BXTOOLS_INDEX_H__
+
+#include <cstdint>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+#include "htslib/sam.h"
+#include "SeqLib/BamHeader.h"
+#include "SeqLib/BamRecord.h"
+
+#include "bxdict.h"
+
+void runIndex(int argc, char** argv);
+
+// A run of records [beg, end) given as BGZF virtual offsets
+struct BXChunk {
+  uint64_t beg;
+  uint64_t end;
+  bool operator<(const BXChunk& o) const { return beg < o.beg; }
+};
+
+// Barcode sidecar index (in.bam.bxi). For every barcode, the virtual offset
+// chunks of an ordinary (eg coordinate-sorted) BAM that hold its reads.
+// Chunks that start in the block where the previous one ended are merged,
+// so a chunk may also cover reads of other barcodes; readers of the index
+// check the tag of what they read.
+//
+// On disk (BGZF-compressed, little endian):
+//   "BXI\1", uint32 tag length, tag, uint32 n_barcodes,
+//   then per barcode: uint32 name length, name, uint32 n_chunks,
+//   n_chunks x (uint64 beg, uint64 end)
+class BXIndex {
+
+ public:
+
+  // scan a BAM and index the reads by the given tag
+  bool Build(const std::string& bam, const std::string& tag = "BX");
+
+  // start an index written alongside a BAM (see bxtools split -g)
+  void Reset(const std::string& tag);
+
+  // add a chunk for a barcode. Chunks must come in file order
+  void Add(const std::string& barcode, const BXChunk& c);
+
+  bool Save(const std::string& file) const;
+
+  // load the index. With a barcode set, only those barcodes are kept
+  bool Load(const std::string& file, const std::unordered_set<std::string>* only = nullptr);
+
+  // the chunks of a set of barcodes, merged and in file order
+  std::vector<BXChunk> Chunks(const std::unordered_set<std::string>& barcodes) const;
+
+  const std::string& Tag() const { return m_tag; }
+
+  size_t size() const { return m_barcodes.size(); }
+
+ private:
+
+  std::string m_tag = "BX";
+  BXDict m_barcodes;
+  std::vector<std::vector<BXChunk>> m_chunks; // indexed by BXDict id
+};
+
+// default sidecar file for a BAM
+inline std::string indexFile(const std::string& bam) {
+  return bam + ".bxi";
+}
+
+// Reads the records of a set of barcodes by seeking to their chunks,
+// instead of a pass over the whole BAM. Records come out in file order.
+class BXFetcher {
+
+ public:
+
+  BXFetcher() {}
+  ~BXFetcher();
+
+  bool Open(const std::string& bam, const BXIndex& index,
+	    const std::unordered_set<std::string>& barcodes);
+
+  bool GetNextRecord(SeqLib::BamRecord& r);
+
+  SeqLib::BamHeader Header() const { return SeqLib::BamHeader(m_hdr); }
+
+ private:
+
+  BXFetcher(const BXFetcher&);
+  BXFetcher& operator=(const BXFetcher&);
+
+  htsFile* m_fp = nullptr;
+  bam_hdr_t* m_hdr = nullptr;
+
+  std::vector<BXChunk> m_chunks;
+  size_t m_chunk = 0;
+  bool m_seeked = false;
+
+  uint16_t m_tag = 0;
+  const std::unordered_set<std::string>* m_barcodes = nullptr;
+  std::string m_bx;
+};
+
+#endif
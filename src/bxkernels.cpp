@@ -0,0 +1,207 @@
+#include "bxkernels.h"
+
+#include <algorithm>
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define BX_KERNELS_X86 1
+#include <immintrin.h>
+#endif
+
+// 4-bit code -> base, and -> the base it pairs with (as nucl_complement
+// always did: only ACGT and N have one)
+static const char bx_nt16[17] = "=ACMGRSVTWYHKDBN";
+static const char bx_nt16_comp[17] = "nTGnCnnnAnnnnnnN";
+
+// scalar
+
+static uint64_t qualSumScalar(const uint8_t* q, size_t n) {
+  uint64_t sum = 0;
+  for (size_t i = 0; i < n; ++i)
+    sum += q[i];
+  return sum;
+}
+
+// from base i on; i is even for the vector versions' tails
+static void decodeScalar(const char* table, const uint8_t* seq, size_t i, size_t n, char* out) {
+  for (; i < n; ++i)
+    out[i] = table[seq[i >> 1] >> ((~i & 1) << 2) & 0xf];
+}
+
+static void decodeScalar(const char* table, const uint8_t* seq, size_t n, char* out) {
+  decodeScalar(table, seq, 0, n, out);
+}
+
+static void reverseScalar(char* s, size_t n) {
+  std::reverse(s, s + n);
+}
+
+static void qualAsciiScalar(const uint8_t* q, size_t n, char* out) {
+  for (size_t i = 0; i < n; ++i)
+    out[i] = static_cast<char>(q[i] + 33);
+}
+
+#ifdef BX_KERNELS_X86
+
+// SSE4.1: 16 qualities or 32 bases a step
+
+__attribute__((target("sse4.1")))
+static uint64_t qualSumSSE(const uint8_t* q, size_t n) {
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc = zero;
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16)
+    acc = _mm_add_epi64(acc, _mm_sad_epu8(_mm_loadu_si128(reinterpret_cast<const __m128i*>(q + i)), zero));
+  uint64_t lanes[2];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(lanes), acc);
+  return lanes[0] + lanes[1] + qualSumScalar(q + i, n - i);
+}
+
+__attribute__((target("sse4.1")))
+static void decodeSSE(const char* table, const uint8_t* seq, size_t n, char* out) {
+  const __m128i lut = _mm_loadu_si128(reinterpret_cast<const __m128i*>(table));
+  const __m128i mask = _mm_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(seq + (i >> 1)));
+    // the first base of a byte is its high nibble
+    const __m128i hi = _mm_shuffle_epi8(lut, _mm_and_si128(_mm_srli_epi16(v, 4), mask));
+    const __m128i lo = _mm_shuffle_epi8(lut, _mm_and_si128(v, mask));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_unpacklo_epi8(hi, lo));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i + 16), _mm_unpackhi_epi8(hi, lo));
+  }
+  decodeScalar(table, seq, i, n, out);
+}
+
+__attribute__((target("sse4.1")))
+static void reverseSSE(char* s, size_t n) {
+  const __m128i rev = _mm_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+  size_t i = 0, j = n;
+  for (; j - i >= 32; i += 16, j -= 16) {
+    const __m128i a = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+    const __m128i b = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + j - 16));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(s + i), _mm_shuffle_epi8(b, rev));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(s + j - 16), _mm_shuffle_epi8(a, rev));
+  }
+  std::reverse(s + i, s + j);
+}
+
+__attribute__((target("sse4.1")))
+static void qualAsciiSSE(const uint8_t* q, size_t n, char* out) {
+  const __m128i offset = _mm_set1_epi8(33);
+  size_t i = 0;
+  for (; i + 16 <= n; i += 16) {
+    const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(q + i));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out + i), _mm_add_epi8(v, offset));
+  }
+  qualAsciiScalar(q + i, n - i, out + i);
+}
+
+// AVX2: twice that. Shuffles and unpacks work within each 128-bit lane,
+// so the lanes are put back in order with a permute.
+
+__attribute__((target("avx2")))
+static uint64_t qualSumAVX2(const uint8_t* q, size_t n) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i acc = zero;
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32)
+    acc = _mm256_add_epi64(acc, _mm256_sad_epu8(_mm256_loadu_si256(reinterpret_cast<const __m256i*>(q + i)), zero));
+  uint64_t lanes[4];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(lanes), acc);
+  return lanes[0] + lanes[1] + lanes[2] + lanes[3] + qualSumScalar(q + i, n - i);
+}
+
+__attribute__((target("avx2")))
+static void decodeAVX2(const char* table, const uint8_t* seq, size_t n, char* out) {
+  const __m256i lut = _mm256_broadcastsi128_si256(_mm_loadu_si128(reinterpret_cast<const __m128i*>(table)));
+  const __m256i mask = _mm256_set1_epi8(0x0f);
+  size_t i = 0;
+  for (; i + 64 <= n; i += 64) {
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(seq + (i >> 1)));
+    const __m256i hi = _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(v, 4), mask));
+    const __m256i lo = _mm256_shuffle_epi8(lut, _mm256_and_si256(v, mask));
+    const __m256i a = _mm256_unpacklo_epi8(hi, lo); // bytes 0-7 | 16-23
+    const __m256i b = _mm256_unpackhi_epi8(hi, lo); // bytes 8-15 | 24-31
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_permute2x128_si256(a, b, 0x20));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i + 32), _mm256_permute2x128_si256(a, b, 0x31));
+  }
+  decodeScalar(table, seq, i, n, out);
+}
+
+__attribute__((target("avx2")))
+static void reverseAVX2(char* s, size_t n) {
+  const __m256i rev = _mm256_setr_epi8(15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0,
+				       15, 14, 13, 12, 11, 10, 9, 8, 7, 6, 5, 4, 3, 2, 1, 0);
+  size_t i = 0, j = n;
+  for (; j - i >= 64; i += 32, j -= 32) {
+    const __m256i a = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+    const __m256i b = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + j - 32));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(s + i),
+			_mm256_permute4x64_epi64(_mm256_shuffle_epi8(b, rev), 0x4e));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(s + j - 32),
+			_mm256_permute4x64_epi64(_mm256_shuffle_epi8(a, rev), 0x4e));
+  }
+  reverseSSE(s + i, j - i);
+}
+
+__attribute__((target("avx2")))
+static void qualAsciiAVX2(const uint8_t* q, size_t n, char* out) {
+  const __m256i offset = _mm256_set1_epi8(33);
+  size_t i = 0;
+  for (; i + 32 <= n; i += 32) {
+    const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(q + i));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out + i), _mm256_add_epi8(v, offset));
+  }
+  qualAsciiScalar(q + i, n - i, out + i);
+}
+
+#endif
+
+struct BXKernelSet {
+  const char* name;
+  uint64_t (*qual_sum)(const uint8_t*, size_t);
+  void (*decode)(const char*, const uint8_t*, size_t, char*);
+  void (*reverse)(char*, size_t);
+  void (*qual_ascii)(const uint8_t*, size_t, char*);
+};
+
+static BXKernelSet pickKernels() {
+#ifdef BX_KERNELS_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2"))
+    return { "avx2", qualSumAVX2, decodeAVX2, reverseAVX2, qualAsciiAVX2 };
+  if (__builtin_cpu_supports("sse4.1"))
+    return { "sse4.1", qualSumSSE, decodeSSE, reverseSSE, qualAsciiSSE };
+#endif
+  return { "scalar", qualSumScalar, decodeScalar, reverseScalar, qualAsciiScalar };
+}
+
+static const BXKernelSet& kernels() {
+  static const BXKernelSet k = pickKernels();
+  return k;
+}
+
+const char* bxKernelSet() {
+  return kernels().name;
+}
+
+uint64_t bxQualSum(const uint8_t* qual, size_t n) {
+  return kernels().qual_sum(qual, n);
+}
+
+void bxDecodeSeq(const uint8_t* seq, size_t n, char* out) {
+  kernels().decode(bx_nt16, seq, n, out);
+}
+
+void bxDecodeSeqRevComp(const uint8_t* seq, size_t n, char* out) {
+  const BXKernelSet& k = kernels();
+  k.decode(bx_nt16_comp, seq, n, out);
+  k.reverse(out, n);
+}
+
+void bxQualToAscii(const uint8_t* qual, size_t n, char* out, bool reverse) {
+  const BXKernelSet& k = kernels();
+  k.qual_ascii(qual, n, out);
+  if (reverse)
+    k.reverse(out, n);
+}
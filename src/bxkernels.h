@@ -0,0 +1,26 @@
+#ifndef BXTOOLS_KERNELS_H__
+#define BXTOOLS_KERNELS_H__
+
+#include <cstddef>
+#include <cstdint>
+
+// Per-base kernels on the raw BAM sequence (bam_get_seq, 4 bits a base)
+// and qualities (bam_get_qual), for filter and bamtofastq. Each has an
+// AVX2, an SSE4.1 and a scalar version; the best one the CPU supports is
+// picked at run time, so the binary needs no -m flags to use them.
+
+// sum of n base qualities
+uint64_t bxQualSum(const uint8_t* qual, size_t n);
+
+// the n bases of a read as ASCII (=ACMGRSVTWYHKDBN), or their reverse
+// complement (A<->T, C<->G, N stays N and any other code becomes n)
+void bxDecodeSeq(const uint8_t* seq, size_t n, char* out);
+void bxDecodeSeqRevComp(const uint8_t* seq, size_t n, char* out);
+
+// n qualities as FASTQ (phred + 33), reversed for reads on the reverse strand
+void bxQualToAscii(const uint8_t* qual, size_t n, char* out, bool reverse);
+
+// the kernel set in use: "avx2", "sse4.1" or "scalar"
+const char* bxKernelSet();
+
+#endif
@@ -4,10 +4,13 @@
 #include <iostream>
 #include <sstream>
 
-#include "SeqLib/BamReader.h"
 #include "SeqLib/GenomicRegionCollection.h"
 
 #include "bxcommon.h"
+#include "bxaux.h"
+#include "bxshard.h"
+#include "bxspill.h"
+#include "bxreader.h"
 
 namespace opt {
 
@@ -47,18 +50,28 @@ public:
   int nr = 0; // num reads
   std::string chr_string;
 
-  bool add(const SeqLib::BamRecord& r, const SeqLib::BamHeader h) {
+  // A molecule stays on the chromosome of its first read; reads elsewhere
+  // are dropped. Shards are merged in file order, so the partial merged
+  // first holds the first read, and merge() dropping a later partial on
+  // another chromosome drops the same reads as add() when a shard holds
+  // one chromosome (a sorted, indexed BAM). With byte-range shards, a
+  // partial whose reads switch chromosome is kept or dropped whole.
+  bool onChrom(int c) const {
+    return chr < 0 || c == chr;
+  }
+
+  // m and bxtag are the MI and BX tags, already pulled from r
+  bool add(const SeqLib::BamRecord& r, int32_t m, const BXAux& bxtag, const SeqLib::BamHeader& h) {
     
-    if (!r.GetIntTag("MI", mi)) // skip if not there
-      return true;
+    mi = m;
     
-    if (chr > 0 && chr != r.ChrID()) {
+    if (!onChrom(r.ChrID())) {
       std::cerr << "Warning: MI tag " << mi << " spans multiple chromosomes" << std::endl;
       return false;
     }
     ++nr;
-    if (bx.empty())
-      r.GetZTag("BX", bx);
+    if (bx.empty() && bxtag.isString())
+      bx.assign(bxtag.str(), bxtag.len);
     chr = r.ChrID();
     min = std::min(r.Position(), min);
     max = std::max(r.PositionEnd(), max);
@@ -68,6 +81,46 @@ public:
     return true;
 
   }
+
+  // fold in the reads of the same molecule seen by another shard
+  void merge(const BXMol& o) {
+
+    if (o.chr >= 0 && !onChrom(o.chr)) {
+      std::cerr << "Warning: MI tag " << o.mi << " spans multiple chromosomes" << std::endl;
+      return;
+    }
+    mi = o.mi;
+    nr += o.nr;
+    if (bx.empty())
+      bx = o.bx;
+    if (chr < 0) {
+      chr = o.chr;
+      chr_string = o.chr_string;
+    }
+    min = std::min(o.min, min);
+    max = std::max(o.max, max);
+  }
+
+  // for BXSpillMap
+  void save(BXSpillWriter& w) const {
+    w.put(min);
+    w.put(max);
+    w.put(chr);
+    w.put(mi);
+    w.put(nr);
+    w.put(bx);
+    w.put(chr_string);
+  }
+
+  void load(BXSpillReader& r) {
+    r.get(min);
+    r.get(max);
+    r.get(chr);
+    r.get(mi);
+    r.get(nr);
+    r.get(bx);
+    r.get(chr_string);
+  }
   
   friend std::ostream& operator<<(std::ostream& out, const BXMol& b) {
     out << b.chr_string << "\t" << b.min << "\t" 
@@ -78,30 +131,92 @@ public:
 
 };
 
+// molecules keyed by MI, one map per shard thread when running sharded.
+// Written out in MI order
+class MolAccumulator final : public BXAnalysis {
+
+ public:
+
+  SeqLib::BamHeader hdr;
+  BXSpillMap<int, BXMol> molmap;
+  size_t mi_reads = 0;
+  uint16_t aux_tags[2];
+
+  // a new molecule holds two short strings besides itself
+  explicit MolAccumulator(const SeqLib::BamHeader& h) : hdr(h), molmap(sizeof(BXMol) + 128) {
+    aux_tags[0] = auxTag("MI");
+    aux_tags[1] = auxTag("BX");
+  }
+
+  void add(const SeqLib::BamRecord& r) override {
+    if (!r.MappedFlag())
+      return;
+    BXAux aux[2];
+    scanAux(r.raw(), aux_tags, 2, aux);
+    if (aux[0].isInt()) {
+      const int32_t mi = aux[0].toInt();
+      molmap.get(mi).add(r, mi, aux[1], hdr);
+      ++mi_reads;
+    }
+  }
+
+  void merge(MolAccumulator& o) {
+    o.molmap.forEach([&](int mi, const BXMol& m) {
+	molmap.get(mi).merge(m);
+      });
+    mi_reads += o.mi_reads;
+  }
+
+  void merge(BXAnalysis& o) override {
+    merge(static_cast<MolAccumulator&>(o));
+  }
+
+  BXAnalysis* clone() const override {
+    return new MolAccumulator(*this);
+  }
+
+  // print them out as a BED
+  void write(const std::string& out) override {
+    std::ofstream file;
+    std::ostream& os = openOutput(out, file);
+    molmap.forEach([&](int, const BXMol& m) {
+	os << m << std::endl;
+      });
+  }
+};
+
+BXAnalysis* newMolAnalysis(const SeqLib::BamHeader& hdr) {
+  return new MolAccumulator(hdr);
+}
+
 static void parseOptions(int argc, char** argv);
 
 void runMol(int argc, char** argv) {
   
   parseOptions(argc, argv);
 
-  SeqLib::BamReader reader;
+  BXReader reader;
   BXOPEN(reader, opt::bam);
   SeqLib::BamHeader hdr = reader.Header();
 
-  std::unordered_map<int, BXMol> molmap;
-
-  SeqLib::BamRecord r;
-  size_t count = 0; 
-  int32_t mi;
-  while (reader.GetNextRecord(r)) {
-    BXLOOPCHECK(r, molmap.size(), "MI");
-    if (r.MappedFlag() && r.GetIntTag("MI", mi)) 
-      molmap[mi].add(r, hdr);
+  MolAccumulator acc(hdr);
+
+  // unmapped reads are skipped anyway, so no shard for the unplaced ones
+  const std::vector<BXShard> shards = shardBam(opt::bam, false);
+  if (shards.size()) {
+    if (opt::verbose)
+      std::cerr << "...reading " << shards.size() << " regions on " << threadCount() << " threads" << std::endl;
+    runShardedInOrder(opt::bam, shards, acc);
+  } else {
+    SeqLib::BamRecord r;
+    size_t count = 0; 
+    while (readRecord(reader, r)) {
+      BXLOOPCHECK(r, acc.mi_reads, "MI");
+      acc.add(r);
+    }
   }
   
-  // print them out as a BED
-  for (const auto& b : molmap)
-    std::cout << b.second << std::endl;
+  acc.write("-");
 }
 
 static void parseOptions(int argc, char** argv) {
@@ -1,6 +1,13 @@
 #ifndef BXTOOLS_MOL_H
 #define BXTOOLS_MOL_H
 
+#include "SeqLib/BamHeader.h"
+
+#include "bxanalysis.h"
+
 void runMol(int argc, char** argv);
 
+// the accumulator of bxtools mol
+BXAnalysis* newMolAnalysis(const SeqLib::BamHeader& hdr);
+
 #endif
@@ -0,0 +1,175 @@
+#include "bxmulti.h"
+
+#include <getopt.h>
+#include <iostream>
+#include <memory>
+#include <sstream>
+#include <vector>
+
+
+#include "bxcommon.h"
+#include "bxshard.h"
+#include "bxstats.h"
+#include "bxtile.h"
+#include "bxmol.h"
+#include "bxsplit2.h"
+#include "bxreader.h"
+
+namespace opt {
+
+  static std::string bam; // the bam to analyze
+  static bool verbose = false;
+  static std::string tag = "BX"; // tag for stats and tile
+  static int width = 1000;
+  static int overlap = 0;
+  static std::string bed;
+
+  // outputs of the analyses to run
+  static std::string stats;
+  static std::string tile;
+  static std::string mol;
+  static std::string split_by_ref;
+}
+
+static const char* shortopts = "hvs:T:m:r:w:O:b:t:";
+static const struct option longopts[] = {
+  { "help",                    no_argument, NULL, 'h' },
+  { "verbose",                 no_argument, NULL, 'v' },
+  { "stats",                   required_argument, NULL, 's' },
+  { "tile",                    required_argument, NULL, 'T' },
+  { "mol",                     required_argument, NULL, 'm' },
+  { "split-by-ref",            required_argument, NULL, 'r' },
+  { "width",                   required_argument, NULL, 'w' },
+  { "overlap",                 required_argument, NULL, 'O' },
+  { "bed",                     required_argument, NULL, 'b' },
+  { "tag",                     required_argument, NULL, 't' },
+  { NULL, 0, NULL, 0 }
+};
+
+static const char *MULTI_USAGE_MESSAGE =
+"Usage: bxtools multi <BAM/SAM/CRAM> -s stats.tsv -T tiles.bed -m mol.bed -r out_folder\n"
+"Description: Run several analyses over a single pass of the BAM, each writing\n"
+"             its usual output (\"-\" for stdout)\n"
+"\n"
+"  Analyses\n"
+"  -s, --stats           Write bxtools stats output to this file\n"
+"  -T, --tile            Write bxtools tile output to this file\n"
+"  -m, --mol             Write bxtools mol output to this file\n"
+"  -r, --split-by-ref    Write bxtools split-by-ref output to this folder\n"
+"  General options\n"
+"  -v, --verbose         Set verbose output\n"
+"  -t, --tag             Tag other than BX for stats and tile (e.g. MI)\n"
+"  -w, --width           Width of the tiles [1000]\n"
+"  -O, --overlap         Overlap of the tiles [0]\n"
+"  -b, --bed             Rather than tile genome, input BED with regions\n"
+"\n";
+
+// fans each record out to every selected analysis
+struct MultiAccumulator {
+
+  std::vector<std::unique_ptr<BXAnalysis>> analyses;
+  std::vector<std::string> outputs;
+
+  MultiAccumulator() {}
+
+  MultiAccumulator(const MultiAccumulator& o) : outputs(o.outputs) {
+    for (const auto& a : o.analyses)
+      analyses.emplace_back(a->clone());
+  }
+
+  void push_back(BXAnalysis* a, const std::string& out) {
+    analyses.emplace_back(a);
+    outputs.push_back(out);
+  }
+
+  void add(const SeqLib::BamRecord& r) {
+    for (const auto& a : analyses)
+      a->add(r);
+  }
+
+  void merge(MultiAccumulator& o) {
+    for (size_t i = 0; i < analyses.size(); ++i)
+      analyses[i]->merge(*o.analyses[i]);
+  }
+
+  void write() {
+    for (size_t i = 0; i < analyses.size(); ++i)
+      analyses[i]->write(outputs[i]);
+  }
+};
+
+static void parseOptions(int argc, char** argv);
+
+void runMulti(int argc, char** argv) {
+
+  parseOptions(argc, argv);
+
+  BXReader reader;
+  BXOPEN(reader, opt::bam);
+  SeqLib::BamHeader hdr = reader.Header();
+
+  MultiAccumulator acc;
+  if (!opt::stats.empty())
+    acc.push_back(newStatAnalysis(opt::tag), opt::stats);
+  if (!opt::tile.empty())
+    acc.push_back(newTileAnalysis(hdr, opt::tag, opt::width, opt::overlap, opt::bed), opt::tile);
+  if (!opt::mol.empty())
+    acc.push_back(newMolAnalysis(hdr), opt::mol);
+  if (!opt::split_by_ref.empty())
+    acc.push_back(newRefBarcodeAnalysis(), opt::split_by_ref);
+
+  const std::vector<BXShard> shards = shardBam(opt::bam, true);
+  if (shards.size()) {
+    if (opt::verbose)
+      std::cerr << "...reading " << shards.size() << " regions on " << threadCount() << " threads" << std::endl;
+    // in file order, for mol
+    runShardedInOrder(opt::bam, shards, acc);
+  } else {
+    SeqLib::BamRecord r;
+    size_t count = 0;
+    while (readRecord(reader, r)) {
+      if (++count % 1000000 == 0 && opt::verbose)
+	std::cerr << "...at read " << SeqLib::AddCommas(count) << " at pos " << r.Brief() << std::endl;
+      acc.add(r);
+    }
+  }
+
+  acc.write();
+}
+
+static void parseOptions(int argc, char** argv) {
+
+  bool die = false;
+  bool help = false;
+
+  if (argc < 2)
+    die = true;
+  else
+    opt::bam = std::string(argv[1]);
+
+  for (char c; (c = getopt_long(argc, argv, shortopts, longopts, NULL)) != -1;) {
+    std::istringstream arg(optarg != NULL ? optarg : "");
+    switch (c) {
+    case 'v': opt::verbose = true; break;
+    case 'h': help = true; break;
+    case 's': arg >> opt::stats; break;
+    case 'T': arg >> opt::tile; break;
+    case 'm': arg >> opt::mol; break;
+    case 'r': arg >> opt::split_by_ref; break;
+    case 'w': arg >> opt::width; break;
+    case 'O': arg >> opt::overlap; break;
+    case 'b': arg >> opt::bed; break;
+    case 't': arg >> opt::tag; break;
+    }
+  }
+
+  if (opt::stats.empty() && opt::tile.empty() && opt::mol.empty() && opt::split_by_ref.empty()) {
+    std::cerr << "Select at least one analysis" << std::endl;
+    die = true;
+  }
+
+  if (die || help) {
+    std::cerr << "\n" << MULTI_USAGE_MESSAGE;
+    die ? exit(EXIT_FAILURE) : exit(EXIT_SUCCESS);
+  }
+}
@@ -0,0 +1,6 @@
+#ifndef BXTOOLS_MULTI_H__
+#define BXTOOLS_MULTI_H__
+
+void runMulti(int argc, char** argv);
+
+#endif
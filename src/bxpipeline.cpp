@@ -0,0 +1,179 @@
+#include "bxpipeline.h"
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <utility>
+
+#include "bxthreads.h"
+#include "bxprofile.h"
+
+// read the next batch; false once the input is exhausted. The records
+// are read into those left in the batch from its last use, so their
+// bam1_t are reused rather than allocated again.
+bool BXPipeline::fill(BXBatch& b) {
+
+  b.first = m_nread;
+  b.records.reserve(m_batch_size);
+
+  size_t n = 0;
+  auto slot = [&]() -> SeqLib::BamRecord& {
+    if (n == b.records.size())
+      b.records.push_back(SeqLib::BamRecord());
+    return b.records[n];
+  };
+
+  if (!m_pending.isEmpty()) {
+    slot() = m_pending;
+    m_pending = SeqLib::BamRecord();
+    ++n;
+  }
+
+  while (n < m_batch_size && readRecord(m_reader, slot()))
+    ++n;
+
+  // carry on to the end of the last name
+  if (m_group_by_name && n == m_batch_size) {
+    const std::string last = b.records[n - 1].Qname();
+    while (readRecord(m_reader, slot())) {
+      if (b.records[n].Qname() != last) {
+	std::swap(m_pending, b.records[n]);
+	break;
+      }
+      ++n;
+    }
+  }
+
+  b.records.resize(n);
+  b.keep.assign(n, 1);
+  m_nread += n;
+  return n > 0;
+}
+
+bool BXPipeline::flush(const BXBatch& b) {
+  for (size_t i = 0; i < b.records.size(); ++i)
+    if (b.keep[i] && !writeRecord(m_writer, b.records[i]))
+      return false;
+  return true;
+}
+
+bool BXPipeline::Run(const Transform& transform) {
+
+  const int nworkers = threadCount();
+
+  if (nworkers <= 1) {
+    BXBatch b;
+    while (fill(b)) {
+      transform(b);
+      if (!flush(b))
+	return false;
+      ++b.seq;
+    }
+    return true;
+  }
+
+  typedef std::unique_ptr<BXBatch> BatchPtr;
+
+  std::mutex m;
+  std::condition_variable cv_todo, cv_done, cv_space;
+  std::deque<BatchPtr> todo;            // read, waiting for a worker
+  std::map<uint64_t, BatchPtr> done;    // transformed, waiting for the writer
+  std::vector<BatchPtr> spare;          // written, to be refilled
+  const size_t max_in_flight = 2 * nworkers + 2;
+  size_t in_flight = 0;
+  uint64_t nbatches = 0;
+  bool eof = false;
+  std::atomic<bool> failed(false);
+
+  auto worker = [&]() {
+    for (;;) {
+      BatchPtr b;
+      {
+	std::unique_lock<std::mutex> lock(m);
+	cv_todo.wait(lock, [&]() { return !todo.empty() || eof; });
+	if (todo.empty())
+	  return;
+	b = std::move(todo.front());
+	todo.pop_front();
+      }
+      transform(*b);
+      {
+	std::lock_guard<std::mutex> lock(m);
+	const uint64_t seq = b->seq;
+	done[seq] = std::move(b);
+      }
+      cv_done.notify_one();
+    }
+  };
+
+  auto writer = [&]() {
+    for (uint64_t next = 0; ; ++next) {
+      BatchPtr b;
+      {
+	std::unique_lock<std::mutex> lock(m);
+	cv_done.wait(lock, [&]() { return done.count(next) || (eof && next == nbatches); });
+	if (!done.count(next))
+	  return;
+	b = std::move(done[next]);
+	done.erase(next);
+      }
+      // after a failure keep draining, so the reader is never left waiting
+      if (!failed && !flush(*b))
+	failed = true;
+      {
+	std::lock_guard<std::mutex> lock(m);
+	spare.push_back(std::move(b));
+	--in_flight;
+      }
+      cv_space.notify_one();
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (int i = 0; i < nworkers; ++i)
+    threads.emplace_back(worker);
+  std::thread writer_thread(writer);
+
+  for (uint64_t seq = 0; ; ++seq) {
+    BatchPtr b;
+    {
+      std::unique_lock<std::mutex> lock(m);
+      cv_space.wait(lock, [&]() { return in_flight < max_in_flight; });
+      if (failed)
+	break;
+      if (!spare.empty()) {
+	b = std::move(spare.back());
+	spare.pop_back();
+      }
+    }
+    if (!b)
+      b.reset(new BXBatch());
+    if (!fill(*b))
+      break;
+    b->seq = seq;
+    {
+      std::lock_guard<std::mutex> lock(m);
+      todo.push_back(std::move(b));
+      ++in_flight;
+      ++nbatches;
+    }
+    cv_todo.notify_one();
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(m);
+    eof = true;
+  }
+  cv_todo.notify_all();
+  cv_done.notify_all();
+
+  for (auto& t : threads)
+    t.join();
+  writer_thread.join();
+
+  return !failed;
+}
@@ -0,0 +1,66 @@
+#ifndef BXTOOLS_PIPELINE_H__
+#define BXTOOLS_PIPELINE_H__
+
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "SeqLib/BamWriter.h"
+
+#include "bxreader.h"
+
+// A run of consecutive input records. The transform edits the records in
+// place and clears keep[i] for the ones that should not be written.
+struct BXBatch {
+
+  uint64_t seq = 0;   // batch number, the writer goes in this order
+  uint64_t first = 0; // number of records read before this batch
+
+  std::vector<SeqLib::BamRecord> records;
+  std::vector<char> keep;
+};
+
+// Read -> transform -> write pipeline for the streaming rewrite commands.
+// With -@ N > 1 one thread reads batches of records, N workers run the
+// transform on them, and a writer thread puts them back in input order,
+// so the output is the same as the serial loop. The number of batches in
+// flight is bounded, which bounds memory. With -@ 1 the same transform is
+// run inline on the calling thread.
+//
+// The transform runs concurrently on different batches, so any state it
+// shares across batches has to be read-only or atomic.
+class BXPipeline {
+
+ public:
+
+  typedef std::function<void(BXBatch&)> Transform;
+
+  BXPipeline(BXReader& reader, SeqLib::BamWriter& writer)
+    : m_reader(reader), m_writer(writer) {}
+
+  // records per batch [4096]
+  void SetBatchSize(size_t n) { m_batch_size = n ? n : 1; }
+
+  // never split records with the same name across batches, for commands
+  // that work on read pairs of name-sorted input
+  void GroupByName(bool g) { m_group_by_name = g; }
+
+  // run to the end of the input. False if a record failed to write
+  bool Run(const Transform& transform);
+
+ private:
+
+  bool fill(BXBatch& b);
+  bool flush(const BXBatch& b);
+
+  BXReader& m_reader;
+  SeqLib::BamWriter& m_writer;
+
+  size_t m_batch_size = 4096;
+  bool m_group_by_name = false;
+
+  uint64_t m_nread = 0;
+  SeqLib::BamRecord m_pending; // read past the end of the last batch
+};
+
+#endif
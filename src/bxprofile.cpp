@@ -0,0 +1,231 @@
+#include "bxprofile.h"
+#include "bxkernels.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+bool bx_profiling = false;
+uint64_t bx_profile_records = 0;
+
+typedef std::chrono::steady_clock Clock;
+
+static const char* stage_names[STAGE_COUNT] = { "read", "tags", "write", "process" };
+
+static const int64_t WINDOW_NS = 100000000; // 100 ms trace windows
+
+namespace {
+
+struct Profile {
+  std::string command;
+  std::string trace_file;
+  Clock::time_point start;
+  int64_t total[STAGE_COUNT] = {};   // ns spent in each stage
+
+  // current trace window
+  Clock::time_point window_start;
+  int64_t window[STAGE_COUNT] = {};
+  uint64_t window_first_record = 0;
+  std::vector<std::string> events;
+
+  int64_t window_workers[STAGE_COUNT] = {}; // worker totals at the window start
+
+  bool reported = false;
+};
+
+// stage times of one worker thread, written by it alone and read by the
+// report while it may still be running
+struct WorkerTimes {
+  std::atomic<int64_t> total[STAGE_COUNT];
+  WorkerTimes() {
+    for (auto& t : total)
+      t.store(0, std::memory_order_relaxed);
+  }
+};
+
+}
+
+static Profile prof;
+
+// kept to the end, as threads may be gone before the report
+static std::mutex workers_mutex;
+static std::vector<std::unique_ptr<WorkerTimes>> workers;
+
+static thread_local bool main_thread = false;
+static thread_local WorkerTimes* worker_times = nullptr;
+
+static WorkerTimes& workerTimes() {
+  if (!worker_times) {
+    std::lock_guard<std::mutex> lock(workers_mutex);
+    workers.emplace_back(new WorkerTimes);
+    worker_times = workers.back().get();
+  }
+  return *worker_times;
+}
+
+// ns in each stage over all the worker threads so far
+static void workerTotals(int64_t* total) {
+  std::lock_guard<std::mutex> lock(workers_mutex);
+  for (int s = 0; s < STAGE_COUNT; ++s) {
+    total[s] = 0;
+    for (const auto& w : workers)
+      total[s] += w->total[s].load(std::memory_order_relaxed);
+  }
+}
+
+static int64_t nanos(Clock::duration d) {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+}
+
+void parseProfileOptions(int& argc, char** argv) {
+
+  main_thread = true;
+  int j = 1;
+  for (int i = 1; i < argc; ++i) {
+    if (!strcmp(argv[i], "--profile")) {
+      bx_profiling = true;
+    } else if (!strncmp(argv[i], "--profile=", 10)) {
+      bx_profiling = true;
+      prof.trace_file = argv[i] + 10;
+    } else {
+      argv[j++] = argv[i];
+    }
+  }
+
+  argc = j;
+  argv[argc] = nullptr;
+}
+
+// one window of the timeline: the stages laid end to end on their own tracks,
+// each as long as the time spent in it during the window
+static void flushWindow(Clock::time_point now) {
+
+  const double ts = nanos(prof.window_start - prof.start) / 1000.0;
+  const double dur = nanos(now - prof.window_start);
+  int64_t timed = 0;
+  for (int s = 0; s < STAGE_PROCESS; ++s)
+    timed += prof.window[s];
+  prof.window[STAGE_PROCESS] = std::max<int64_t>(0, dur - timed);
+
+  char buf[256];
+  for (int s = 0; s < STAGE_COUNT; ++s) {
+    if (!prof.window[s])
+      continue;
+    snprintf(buf, sizeof(buf),
+	     "{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}",
+	     stage_names[s], s + 1, ts, prof.window[s] / 1000.0);
+    prof.events.push_back(buf);
+  }
+  // worker time as the average number of workers busy in each stage
+  int64_t w[STAGE_COUNT];
+  workerTotals(w);
+  for (int s = 0; s < STAGE_PROCESS; ++s) {
+    if (w[s] > prof.window_workers[s] && dur > 0) {
+      snprintf(buf, sizeof(buf),
+	       "{\"name\":\"%s threads\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{\"busy\":%.2f}}",
+	       stage_names[s], ts, (w[s] - prof.window_workers[s]) / dur);
+      prof.events.push_back(buf);
+    }
+    prof.window_workers[s] = w[s];
+  }
+  snprintf(buf, sizeof(buf),
+	   "{\"name\":\"records/s\",\"ph\":\"C\",\"pid\":1,\"ts\":%.3f,\"args\":{\"records/s\":%.0f}}",
+	   ts, dur > 0 ? (bx_profile_records - prof.window_first_record) * 1e9 / dur : 0);
+  prof.events.push_back(buf);
+
+  for (int s = 0; s < STAGE_COUNT; ++s)
+    prof.window[s] = 0;
+  prof.window_first_record = bx_profile_records;
+  prof.window_start = now;
+}
+
+void addStageTime(BXStage stage, Clock::time_point start) {
+  const Clock::time_point now = Clock::now();
+  const int64_t ns = nanos(now - start);
+  if (!main_thread) {
+    std::atomic<int64_t>& t = workerTimes().total[stage];
+    t.store(t.load(std::memory_order_relaxed) + ns, std::memory_order_relaxed);
+    return;
+  }
+  prof.total[stage] += ns;
+  if (prof.trace_file.empty())
+    return;
+  prof.window[stage] += ns;
+  if (nanos(now - prof.window_start) >= WINDOW_NS)
+    flushWindow(now);
+}
+
+void startProfile(const char* command) {
+  if (!bx_profiling)
+    return;
+  prof.command = command;
+  prof.start = prof.window_start = Clock::now();
+  // commands that exit() early still get their report
+  atexit(reportProfile);
+}
+
+static void writeTrace() {
+
+  std::ofstream out(prof.trace_file.c_str());
+  if (!out) {
+    std::cerr << "Could not open trace file: " << prof.trace_file << std::endl;
+    return;
+  }
+
+  out << "{\"traceEvents\":[\n";
+  out << "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"bxtools " << prof.command << "\"}}";
+  for (int s = 0; s < STAGE_COUNT; ++s)
+    out << ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":" << s + 1
+	<< ",\"args\":{\"name\":\"" << stage_names[s] << "\"}}";
+  for (const auto& e : prof.events)
+    out << ",\n" << e;
+  out << "\n],\"displayTimeUnit\":\"ms\"}\n";
+}
+
+void reportProfile() {
+
+  if (!bx_profiling || prof.reported)
+    return;
+  prof.reported = true;
+
+  const Clock::time_point now = Clock::now();
+  const int64_t wall = nanos(now - prof.start);
+  int64_t timed = 0;
+  for (int s = 0; s < STAGE_PROCESS; ++s)
+    timed += prof.total[s];
+  prof.total[STAGE_PROCESS] = std::max<int64_t>(0, wall - timed);
+
+  std::cerr << "...profile of bxtools " << prof.command << ": "
+	    << bx_profile_records << " records in " << wall / 1e9 << " s";
+  if (wall > 0)
+    std::cerr << " (" << static_cast<uint64_t>(bx_profile_records * 1e9 / wall) << " records/s)";
+  std::cerr << std::endl;
+  int64_t w[STAGE_COUNT];
+  workerTotals(w);
+  for (int s = 0; s < STAGE_COUNT; ++s) {
+    char line[128];
+    snprintf(line, sizeof(line), "   %-8s %10.3f s  %5.1f%%", stage_names[s],
+	     prof.total[s] / 1e9, wall > 0 ? 100.0 * prof.total[s] / wall : 0.0);
+    std::cerr << line;
+    if (w[s]) {
+      snprintf(line, sizeof(line), "  + %.3f s on worker threads", w[s] / 1e9);
+      std::cerr << line;
+    }
+    std::cerr << std::endl;
+  }
+  std::cerr << "   base kernels: " << bxKernelSet() << std::endl;
+
+  if (!prof.trace_file.empty()) {
+    flushWindow(now);
+    writeTrace();
+    std::cerr << "...wrote trace to " << prof.trace_file << std::endl;
+  }
+}
@@ -0,0 +1,74 @@
+#ifndef BXTOOLS_PROFILE_H__
+#define BXTOOLS_PROFILE_H__
+
+#include <chrono>
+#include <cstdint>
+
+#include "SeqLib/BamWriter.h"
+
+#include "bxreader.h"
+
+// Per-stage timing for --profile. Reading (BGZF inflate plus record
+// parse, which htslib does in one call), aux tag lookup and writing
+// (record encode plus BGZF deflate) are timed directly; everything else
+// between the start of the command and the report is the command's own
+// per-record logic. Time the worker threads spend in a stage is reported
+// next to it, summed over the threads. With --profile=<file> a Chrome trace / Perfetto JSON
+// timeline of the stages, in 100 ms windows, is written as well.
+
+enum BXStage { STAGE_READ, STAGE_TAGS, STAGE_WRITE, STAGE_PROCESS, STAGE_COUNT };
+
+// Pull the global --profile[=trace.json] option out of argv
+void parseProfileOptions(int& argc, char** argv);
+
+// start the clock for the command; the report is printed at exit
+void startProfile(const char* command);
+void reportProfile();
+
+// set before any worker thread starts, read-only after. Stage times of the
+// thread running the command split its wall time; those of the worker
+// threads (-@) go to a buffer per thread and are summed for the report
+extern bool bx_profiling;
+
+void addStageTime(BXStage stage, std::chrono::steady_clock::time_point start);
+
+// times the enclosing scope when profiling is on
+class BXTimer {
+
+ public:
+
+  explicit BXTimer(BXStage s) : stage(s) {
+    if (bx_profiling)
+      start = std::chrono::steady_clock::now();
+  }
+
+  ~BXTimer() {
+    if (bx_profiling)
+      addStageTime(stage, start);
+  }
+
+ private:
+
+  BXTimer(const BXTimer&);
+  BXTimer& operator=(const BXTimer&);
+
+  BXStage stage;
+  std::chrono::steady_clock::time_point start;
+};
+
+extern uint64_t bx_profile_records;
+
+// GetNextRecord / WriteRecord, timed when profiling
+inline bool readRecord(BXReader& reader, SeqLib::BamRecord& r) {
+  BXTimer t(STAGE_READ);
+  const bool ok = reader.GetNextRecord(r);
+  bx_profile_records += ok;
+  return ok;
+}
+
+inline bool writeRecord(SeqLib::BamWriter& writer, const SeqLib::BamRecord& r) {
+  BXTimer t(STAGE_WRITE);
+  return writer.WriteRecord(r);
+}
+
+#endif
@@ -0,0 +1,51 @@
+#include "bxreader.h"
+#include "bxcollate.h"
+
+BXReader::BXReader() {}
+
+BXReader::~BXReader() {
+  Close();
+}
+
+bool BXReader::Open(const std::string& file) {
+
+  Close();
+  m_fp = sam_open(file.c_str(), "r");
+  if (!m_fp)
+    return false;
+  bam_hdr_t* h = sam_hdr_read(m_fp);
+  if (!h) {
+    Close();
+    return false;
+  }
+  m_hdr = SeqLib::BamHeader(h);
+  bam_hdr_destroy(h);
+  return true;
+}
+
+void BXReader::Close() {
+  m_collate.reset();
+  if (m_fp)
+    sam_close(m_fp);
+  m_fp = nullptr;
+}
+
+void BXReader::Collate() {
+  if (m_fp)
+    m_collate.reset(new BXCollator(m_fp, m_hdr.get_()));
+}
+
+bool BXReader::GetNextRecord(SeqLib::BamRecord& r) {
+  if (m_collate)
+    return m_collate->GetNextRecord(r);
+  return m_fp && sam_read1(m_fp, m_hdr.get_(), reuseRecord(r)) >= 0;
+}
+
+bam1_t* reuseRecord(SeqLib::BamRecord& r) {
+  // the copy shared_pointer() returns is the second holder
+  if (!r.isEmpty() && r.shared_pointer().use_count() == 2)
+    return r.raw();
+  bam1_t* b = bam_init1();
+  r.assign(b);
+  return b;
+}
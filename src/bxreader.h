@@ -0,0 +1,59 @@
+#ifndef BXTOOLS_READER_H__
+#define BXTOOLS_READER_H__
+
+#include <memory>
+#include <string>
+
+#include "htslib/sam.h"
+#include "SeqLib/BamHeader.h"
+#include "SeqLib/BamRecord.h"
+
+class BXCollator;
+
+// Sequential BAM/SAM/CRAM reader (- for stdin), in place of
+// SeqLib::BamReader, which allocates a new bam1_t for every record.
+// GetNextRecord decodes into the record it is given, reusing its bam1_t
+// and data buffer when nothing else holds a copy of it. A record that has
+// been kept (pushed into a vector, say) is left alone and the reader moves
+// on to a fresh one, so holding on to records stays safe.
+//
+// After GetNextRecord returns false the record is unspecified.
+class BXReader {
+
+ public:
+
+  BXReader();
+  ~BXReader();
+
+  bool Open(const std::string& file);
+
+  void Close();
+
+  const SeqLib::BamHeader& Header() const { return m_hdr; }
+
+  bool GetNextRecord(SeqLib::BamRecord& r);
+
+  // From here on hand out the records grouped by read name, whatever the
+  // order of the input (see BXCollator). Call before the first record.
+  void Collate();
+
+  bool Collating() const { return m_collate != nullptr; }
+
+  // for attaching a thread pool
+  htsFile* fp() const { return m_fp; }
+
+ private:
+
+  BXReader(const BXReader&);
+  BXReader& operator=(const BXReader&);
+
+  htsFile* m_fp = nullptr;
+  SeqLib::BamHeader m_hdr;
+  std::unique_ptr<BXCollator> m_collate;
+};
+
+// The bam1_t to decode the next record of r into: r's own if r is the
+// only holder of it, else a new one that r now holds.
+bam1_t* reuseRecord(SeqLib::BamRecord& r);
+
+#endif
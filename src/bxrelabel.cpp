@@ -1,11 +1,16 @@
 #include "bxrelabel.h"
 
+#include "bxcommon.h"
+#include "bxaux.h"
+#include "bxpipeline.h"
+#include "bxreader.h"
+
 #include <string>
 #include <getopt.h>
 #include <iostream>
 #include <sstream>
+#include <atomic>
 
-#include "SeqLib/BamReader.h"
 #include "SeqLib/BamWriter.h"
 
 namespace opt {
@@ -60,11 +65,12 @@ void runRelabel(int argc, char** argv) {
   parseOptions(argc, argv);
   
   // open the read BAM
-  SeqLib::BamReader reader;
+  BXReader reader;
   if (!reader.Open(opt::bam)) {
     std::cerr << "Failed to open bam: " << opt::bam << std::endl;
     exit(EXIT_FAILURE);
   }
+  attachThreadPool(reader);
 
   // open the write BAM
   SeqLib::BamWriter w;
@@ -72,42 +78,51 @@ void runRelabel(int argc, char** argv) {
     std::cerr << "Failed to open output stream" << std::endl;
     exit(EXIT_FAILURE);
   }
+  attachThreadPool(w);
   w.SetHeader(reader.Header());
   w.WriteHeader();
   
   // loop and write
-  SeqLib::BamRecord r;
-  size_t count = 0;
-  bool bxtaghit = false;
-  while (reader.GetNextRecord(r)) {
-
-    ++count;
-
-    // sanity check
-    if (count == 100000 && !bxtaghit)
-      std::cerr << "****1e5 reads in and haven't hit BX tag yet****" << std::endl;
-
+  std::atomic<bool> bxtaghit(false);
+  const uint16_t bx_tag = auxTag("BX");
+  BXPipeline pipeline(reader, w);
+  const bool ok = pipeline.Run([&](BXBatch& batch) {
     std::string bx;
-    r.GetZTag("BX", bx);
-    if (bx.empty()) {
-      if (opt::verbose)
-	std::cerr << "BX tag empty for read: " << r << std::endl;
-      continue;
-    } else {
-      bxtaghit = true;
-    }
-      
-    if (count % 1000000 == 0 && opt::verbose)
-      std::cerr << "...at read " << SeqLib::AddCommas(count) << " at pos " << r.Brief() << std::endl;
-
-    // set the read name with the BX tag, remove the old one
-    r.SetQname(r.Qname() + "_" + bx);
-    r.RemoveTag("BX");
-    
-    if (!w.WriteRecord(r)) {
-      std::cerr << "failed to write read " << r << " to BAM for " << bx << std::endl;
-      exit(EXIT_FAILURE);
+    for (size_t i = 0; i < batch.records.size(); ++i) {
+
+      SeqLib::BamRecord& r = batch.records[i];
+      const size_t count = batch.first + i + 1;
+
+      // sanity check
+      if (count == 100000 && !bxtaghit)
+	std::cerr << "****1e5 reads in and haven't hit BX tag yet****" << std::endl;
+
+      const BXAux a = scanAux(r.raw(), bx_tag);
+      if (a.isString())
+	bx.assign(a.str(), a.len);
+      else
+	bx.clear();
+      if (bx.empty()) {
+	if (opt::verbose)
+	  std::cerr << "BX tag empty for read: " << r << std::endl;
+	batch.keep[i] = 0;
+	continue;
+      } else {
+	bxtaghit = true;
+      }
+
+      if (count % 1000000 == 0 && opt::verbose)
+	std::cerr << "...at read " << SeqLib::AddCommas(count) << " at pos " << r.Brief() << std::endl;
+
+      // set the read name with the BX tag, remove the old one
+      r.SetQname(r.Qname() + "_" + bx);
+      r.RemoveTag("BX");
     }
+  });
+
+  if (!ok) {
+    std::cerr << "failed to write relabeled reads to BAM" << std::endl;
+    exit(EXIT_FAILURE);
   }
   
   w.Close();
@@ -0,0 +1,261 @@
+#include "bxshard.h"
+#include "bxspill.h"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "htslib/bgzf.h"
+
+// the BGZF header: gzip magic with the FEXTRA flag and one 6-byte "BC"
+// extra field holding the size of the block less one
+static const size_t BGZF_HEADER_SIZE = 18;
+
+// the size of the BGZF block whose header is at p, 0 if it isn't one
+static size_t bgzfBlockSize(const uint8_t* p) {
+  if (p[0] != 31 || p[1] != 139 || p[2] != 8 || !(p[3] & 4) || p[10] != 6 || p[11] != 0 ||
+      p[12] != 'B' || p[13] != 'C' || p[14] != 2 || p[15] != 0)
+    return 0;
+  return (p[16] | p[17] << 8) + 1;
+}
+
+// a block at off, followed by two more (or the end of the file), so that
+// compressed bytes which happen to look like a header are passed over
+static bool bgzfBlocksAt(int fd, int64_t off, int64_t size) {
+  uint8_t h[BGZF_HEADER_SIZE];
+  for (int k = 0; k < 3 && off < size; ++k) {
+    if (pread(fd, h, sizeof(h), off) != (ssize_t)sizeof(h))
+      return false;
+    const size_t len = bgzfBlockSize(h);
+    if (!len)
+      return false;
+    off += len;
+  }
+  return off <= size;
+}
+
+// the first BGZF block at or after off (blocks are at most 64 KB, so
+// there is always one within that), or the end of the file
+static int64_t nextBlock(int fd, int64_t off, int64_t size) {
+  std::vector<uint8_t> buf(BGZF_MAX_BLOCK_SIZE + BGZF_HEADER_SIZE);
+  const ssize_t n = pread(fd, buf.data(), buf.size(), off);
+  for (ssize_t i = 0; i + (ssize_t)BGZF_HEADER_SIZE <= n; ++i)
+    if (buf[i] == 31 && bgzfBlockSize(&buf[i]) && bgzfBlocksAt(fd, off + i, size))
+      return off + i;
+  return size;
+}
+
+// cut [data, end of file) into byte ranges at block boundaries
+static void byteShards(const std::string& bam, int64_t data, std::vector<BXShard>& shards) {
+
+  const int fd = open(bam.c_str(), O_RDONLY);
+  if (fd < 0)
+    return;
+  struct stat st;
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode)) {
+    const int64_t size = st.st_size;
+    const int64_t n = std::min<int64_t>(4 * threadCount(), (size - data) / BX_SHARD_BYTES);
+    int64_t beg = data;
+    for (int64_t i = 1; n > 1 && i <= n; ++i) {
+      const int64_t end = i == n ? size : nextBlock(fd, data + (size - data) / n * i, size);
+      if (end > beg) {
+	BXShard s = { -1, 0, 0, beg, end };
+	shards.push_back(s);
+	beg = end;
+      }
+    }
+  }
+  close(fd);
+
+  if (shards.size() < 2)
+    shards.clear();
+}
+
+std::vector<BXShard> shardBam(const std::string& bam, bool unplaced) {
+
+  std::vector<BXShard> shards;
+  // the accumulators only spill on the serial path (see bxspill.h)
+  if (threadCount() <= 1 || bam == "-" || memoryBudget())
+    return shards;
+
+  htsFile* fp = sam_open(bam.c_str(), "r");
+  if (!fp)
+    return shards;
+  bam_hdr_t* hdr = sam_hdr_read(fp);
+  hts_idx_t* idx = hdr ? sam_index_load(fp, bam.c_str()) : nullptr;
+
+  if (idx) {
+    for (int32_t tid = 0; tid < hdr->n_targets; ++tid) {
+      uint64_t mapped = 0, unmapped = 0;
+      if (hts_idx_get_stat(idx, tid, &mapped, &unmapped) == 0 && mapped + unmapped == 0)
+	continue;
+      const int32_t len = hdr->target_len[tid];
+      for (int32_t beg = 0; beg < len; beg += BX_SHARD_SIZE) {
+	BXShard s = { tid, beg, std::min(len - beg, BX_SHARD_SIZE) + beg, 0, 0 };
+	shards.push_back(s);
+      }
+    }
+    if (unplaced) {
+      BXShard s = { -1, 0, 0, 0, 0 };
+      shards.push_back(s);
+    }
+    hts_idx_destroy(idx);
+  } else if (hdr && hts_get_format(fp)->format == htsExactFormat::bam && fp->is_bgzf) {
+    // unplaced or not, a byte range holds whatever reads are in it
+    byteShards(bam, bgzf_tell(fp->fp.bgzf) >> 16, shards);
+  }
+
+  if (hdr)
+    bam_hdr_destroy(hdr);
+  sam_close(fp);
+  return shards;
+}
+
+static inline int32_t le32(const uint8_t* p) {
+  return static_cast<int32_t>(p[0] | p[1] << 8 | p[2] << 16 | static_cast<uint32_t>(p[3]) << 24);
+}
+
+// Could a BAM record start at d[p]? Its length (with the block_size field)
+// if so, 0 if not, -1 if it runs past the n bytes there are to go on.
+static int64_t bamRecordAt(const uint8_t* d, size_t n, size_t p, int32_t n_targets) {
+
+  if (p + 36 > n)
+    return -1;
+  const uint8_t* r = d + p;
+  const int32_t size = le32(r);
+  const int32_t tid = le32(r + 4), pos = le32(r + 8);
+  const int32_t mtid = le32(r + 24), mpos = le32(r + 28);
+  const int32_t l_seq = le32(r + 20);
+  const uint32_t l_qname = r[12];
+  const uint32_t n_cigar = r[16] | r[17] << 8;
+  const uint32_t flag = r[18] | r[19] << 8;
+
+  if (size < 32 || tid < -1 || tid >= n_targets || mtid < -1 || mtid >= n_targets ||
+      pos < -1 || mpos < -1 || l_qname < 1 || l_seq < 0 || flag > 0xfff)
+    return 0;
+  if (32 + l_qname + 4 * static_cast<int64_t>(n_cigar) + (l_seq + 1) / 2 + static_cast<int64_t>(l_seq) > size)
+    return 0;
+
+  // a printable read name, NUL terminated
+  if (p + 36 + l_qname > n)
+    return -1;
+  for (uint32_t i = 0; i + 1 < l_qname; ++i)
+    if (r[36 + i] < '!' || r[36 + i] > '~' || r[36 + i] == '@')
+      return 0;
+  if (r[36 + l_qname - 1])
+    return 0;
+
+  return p + 4 + size > n ? -1 : 4 + size;
+}
+
+// a run of records from d[p]: 1 if eight of them check out (or they run
+// exactly to the end of the file), 0 if not, -1 if more data is needed
+static int bamRecordsAt(const uint8_t* d, size_t n, size_t p, int32_t n_targets, bool eof) {
+  for (int k = 0; k < 8; ++k) {
+    if (eof && p == n && k)
+      return 1;
+    const int64_t len = bamRecordAt(d, n, p, n_targets);
+    if (len <= 0)
+      return len < 0 && !eof ? -1 : 0;
+    p += len;
+  }
+  return 1;
+}
+
+BXShardReader::~BXShardReader() {
+  if (m_itr)
+    hts_itr_destroy(m_itr);
+  if (m_idx)
+    hts_idx_destroy(m_idx);
+  if (m_hdr)
+    bam_hdr_destroy(m_hdr);
+  if (m_fp)
+    sam_close(m_fp);
+}
+
+bool BXShardReader::Open(const std::string& bam) {
+  m_bam = bam;
+  m_fp = sam_open(bam.c_str(), "r");
+  if (!m_fp)
+    return false;
+  m_hdr = sam_hdr_read(m_fp);
+  if (!m_hdr)
+    return false;
+  m_data = bgzf_tell(m_fp->fp.bgzf);
+  return true;
+}
+
+bool BXShardReader::SetShard(const BXShard& s) {
+
+  m_shard = s;
+  if (s.bytes()) {
+    // the first range starts right after the header
+    if ((s.off_beg << 16) > m_data)
+      return seekRecord(s.off_beg);
+    m_done = false;
+    return bgzf_seek(m_fp->fp.bgzf, m_data, SEEK_SET) >= 0;
+  }
+
+  if (!m_idx && !(m_idx = sam_index_load(m_fp, m_bam.c_str())))
+    return false;
+  if (m_itr)
+    hts_itr_destroy(m_itr);
+  if (s.tid < 0)
+    m_itr = sam_itr_queryi(m_idx, HTS_IDX_NOCOOR, 0, 0);
+  else
+    m_itr = sam_itr_queryi(m_idx, s.tid, s.beg, s.end);
+  return m_itr != nullptr;
+}
+
+// Go to the first record that starts at or after the block at file offset
+// off, looking for it in a window of the data that grows until a run of
+// records can be told apart from the tail of one started earlier.
+bool BXShardReader::seekRecord(int64_t off) {
+
+  BGZF* bg = m_fp->fp.bgzf;
+  for (size_t window = 256 << 10; window <= (256 << 20); window *= 4) {
+
+    m_scan.resize(window);
+    if (bgzf_seek(bg, off << 16, SEEK_SET) < 0)
+      return false;
+    const ssize_t n = bgzf_read(bg, m_scan.data(), window);
+    if (n < 0)
+      return false;
+    const bool eof = static_cast<size_t>(n) < window;
+
+    int found = 0;
+    size_t p = 0;
+    for (; p < static_cast<size_t>(n) && !found; ++p)
+      found = bamRecordsAt(m_scan.data(), n, p, m_hdr->n_targets, eof);
+
+    if (found > 0) {
+      --p;
+      m_done = false;
+      return bgzf_seek(bg, off << 16, SEEK_SET) >= 0 && bgzf_read(bg, m_scan.data(), p) == static_cast<ssize_t>(p);
+    }
+    // only the ends of records started earlier
+    if (!found && eof) {
+      m_done = true;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool BXShardReader::GetNextRecord(SeqLib::BamRecord& r) {
+
+  if (m_shard.bytes()) {
+    if (m_done || (bgzf_tell(m_fp->fp.bgzf) >> 16) >= m_shard.off_end)
+      return false;
+    return sam_read1(m_fp, m_hdr, reuseRecord(r)) >= 0;
+  }
+
+  bam1_t* b = reuseRecord(r);
+  while (sam_itr_next(m_fp, m_itr, b) >= 0) {
+    // started in an earlier chunk, which has already counted it
+    if (m_shard.tid >= 0 && b->core.pos < m_shard.beg)
+      continue;
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,204 @@
+#ifndef BXTOOLS_SHARD_H__
+#define BXTOOLS_SHARD_H__
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "htslib/sam.h"
+#include "SeqLib/BamRecord.h"
+
+#include "bxthreads.h"
+#include "bxprofile.h"
+
+// Sharded driver for the aggregating commands. When -@ asks for more than
+// one thread, the input BAM is cut into shards that worker threads process
+// with their own reader and their own accumulator. The per-thread
+// accumulators are merged into one at the end.
+//
+// With a .bai/.csi a shard is a contig, or a fixed-size chunk of one.
+// Without one (the unsorted output of relabel, filter, convert...) the
+// file itself is cut into byte ranges at BGZF block boundaries, and each
+// shard finds the first record that starts in its range by checking
+// candidate offsets against the BAM record layout.
+
+// size of the chunks that long contigs are cut into
+static const int32_t BX_SHARD_SIZE = 20000000;
+
+// smallest byte range an unindexed BAM is cut into
+static const int64_t BX_SHARD_BYTES = 8 << 20;
+
+// A contig or a chunk [beg, end) of one. tid -1 holds the reads with no
+// coordinate at all, which sort to the end of the BAM. For an unindexed
+// BAM, the reads that start in the BGZF blocks at file offsets
+// [off_beg, off_end) instead.
+struct BXShard {
+  int32_t tid;
+  int32_t beg;
+  int32_t end;
+  int64_t off_beg;
+  int64_t off_end;
+
+  bool bytes() const { return off_end > 0; }
+};
+
+// Shards covering a BAM, by its index if it has one, skipping contigs the
+// index says are empty, else by byte ranges. Empty if -@ is 1, there is a
+// --max-mem budget, the input is stdin or is not a BGZF BAM big enough to
+// cut, ie if the command should run its serial loop instead.
+std::vector<BXShard> shardBam(const std::string& bam, bool unplaced);
+
+// Reader over one shard at a time. Only reads that start in the shard are
+// returned, so reads straddling a chunk or range boundary are seen once.
+class BXShardReader {
+
+ public:
+
+  BXShardReader() {}
+  ~BXShardReader();
+
+  bool Open(const std::string& bam);
+
+  bool SetShard(const BXShard& s);
+
+  bool GetNextRecord(SeqLib::BamRecord& r);
+
+ private:
+
+  BXShardReader(const BXShardReader&);
+  BXShardReader& operator=(const BXShardReader&);
+
+  bool seekRecord(int64_t off);
+
+  std::string m_bam;
+  htsFile* m_fp = nullptr;
+  bam_hdr_t* m_hdr = nullptr;
+  hts_idx_t* m_idx = nullptr;
+  hts_itr_t* m_itr = nullptr;
+  BXShard m_shard;
+  int64_t m_data = 0;  // virtual offset of the first record
+  bool m_done = false; // byte range with no record starting in it
+  std::vector<uint8_t> m_scan;
+};
+
+// Run the shards on -@ threads. Each thread gets a copy of acc (so
+// accumulators can carry shared read-only state, like a header), calls
+// add(record) on it for every read of the shards it picks up, and the
+// copies are folded back into acc with merge() once all threads are done.
+//
+//   struct Acc {
+//     void add(const SeqLib::BamRecord& r);
+//     void merge(Acc& other);
+//   };
+template <class Acc>
+void runSharded(const std::string& bam, const std::vector<BXShard>& shards, Acc& acc) {
+
+  const size_t nthreads = std::min<size_t>(threadCount(), shards.size());
+  std::vector<Acc> accs(nthreads, acc);
+  std::vector<uint64_t> records(nthreads, 0);
+  std::atomic<size_t> next(0);
+  std::atomic<bool> failed(false);
+
+  auto worker = [&](size_t t) {
+    BXShardReader reader;
+    if (!reader.Open(bam)) {
+      failed = true;
+      return;
+    }
+    SeqLib::BamRecord r;
+    for (size_t i; !failed && (i = next++) < shards.size();) {
+      if (!reader.SetShard(shards[i])) {
+	failed = true;
+	return;
+      }
+      while (reader.GetNextRecord(r)) {
+	accs[t].add(r);
+	++records[t];
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < nthreads; ++t)
+    threads.emplace_back(worker, t);
+  for (auto& t : threads)
+    t.join();
+
+  if (failed) {
+    std::cerr << "Failed to read bam: " << bam << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  for (size_t t = 0; t < nthreads; ++t) {
+    acc.merge(accs[t]);
+    bx_profile_records += records[t];
+  }
+}
+
+// As runSharded, for accumulators that depend on the order reads come in
+// (barcode ids in order of first appearance). Every shard gets its own
+// copy of acc, and the copies are merged in shard order, which is file
+// order, as soon as all the shards before them are done.
+template <class Acc>
+void runShardedInOrder(const std::string& bam, const std::vector<BXShard>& shards, Acc& acc) {
+
+  const size_t nthreads = std::min<size_t>(threadCount(), shards.size());
+  const Acc proto(acc);
+  std::vector<std::unique_ptr<Acc>> done(shards.size());
+  size_t merged = 0;
+  std::mutex m;
+  std::atomic<uint64_t> records(0);
+  std::atomic<size_t> next(0);
+  std::atomic<bool> failed(false);
+
+  auto worker = [&]() {
+    BXShardReader reader;
+    if (!reader.Open(bam)) {
+      failed = true;
+      return;
+    }
+    SeqLib::BamRecord r;
+    for (size_t i; !failed && (i = next++) < shards.size();) {
+      if (!reader.SetShard(shards[i])) {
+	failed = true;
+	return;
+      }
+      std::unique_ptr<Acc> a(new Acc(proto));
+      uint64_t n = 0;
+      while (reader.GetNextRecord(r)) {
+	a->add(r);
+	++n;
+      }
+      records += n;
+
+      std::lock_guard<std::mutex> lock(m);
+      done[i] = std::move(a);
+      for (; merged < done.size() && done[merged]; ++merged) {
+	acc.merge(*done[merged]);
+	done[merged].reset();
+      }
+    }
+  };
+
+  std::vector<std::thread> threads;
+  for (size_t t = 0; t < nthreads; ++t)
+    threads.emplace_back(worker);
+  for (auto& t : threads)
+    t.join();
+
+  if (failed) {
+    std::cerr << "Failed to read bam: " << bam << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  bx_profile_records += records;
+}
+
+#endif
@@ -0,0 +1,167 @@
+#include "bxsketch.h"
+
+#include <algorithm>
+
+// FNV-1a then the MurmurHash3 finalizer, so that all 64 bits are mixed
+static inline uint64_t hash64(const char* s, size_t len) {
+  uint64_t h = 14695981039346656037ULL;
+  for (size_t i = 0; i < len; ++i) {
+    h ^= static_cast<unsigned char>(s[i]);
+    h *= 1099511628211ULL;
+  }
+  h ^= h >> 33;
+  h *= 0xff51afd7ed558ccdULL;
+  h ^= h >> 33;
+  h *= 0xc4ceb9fe1a85ec53ULL;
+  h ^= h >> 33;
+  return h;
+}
+
+void BXDistinct::add(const char* s, size_t len) {
+  const uint64_t h = hash64(s, len);
+  const size_t i = h >> (64 - BX_HLL_BITS);
+  // position of the first 1 bit in the rest of the hash
+  const uint64_t rest = (h << BX_HLL_BITS) | (1ULL << (BX_HLL_BITS - 1));
+  const uint8_t rank = __builtin_clzll(rest) + 1;
+  if (rank > m_reg[i])
+    m_reg[i] = rank;
+}
+
+void BXDistinct::merge(const BXDistinct& o) {
+  for (size_t i = 0; i < m_reg.size(); ++i)
+    m_reg[i] = std::max(m_reg[i], o.m_reg[i]);
+}
+
+uint64_t BXDistinct::estimate() const {
+  const double m = m_reg.size();
+  double sum = 0;
+  size_t zeros = 0;
+  for (const auto r : m_reg) {
+    sum += std::ldexp(1.0, -r);
+    zeros += !r;
+  }
+  double e = (0.7213 / (1 + 1.079 / m)) * m * m / sum;
+  // linear counting while most registers are still empty
+  if (e <= 2.5 * m && zeros)
+    e = m * std::log(m / zeros);
+  return static_cast<uint64_t>(e + 0.5);
+}
+
+void BXMoments::merge(const BXMoments& o) {
+  if (!o.m_n)
+    return;
+  const uint64_t n = m_n + o.m_n;
+  const double d = o.m_mean - m_mean;
+  m_mean += d * o.m_n / n;
+  m_m2 += o.m_m2 + d * d * m_n * o.m_n / n;
+  m_n = n;
+}
+
+double BXIntMoments::sd() const {
+  if (m_n < 2)
+    return 0;
+  const long double sumsq = std::ldexp(static_cast<long double>(m_sumsq_hi), 64) + m_sumsq_lo;
+  const long double sum = m_sum;
+  const long double var = (sumsq - sum * sum / m_n) / (m_n - 1);
+  return var > 0 ? static_cast<double>(std::sqrt(var)) : 0;
+}
+
+void BXHistogram::merge(const BXHistogram& o) {
+  if (o.m_bins.size() > m_bins.size())
+    m_bins.resize(o.m_bins.size(), 0);
+  for (size_t i = 0; i < o.m_bins.size(); ++i)
+    m_bins[i] += o.m_bins[i];
+  m_n += o.m_n;
+}
+
+double BXHistogram::quantile(double q) const {
+
+  if (!m_n)
+    return -1;
+
+  // the values at ranks floor(p) and floor(p) + 1 of the sorted data
+  const double p = q * (m_n - 1);
+  const uint64_t lo = static_cast<uint64_t>(p);
+  double vlo = -1, vhi = -1;
+  uint64_t cum = 0;
+  for (size_t v = 0; v < m_bins.size() && vhi < 0; ++v) {
+    cum += m_bins[v];
+    if (vlo < 0 && cum > lo)
+      vlo = v;
+    if (cum > lo + 1 || (cum > lo && lo + 1 >= m_n))
+      vhi = v;
+  }
+  return vlo + (vhi - vlo) * (p - lo);
+}
+
+void BXQuantiles::compress() {
+
+  std::sort(m_c.begin(), m_c.end());
+
+  // greedily merge neighbours up to an equal share of the weight, which
+  // leaves at most 2 * BX_SKETCH_CENTROIDS centroids
+  const uint64_t target = std::max<uint64_t>(1, m_n / BX_SKETCH_CENTROIDS);
+  size_t j = 0;
+  for (size_t i = 1; i < m_c.size(); ++i) {
+    Centroid& c = m_c[j];
+    const Centroid& n = m_c[i];
+    if (c.weight + n.weight <= target) {
+      const uint32_t w = c.weight + n.weight;
+      c.mean = (static_cast<double>(c.mean) * c.weight + static_cast<double>(n.mean) * n.weight) / w;
+      c.weight = w;
+    } else {
+      m_c[++j] = n;
+    }
+  }
+  m_c.resize(m_c.empty() ? 0 : j + 1);
+}
+
+void BXQuantiles::merge(const BXQuantiles& o) {
+  if (!o.m_n)
+    return;
+  if (o.exact()) {
+    for (const auto& c : o.m_c)
+      add(c.mean);
+    return;
+  }
+  if (!m_n || o.m_min < m_min)
+    m_min = o.m_min;
+  if (!m_n || o.m_max > m_max)
+    m_max = o.m_max;
+  m_c.insert(m_c.end(), o.m_c.begin(), o.m_c.end());
+  m_n += o.m_n;
+  if (m_c.size() >= BX_SKETCH_BUFFER)
+    compress();
+}
+
+double BXQuantiles::quantile(double q) const {
+
+  if (!m_n)
+    return -1;
+
+  std::vector<Centroid> c(m_c);
+  std::sort(c.begin(), c.end());
+
+  // each centroid sits at the middle rank of the values it holds; with all
+  // weights 1 this is plain interpolation between sorted values
+  const double p = q * (m_n - 1);
+  double prev_rank = 0, prev_val = m_min;
+  uint64_t cum = 0;
+  for (const auto& x : c) {
+    const double rank = cum + (x.weight - 1) / 2.0;
+    if (p <= rank) {
+      if (rank == prev_rank)
+	return x.mean;
+      return prev_val + (x.mean - prev_val) * (p - prev_rank) / (rank - prev_rank);
+    }
+    prev_rank = rank;
+    prev_val = x.mean;
+    cum += x.weight;
+  }
+
+  // past the last centroid, towards the max
+  const double last = m_n - 1;
+  if (last == prev_rank)
+    return m_max;
+  return prev_val + (m_max - prev_val) * (p - prev_rank) / (last - prev_rank);
+}
@@ -0,0 +1,206 @@
+#ifndef BXTOOLS_SKETCH_H__
+#define BXTOOLS_SKETCH_H__
+
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+#include "bxspill.h"
+
+// Fixed-size summaries for per-barcode stats, so that memory grows with
+// the number of barcodes rather than the number of reads.
+
+// running count, mean and variance (Welford), mergeable
+class BXMoments {
+
+ public:
+
+  void add(double x) {
+    ++m_n;
+    const double d = x - m_mean;
+    m_mean += d / m_n;
+    m_m2 += d * (x - m_mean);
+  }
+
+  void merge(const BXMoments& o);
+
+  uint64_t count() const { return m_n; }
+  double mean() const { return m_mean; }
+  double sd() const { return m_n > 1 ? std::sqrt(m_m2 / (m_n - 1)) : 0; }
+
+  void save(BXSpillWriter& w) const { w.put(m_n); w.put(m_mean); w.put(m_m2); }
+  void load(BXSpillReader& r) { r.get(m_n); r.get(m_mean); r.get(m_m2); }
+
+ private:
+
+  uint64_t m_n = 0;
+  double m_mean = 0;
+  double m_m2 = 0;
+};
+
+// count, mean and variance of integer values (insert size, MAPQ) from
+// exact sums, so that merging partials in any order gives the same result
+// as adding the values one by one
+class BXIntMoments {
+
+ public:
+
+  void add(int64_t x) {
+    ++m_n;
+    m_sum += x;
+    const unsigned __int128 sq = static_cast<unsigned __int128>(x < 0 ? -x : x) * (x < 0 ? -x : x);
+    addSquares(sq);
+  }
+
+  void merge(const BXIntMoments& o) {
+    m_n += o.m_n;
+    m_sum += o.m_sum;
+    addSquares(static_cast<unsigned __int128>(o.m_sumsq_hi) << 64 | o.m_sumsq_lo);
+  }
+
+  uint64_t count() const { return m_n; }
+  double mean() const { return m_n ? static_cast<double>(static_cast<long double>(m_sum) / m_n) : 0; }
+  double sd() const;
+
+  void save(BXSpillWriter& w) const { w.put(m_n); w.put(m_sum); w.put(m_sumsq_lo); w.put(m_sumsq_hi); }
+  void load(BXSpillReader& r) { r.get(m_n); r.get(m_sum); r.get(m_sumsq_lo); r.get(m_sumsq_hi); }
+
+ private:
+
+  void addSquares(unsigned __int128 sq) {
+    const unsigned __int128 t = (static_cast<unsigned __int128>(m_sumsq_hi) << 64 | m_sumsq_lo) + sq;
+    m_sumsq_lo = static_cast<uint64_t>(t);
+    m_sumsq_hi = static_cast<uint64_t>(t >> 64);
+  }
+
+  uint64_t m_n = 0;
+  int64_t m_sum = 0;
+  uint64_t m_sumsq_lo = 0; // sum of squares, 128 bits in two halves
+  uint64_t m_sumsq_hi = 0;
+};
+
+// Counts of small integer values (eg MAPQ) in up to 256 bins. Storage only
+// grows to the largest value seen, which for MAPQ is usually 60 or 70.
+class BXHistogram {
+
+ public:
+
+  void add(uint8_t v) {
+    if (v >= m_bins.size())
+      m_bins.resize(v + 1, 0);
+    ++m_bins[v];
+    ++m_n;
+  }
+
+  void merge(const BXHistogram& o);
+
+  uint64_t count() const { return m_n; }
+
+  // exact, interpolated between neighbouring values like a sorted array.
+  // -1 if empty
+  double quantile(double q) const;
+
+  size_t bytes() const { return m_bins.capacity() * sizeof(uint32_t); }
+
+  void save(BXSpillWriter& w) const { w.put(m_bins); w.put(m_n); }
+  void load(BXSpillReader& r) { r.get(m_bins); r.get(m_n); }
+
+ private:
+
+  std::vector<uint32_t> m_bins;
+  uint64_t m_n = 0;
+};
+
+// Compact quantile sketch for unbounded values (insert size, AS). Values are
+// kept exactly while there are fewer than BX_SKETCH_BUFFER of them (so up
+// to 255); from the BX_SKETCH_BUFFER-th on they
+// are compressed into BX_SKETCH_CENTROIDS weighted centroids of roughly
+// equal weight, which bounds the rank error of a quantile to about
+// 1 / BX_SKETCH_CENTROIDS. Min and max are always exact.
+static const size_t BX_SKETCH_CENTROIDS = 64;
+static const size_t BX_SKETCH_BUFFER = 256;
+
+class BXQuantiles {
+
+ public:
+
+  void add(float v) {
+    if (m_c.empty() || v < m_min)
+      m_min = v;
+    if (m_c.empty() || v > m_max)
+      m_max = v;
+    Centroid c = { v, 1 };
+    m_c.push_back(c);
+    ++m_n;
+    if (m_c.size() >= BX_SKETCH_BUFFER)
+      compress();
+  }
+
+  // Fold in the values of a later partial. While o still has every value
+  // as added they are replayed through add(), which leaves the same state as
+  // adding them here in the first place; only a partial that has itself
+  // been compressed is merged centroid by centroid, which can move the
+  // quantiles by up to the rank error.
+  void merge(const BXQuantiles& o);
+
+  uint64_t count() const { return m_n; }
+
+  // no values compressed yet
+  bool exact() const { return m_n < BX_SKETCH_BUFFER; }
+
+  // f(v) for each value in the order added, while exact()
+  template <class F>
+  void forEachValue(F f) const {
+    for (const auto& c : m_c)
+      f(c.mean);
+  }
+
+  // linearly interpolated, same as a sorted array while the values are
+  // exact. -1 if empty
+  double quantile(double q) const;
+
+  size_t bytes() const { return m_c.capacity() * sizeof(Centroid); }
+
+  void save(BXSpillWriter& w) const { w.put(m_c); w.put(m_n); w.put(m_min); w.put(m_max); }
+  void load(BXSpillReader& r) { r.get(m_c); r.get(m_n); r.get(m_min); r.get(m_max); }
+
+ private:
+
+  struct Centroid {
+    float mean;
+    uint32_t weight;
+    bool operator<(const Centroid& o) const { return mean < o.mean; }
+  };
+
+  void compress();
+
+  std::vector<Centroid> m_c; // compressed centroids, then new values
+  uint64_t m_n = 0;
+  float m_min = 0;
+  float m_max = 0;
+};
+
+// HyperLogLog estimate of the number of distinct strings (eg read names)
+// in 2^BX_HLL_BITS one-byte registers (4 KB), with a standard error of
+// about 1.6%. Mergeable, so shards can count separately.
+static const int BX_HLL_BITS = 12;
+
+class BXDistinct {
+
+ public:
+
+  BXDistinct() : m_reg(1 << BX_HLL_BITS, 0) {}
+
+  void add(const char* s, size_t len);
+
+  void merge(const BXDistinct& o);
+
+  uint64_t estimate() const;
+
+ private:
+
+  std::vector<uint8_t> m_reg;
+};
+
+#endif
@@ -0,0 +1,277 @@
+#include "bxspill.h"
+
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+
+static size_t budget = 0;
+
+// estimated bytes held by all spillables
+static size_t used = 0;
+
+static std::vector<BXSpillable*>& spillables() {
+  static std::vector<BXSpillable*> all;
+  return all;
+}
+
+// "512M", "8G", "1.5g", "100000"
+static size_t parseSize(const char* val) {
+  char* end = nullptr;
+  double n = strtod(val, &end);
+  if (end == val || n <= 0) {
+    std::cerr << "Invalid memory size: " << val << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  switch (*end) {
+  case 'k': case 'K': n *= 1024.0; ++end; break;
+  case 'm': case 'M': n *= 1024.0 * 1024; ++end; break;
+  case 'g': case 'G': n *= 1024.0 * 1024 * 1024; ++end; break;
+  }
+  if (*end == 'b' || *end == 'B')
+    ++end;
+  if (*end != '\0') {
+    std::cerr << "Invalid memory size: " << val << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  return static_cast<size_t>(n);
+}
+
+void parseMemoryOptions(int& argc, char** argv) {
+
+  int j = 1;
+  for (int i = 1; i < argc; ++i) {
+    const char* val = nullptr;
+    if (!strcmp(argv[i], "--max-mem")) {
+      if (i + 1 >= argc) {
+	std::cerr << "Option --max-mem requires a size" << std::endl;
+	exit(EXIT_FAILURE);
+      }
+      val = argv[++i];
+    } else if (!strncmp(argv[i], "--max-mem=", 10)) {
+      val = argv[i] + 10;
+    } else {
+      argv[j++] = argv[i];
+      continue;
+    }
+    budget = parseSize(val);
+  }
+
+  argc = j;
+  argv[argc] = nullptr;
+}
+
+size_t memoryBudget() {
+  return budget;
+}
+
+FILE* openSpillFile() {
+
+  const char* dir = getenv("TMPDIR");
+  std::string path = std::string(dir && *dir ? dir : "/tmp") + "/bxtools.XXXXXX";
+  int fd = mkstemp(&path[0]);
+  FILE* f = fd < 0 ? nullptr : fdopen(fd, "w+b");
+  if (!f) {
+    std::cerr << "Failed to create temp file: " << path << std::endl;
+    exit(EXIT_FAILURE);
+  }
+  unlink(path.c_str());
+  return f;
+}
+
+void spillError(const char* what) {
+  std::cerr << "Failed to spill to temp file (" << what << "), is $TMPDIR full?" << std::endl;
+  exit(EXIT_FAILURE);
+}
+
+void BXSpillWriter::write(const void* p, size_t n) {
+  if (n && fwrite(p, 1, n, m_f) != n)
+    spillError("write");
+}
+
+BXSpillReader::BXSpillReader(FILE* f, off_t beg, off_t end)
+  : m_fd(fileno(f)), m_pos(beg), m_end(end) {}
+
+void BXSpillReader::read(void* p, size_t n) {
+
+  char* out = static_cast<char*>(p);
+  while (n) {
+    if (m_bufpos == m_buf.size()) {
+      const size_t want = std::min<off_t>(1 << 16, m_end - m_pos);
+      m_buf.resize(want);
+      m_bufpos = 0;
+      if (!want || pread(m_fd, &m_buf[0], want, m_pos) != static_cast<ssize_t>(want))
+	spillError("read");
+      m_pos += want;
+    }
+    const size_t k = std::min(n, m_buf.size() - m_bufpos);
+    memcpy(out, &m_buf[m_bufpos], k);
+    m_bufpos += k;
+    out += k;
+    n -= k;
+  }
+}
+
+// Only accumulators made under a budget take part. Without one nothing is
+// counted, so the sharded copies on worker threads never touch the list.
+BXSpillable::BXSpillable() {
+  if (budget)
+    spillables().push_back(this);
+}
+
+BXSpillable::BXSpillable(const BXSpillable&) {
+  if (budget)
+    spillables().push_back(this);
+}
+
+BXSpillable::~BXSpillable() {
+  std::vector<BXSpillable*>& all = spillables();
+  all.erase(std::remove(all.begin(), all.end(), this), all.end());
+  used -= m_bytes;
+}
+
+void BXSpillable::account(size_t n) {
+
+  if (!budget)
+    return;
+  m_bytes += n;
+  used += n;
+
+  while (used > budget) {
+    BXSpillable* largest = nullptr;
+    for (auto s : spillables())
+      if (!largest || s->m_bytes > largest->m_bytes)
+	largest = s;
+    if (!largest || !largest->m_bytes)
+      return;
+    const size_t before = largest->m_bytes;
+    largest->spill();
+    if (largest->m_bytes == before)
+      return;
+  }
+}
+
+void BXSpillable::resetBytes() {
+  used -= m_bytes;
+  m_bytes = 0;
+}
+
+BXSpillSet::~BXSpillSet() {
+  if (m_file)
+    fclose(m_file);
+  if (m_merged)
+    fclose(m_merged);
+}
+
+void BXSpillSet::insert(const std::string& s) {
+  // the string plus hash node and bucket overhead
+  if (m_live.insert(s).second)
+    account(s.capacity() + 64);
+}
+
+void BXSpillSet::spill() {
+
+  if (m_live.empty())
+    return;
+  if (!m_file)
+    m_file = openSpillFile();
+
+  std::vector<const std::string*> sorted;
+  sorted.reserve(m_live.size());
+  for (const auto& s : m_live)
+    sorted.push_back(&s);
+  std::sort(sorted.begin(), sorted.end(),
+	    [](const std::string* a, const std::string* b) { return *a < *b; });
+
+  BXRun run;
+  fseeko(m_file, 0, SEEK_END);
+  run.beg = ftello(m_file);
+  BXSpillWriter w(m_file);
+  for (const auto s : sorted)
+    w.put(*s);
+  if (fflush(m_file))
+    spillError("write");
+  run.end = ftello(m_file);
+  m_runs.push_back(run);
+
+  std::unordered_set<std::string>().swap(m_live);
+  resetBytes();
+}
+
+void BXSpillSet::finish() {
+
+  if (m_runs.empty())
+    return;
+  spill();
+
+  // k-way merge of the runs into one sorted file without duplicates
+  struct Head {
+    std::string s;
+    size_t run;
+    bool operator<(const Head& o) const { return o.s < s; }
+  };
+  std::priority_queue<Head> heap;
+  std::vector<BXSpillReader> readers;
+  for (const auto& r : m_runs)
+    readers.emplace_back(m_file, r.beg, r.end);
+  auto advance = [&](size_t run) {
+    if (readers[run].eof())
+      return;
+    Head h;
+    h.run = run;
+    readers[run].get(h.s);
+    heap.push(h);
+  };
+  for (size_t i = 0; i < readers.size(); ++i)
+    advance(i);
+
+  m_merged = openSpillFile();
+  BXSpillWriter w(m_merged);
+  std::string last;
+  size_t n = 0;
+  while (!heap.empty()) {
+    Head h = heap.top();
+    heap.pop();
+    advance(h.run);
+    if (n && h.s == last)
+      continue;
+    if (n++ % BX_SPILL_SET_STRIDE == 0) {
+      if (fflush(m_merged))
+	spillError("write");
+      m_samples.push_back(h.s);
+      m_offsets.push_back(ftello(m_merged));
+    }
+    w.put(h.s);
+    last.swap(h.s);
+  }
+  if (fflush(m_merged))
+    spillError("write");
+  m_merged_end = ftello(m_merged);
+
+  // the runs are not needed any more
+  fclose(m_file);
+  m_file = nullptr;
+  m_runs.clear();
+}
+
+bool BXSpillSet::count(const std::string& s) {
+
+  if (!m_merged)
+    return m_live.count(s);
+
+  // the block starting at the last sample <= s
+  const size_t i = std::upper_bound(m_samples.begin(), m_samples.end(), s) - m_samples.begin();
+  if (!i)
+    return false;
+  if (i - 1 != m_block) {
+    m_block = i - 1;
+    BXSpillReader r(m_merged, m_offsets[m_block],
+		    i < m_offsets.size() ? m_offsets[i] : m_merged_end);
+    m_block_strings.clear();
+    while (!r.eof()) {
+      m_block_strings.push_back(std::string());
+      r.get(m_block_strings.back());
+    }
+  }
+  return std::binary_search(m_block_strings.begin(), m_block_strings.end(), s);
+}
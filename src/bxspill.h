@@ -0,0 +1,341 @@
+#ifndef BXTOOLS_SPILL_H__
+#define BXTOOLS_SPILL_H__
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <queue>
+#include <string>
+#include <sys/types.h>
+#include <type_traits>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+// Memory budget for the aggregating commands (global --max-mem). The
+// accumulators that grow with the input (per barcode, per tile, per
+// molecule) keep their entries in a BXSpillMap or BXSpillSet. Once all of
+// them together pass the budget, the largest one writes its entries to a
+// temp file as a run sorted by key and starts over; at the end the runs and
+// what is left in memory are put back together with a k-way merge.
+//
+// Entries are always handed out in key order, spilled or not, so the
+// output does not depend on the budget. Temp files go to $TMPDIR (or /tmp)
+// and are unlinked as soon as they are made.
+
+// Pull the global --max-mem <size>[K|M|G] option out of argv
+void parseMemoryOptions(int& argc, char** argv);
+
+// budget in bytes, 0 for no limit
+size_t memoryBudget();
+
+// an anonymous read/write temp file, removed when closed
+FILE* openSpillFile();
+
+// report a failed temp file read/write and exit
+void spillError(const char* what);
+
+// binary serialisation of the spilled entries
+class BXSpillWriter {
+
+ public:
+
+  explicit BXSpillWriter(FILE* f) : m_f(f) {}
+
+  template <class T>
+  void put(const T& v) {
+    static_assert(std::is_trivially_copyable<T>::value, "spill put() needs a plain value");
+    write(&v, sizeof(T));
+  }
+
+  void put(const std::string& s) {
+    put<uint32_t>(s.size());
+    write(s.data(), s.size());
+  }
+
+  template <class T>
+  void put(const std::vector<T>& v) {
+    put<uint64_t>(v.size());
+    write(v.data(), v.size() * sizeof(T));
+  }
+
+  void write(const void* p, size_t n);
+
+ private:
+
+  FILE* m_f;
+};
+
+// reads back the bytes [beg, end) of a spill file, through its own buffer,
+// so that many runs of one file can be read side by side
+class BXSpillReader {
+
+ public:
+
+  BXSpillReader(FILE* f, off_t beg, off_t end);
+
+  bool eof() const { return m_pos == m_end && m_bufpos == m_buf.size(); }
+
+  template <class T>
+  void get(T& v) {
+    static_assert(std::is_trivially_copyable<T>::value, "spill get() needs a plain value");
+    read(&v, sizeof(T));
+  }
+
+  void get(std::string& s) {
+    uint32_t n = 0;
+    get(n);
+    s.resize(n);
+    read(&s[0], n);
+  }
+
+  template <class T>
+  void get(std::vector<T>& v) {
+    uint64_t n = 0;
+    get(n);
+    v.resize(n);
+    read(v.data(), n * sizeof(T));
+  }
+
+  void read(void* p, size_t n);
+
+ private:
+
+  int m_fd;
+  off_t m_pos;
+  off_t m_end;
+  std::vector<char> m_buf;
+  size_t m_bufpos = 0;
+};
+
+// Everything that counts towards the budget. When the total is over it,
+// the largest one is spilled.
+class BXSpillable {
+
+ public:
+
+  BXSpillable();
+  BXSpillable(const BXSpillable&);
+  virtual ~BXSpillable();
+
+  size_t bytes() const { return m_bytes; }
+
+  virtual void spill() = 0;
+
+ protected:
+
+  // add to this accumulator's estimated memory, spilling as needed
+  void account(size_t n);
+  void resetBytes();
+
+  size_t m_bytes = 0;
+};
+
+// a sorted run of a spill file
+struct BXRun {
+  off_t beg;
+  off_t end;
+};
+
+// Key -> Value aggregates under the memory budget. Value needs
+//
+//   void merge(const Value& o);       // fold in a partial for the same key
+//   void save(BXSpillWriter& w) const;
+//   void load(BXSpillReader& r);
+//
+// Key must be a plain value or a std::string. Partial values of a key are
+// merged oldest first, so "first seen" fields keep their first value.
+template <class Key, class Value>
+class BXSpillMap : public BXSpillable {
+
+ public:
+
+  // entry_bytes is the memory of a new, empty entry. What it grows by
+  // afterwards is reported with grew()
+  explicit BXSpillMap(size_t entry_bytes) : m_entry_bytes(entry_bytes) {}
+
+  BXSpillMap(const BXSpillMap& o)
+    : BXSpillable(o), m_entry_bytes(o.m_entry_bytes), m_live(o.m_live) {
+    if (o.m_file)
+      spillError("copy of a spilled map");
+  }
+
+  ~BXSpillMap() {
+    if (m_file)
+      fclose(m_file);
+  }
+
+  // the entry for a key, made if needed. The reference is good until the
+  // next get() or grew() on any spillable
+  Value& get(const Key& k) {
+    auto it = m_live.find(k);
+    if (it != m_live.end())
+      return it->second;
+    account(m_entry_bytes);
+    return m_live[k];
+  }
+
+  // an entry took n more bytes; may spill
+  void grew(size_t n) {
+    account(n);
+  }
+
+  bool spilled() const { return !m_runs.empty(); }
+
+  // write the entries out as a sorted run and drop them
+  void spill() override {
+    if (m_live.empty())
+      return;
+    if (!m_file)
+      m_file = openSpillFile();
+    std::vector<const Key*> keys = sortedKeys();
+    BXRun run;
+    fseeko(m_file, 0, SEEK_END);
+    run.beg = ftello(m_file);
+    BXSpillWriter w(m_file);
+    for (const auto k : keys) {
+      w.put(*k);
+      m_live[*k].save(w);
+    }
+    if (fflush(m_file))
+      spillError("write");
+    run.end = ftello(m_file);
+    m_runs.push_back(run);
+    std::unordered_map<Key, Value>().swap(m_live);
+    resetBytes();
+  }
+
+  // Call f(key, value) for every key once, in key order, with the partial
+  // values of all runs and of memory merged
+  template <class F>
+  void forEach(F f) {
+
+    std::vector<const Key*> keys = sortedKeys();
+    if (m_runs.empty()) {
+      for (const auto k : keys)
+	f(*k, m_live[*k]);
+      return;
+    }
+
+    // k-way merge of the runs, with the live entries as the newest run
+    struct Head {
+      Key key;
+      size_t run;
+    };
+    auto later = [](const Head& a, const Head& b) {
+      return b.key < a.key || (!(a.key < b.key) && b.run < a.run);
+    };
+    std::priority_queue<Head, std::vector<Head>, decltype(later)> heap(later);
+
+    const size_t live = m_runs.size();
+    std::vector<BXSpillReader> readers;
+    for (const auto& r : m_runs)
+      readers.emplace_back(m_file, r.beg, r.end);
+    size_t next_live = 0;
+
+    auto advance = [&](size_t run) {
+      Head h;
+      h.run = run;
+      if (run == live) {
+	if (next_live == keys.size())
+	  return;
+	h.key = *keys[next_live++];
+      } else {
+	if (readers[run].eof())
+	  return;
+	readers[run].get(h.key);
+      }
+      heap.push(h);
+    };
+
+    for (size_t i = 0; i <= live; ++i)
+      advance(i);
+
+    while (!heap.empty()) {
+      const Key key = heap.top().key;
+      Value merged;
+      bool first = true;
+      while (!heap.empty() && !(key < heap.top().key)) {
+	const size_t run = heap.top().run;
+	heap.pop();
+	if (run == live) {
+	  if (first)
+	    merged = m_live[key];
+	  else
+	    merged.merge(m_live[key]);
+	} else if (first) {
+	  merged.load(readers[run]);
+	} else {
+	  Value v;
+	  v.load(readers[run]);
+	  merged.merge(v);
+	}
+	first = false;
+	advance(run);
+      }
+      f(key, merged);
+    }
+  }
+
+ private:
+
+  std::vector<const Key*> sortedKeys() const {
+    std::vector<const Key*> keys;
+    keys.reserve(m_live.size());
+    for (const auto& e : m_live)
+      keys.push_back(&e.first);
+    std::sort(keys.begin(), keys.end(), [](const Key* a, const Key* b) { return *a < *b; });
+    return keys;
+  }
+
+  size_t m_entry_bytes;
+
+  std::unordered_map<Key, Value> m_live;
+
+  FILE* m_file = nullptr;
+  std::vector<BXRun> m_runs;
+};
+
+// A set of strings under the memory budget, filled first and then only
+// looked up (eg read names to drop in a second pass). Spills sorted runs
+// like BXSpillMap; finish() then merges them into one sorted file and keeps
+// every BX_SPILL_SET_STRIDE-th string in memory to find the block of the
+// file a string would be in.
+static const size_t BX_SPILL_SET_STRIDE = 64;
+
+class BXSpillSet : public BXSpillable {
+
+ public:
+
+  BXSpillSet() {}
+  ~BXSpillSet();
+
+  void insert(const std::string& s);
+
+  void spill() override;
+
+  // done inserting
+  void finish();
+
+  bool count(const std::string& s);
+
+ private:
+
+  BXSpillSet(const BXSpillSet&);
+  BXSpillSet& operator=(const BXSpillSet&);
+
+  std::unordered_set<std::string> m_live;
+
+  FILE* m_file = nullptr;
+  std::vector<BXRun> m_runs;
+
+  // after finish(), if spilled
+  FILE* m_merged = nullptr;
+  std::vector<std::string> m_samples;
+  std::vector<off_t> m_offsets;
+  off_t m_merged_end = 0;
+  size_t m_block = SIZE_MAX;
+  std::vector<std::string> m_block_strings;
+};
+
+#endif
@@ -1,20 +1,25 @@
 #include "bxsplit.h"
 
 #include "bxcommon.h"
+#include "bxdict.h"
+#include "bxaux.h"
+#include "bxspill.h"
+#include "bxindex.h"
+#include "bxfanout.h"
+#include "bxarena.h"
+#include "bxshard.h"
+#include "bxreader.h"
+#include <algorithm>
 #include <string>
 #include <getopt.h>
 #include <iostream>
+#include <memory>
 #include <sstream>
+#include <unistd.h>
 
-#include "SeqLib/BamReader.h"
-#include "SeqLib/BamWriter.h"
-
-struct BXTag {
+#include "htslib/bgzf.h"
 
-  SeqLib::BamWriter w;
-  size_t count = 0;
-  SeqLib::BamRecordVector buff;
-};
+#include "SeqLib/BamWriter.h"
 
 namespace opt {
 
@@ -24,9 +29,11 @@ namespace opt {
   static bool noop = false; // dont write bams, just count
   static int min = 0; // minimum number of reads before writing
   static std::string tag = "BX"; // tag to split by
+  static int buckets = 256; // temp files records are spread over
+  static std::string grouped; // one barcode-grouped BAM instead of a BAM per barcode
 }
 
-static const char* shortopts = "hvxb:a:m:t:";
+static const char* shortopts = "hvxb:a:m:t:B:g:";
 static const struct option longopts[] = {
   { "help",                    no_argument, NULL, 'h' },
   { "no-output",               no_argument, NULL, 'x' },
@@ -34,6 +41,8 @@ static const struct option longopts[] = {
   { "verbose",                 no_argument, NULL, 'v' },
   { "min-reads",               required_argument, NULL, 'm' },
   { "tag",                     required_argument, NULL, 't' },
+  { "buckets",                 required_argument, NULL, 'B' },
+  { "grouped",                 required_argument, NULL, 'g' },
   { NULL, 0, NULL, 0 }
 };
 
@@ -48,6 +57,11 @@ static const char *SPLIT_USAGE_MESSAGE =
 "  -x, --no-output                      Don't output BAMs (count only) [off]\n"
 "  -m, --min-reads                      Minumum reads of given tag to see before writing [0]\n"
 "  -t, --tag                            Split by a tag other than BX (e.g. MI)\n"
+"  -B, --buckets                        Temp files (in $TMPDIR) to spread reads over before writing\n"
+"                                       the BAMs. Each is held in memory in turn [256]\n"
+"  -g, --grouped                        Write one BAM with the reads of each barcode back to back,\n"
+"                                       and its barcode index (<file>.bxi), instead of a BAM per\n"
+"                                       barcode. Read a barcode back with bxtools fetch\n"
 "\n";
 
 void parseSplitOptions(int argc, char** argv) {
@@ -70,86 +84,312 @@ void parseSplitOptions(int argc, char** argv) {
     case 'x': opt::noop = true; break;
     case 'm': arg >> opt::min; break;
     case 't': arg >> opt::tag; break;
+    case 'B': arg >> opt::buckets; break;
+    case 'g': arg >> opt::grouped; break;
     }
   }
 
+  if (opt::buckets < 1) {
+    std::cerr << "Need at least one bucket" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
+  if (opt::noop && !opt::grouped.empty()) {
+    std::cerr << "-g writes reads, and -x only counts them: use one or the other" << std::endl;
+    exit(EXIT_FAILURE);
+  }
+
   if (die || help) {
     std::cerr << "\n" << SPLIT_USAGE_MESSAGE;
     die ? exit(EXIT_FAILURE) : exit(EXIT_SUCCESS);
   }
 }
 
+// Records are first spread by barcode id over opt::buckets temp files, so
+// only that many files are open however many barcodes there are. Each
+// bucket is then read back whole, its records grouped by barcode (keeping
+// input order) and written out one BAM at a time.
+class BXBuckets {
+
+ public:
+
+  explicit BXBuckets(size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+      m_files.push_back(openSpillFile());
+      BGZF* bg = bgzf_dopen(dup(fileno(m_files.back())), "w1");
+      if (!bg)
+	spillError("open bucket");
+      m_out.push_back(bg);
+    }
+  }
+
+  ~BXBuckets() {
+    for (auto f : m_files)
+      fclose(f);
+  }
+
+  size_t size() const { return m_files.size(); }
+
+  // the barcode id is stored in front of each record
+  void add(uint32_t id, const bam1_t* b) {
+    BGZF* bg = m_out[id % m_out.size()];
+    if (bgzf_write(bg, &id, sizeof(id)) != sizeof(id) || bam_write1(bg, b) < 0)
+      spillError("write bucket");
+  }
+
+  // done adding
+  void close() {
+    for (auto bg : m_out)
+      if (bgzf_close(bg) < 0)
+	spillError("write bucket");
+    m_out.clear();
+  }
+
+  // the records of bucket i into an arena, with the barcode id of each
+  void read(size_t i, BXRecordArena& records, std::vector<uint32_t>& ids) const {
+
+    records.clear();
+    ids.clear();
+    BGZF* bg = bgzf_dopen(dup(fileno(m_files[i])), "r");
+    if (!bg || bgzf_seek(bg, 0, SEEK_SET) < 0)
+      spillError("read bucket");
+
+    bam1_t* b = bam_init1();
+    uint32_t id;
+    ssize_t n;
+    while ((n = bgzf_read(bg, &id, sizeof(id))) == sizeof(id)) {
+      if (bam_read1(bg, b) < 0)
+	spillError("read bucket");
+      records.push_back(b);
+      ids.push_back(id);
+    }
+    bam_destroy1(b);
+    bgzf_close(bg);
+    if (n != 0)
+      spillError("read bucket");
+  }
+
+ private:
+
+  BXBuckets(const BXBuckets&);
+  BXBuckets& operator=(const BXBuckets&);
+
+  std::vector<FILE*> m_files;
+  std::vector<BGZF*> m_out;
+};
+
+// One BAM holding every barcode's reads as a contiguous run, in place of
+// millions of small files, plus a .bxi with one chunk per barcode. Written
+// with plain htslib and no thread pool, so that bgzf_tell() gives exact
+// virtual offsets.
+class BXGroupedWriter {
+
+ public:
+
+  ~BXGroupedWriter() {
+    if (m_fp)
+      sam_close(m_fp);
+  }
+
+  bool Open(const std::string& file, const SeqLib::BamHeader& h, const std::string& tag) {
+    // the reads are no longer in the input's sort order
+    std::string text = h.AsString();
+    if (text.compare(0, 3, "@HD") == 0)
+      text.erase(0, text.find('\n') + 1);
+    m_hdr = SeqLib::BamHeader("@HD\tVN:1.4\tSO:unsorted\n" + text);
+    m_file = file;
+    m_index.Reset(tag);
+    m_fp = sam_open(file.c_str(), "wb");
+    return m_fp && sam_hdr_write(m_fp, m_hdr.get_()) >= 0;
+  }
+
+  void Begin() {
+    m_beg = bgzf_tell(m_fp->fp.bgzf);
+  }
+
+  bool Write(const bam1_t* b) {
+    BXTimer t(STAGE_WRITE);
+    return sam_write1(m_fp, m_hdr.get_(), b) >= 0;
+  }
+
+  // the reads since Begin() were those of this barcode
+  void End(const std::string& barcode) {
+    const BXChunk c = { m_beg, static_cast<uint64_t>(bgzf_tell(m_fp->fp.bgzf)) };
+    m_index.Add(barcode, c);
+  }
+
+  bool Close() {
+    const bool ok = sam_close(m_fp) == 0;
+    m_fp = nullptr;
+    return ok && m_index.Save(indexFile(m_file));
+  }
+
+ private:
+
+  htsFile* m_fp = nullptr;
+  SeqLib::BamHeader m_hdr;
+  std::string m_file;
+  BXIndex m_index;
+  uint64_t m_beg = 0;
+};
+
+// read counts per barcode, with ids in order of first appearance
+struct SplitCounts {
+
+  explicit SplitCounts(const std::string& t) : tag(auxTag(t)) {}
+
+  uint32_t add(const char* bx, size_t len) {
+    const uint32_t id = barcodes.intern(bx, len);
+    if (id == counts.size())
+      counts.push_back(0);
+    ++counts[id];
+    return id;
+  }
+
+  void add(const SeqLib::BamRecord& r) {
+    char buf[32];
+    size_t len = 0;
+    const char* bx = scanAux(r.raw(), tag).text(buf, len);
+    if (bx && len)
+      add(bx, len);
+  }
+
+  // in shard order, so ids stay in order of first appearance
+  void merge(const SplitCounts& o) {
+    for (uint32_t i = 0; i < o.counts.size(); ++i) {
+      const uint32_t id = barcodes.intern(o.barcodes.name(i));
+      if (id == counts.size())
+	counts.push_back(0);
+      counts[id] += o.counts[i];
+    }
+  }
+
+  uint16_t tag;
+  BXDict barcodes;
+  std::vector<size_t> counts;
+};
+
 void runSplit(int argc, char** argv) {
   
   parseSplitOptions(argc, argv);
   
   // opeen the BAM
-  SeqLib::BamReader reader;
+  BXReader reader;
   if (!reader.Open(opt::bam)) {
     std::cerr << "Failed to open bam: " << opt::bam << std::endl;
     exit(EXIT_FAILURE);
   }
+  attachThreadPool(reader);
   
-  // make a collection of writers
-  std::unordered_map<std::string, BXTag> tags;
+  SplitCounts acc(opt::tag);
 
-  // loop and write
+  // counting only: the shards of the BAM on -@ threads
+  const std::vector<BXShard> shards = opt::noop ? shardBam(opt::bam, true) : std::vector<BXShard>();
+  if (shards.size()) {
+    if (opt::verbose)
+      std::cerr << "...reading " << shards.size() << " regions on " << threadCount() << " threads" << std::endl;
+    runShardedInOrder(opt::bam, shards, acc);
+  }
+
+  std::unique_ptr<BXBuckets> buckets;
+  if (!opt::noop)
+    buckets.reset(new BXBuckets(opt::buckets));
+
+  // loop and bucket
+  char buf[32];
   SeqLib::BamRecord r;
   size_t count = 0;
   bool hit = false;
-  while (reader.GetNextRecord(r)) {
+  while (shards.empty() && readRecord(reader, r)) {
 
     ++count;
 
     // sanity check
     BXLOOPCHECK(r, hit, opt::tag)
 
-    std::string bx;
-    r.GetTag(opt::tag, bx);
-    if (bx.empty()) {
+    size_t len = 0;
+    const char* bx = scanAux(r.raw(), acc.tag).text(buf, len);
+    if (!bx || !len) {
       continue;
     } else {
       hit = true;
     }
     
-    ++tags[bx].count;
+    const uint32_t id = acc.add(bx, len);
+    if (buckets)
+      buckets->add(id, r.raw());
+  }
 
-    if (opt::noop)
-      continue;
-    
-    if (tags[bx].count < opt::min) {
-      tags[bx].buff.push_back(r);
-      continue;
+  // write the BAMs of the barcodes with enough reads, bucket by bucket
+  if (buckets) {
+    buckets->close();
+
+    BXFanout fanout(reader.Header());
+    BXGroupedWriter grouped;
+    if (!opt::grouped.empty() && !grouped.Open(opt::grouped, reader.Header(), opt::tag)) {
+      std::cerr << "Could not open BAM: " << opt::grouped << std::endl;
+      exit(EXIT_FAILURE);
     }
-    
-    // have a buffer to clear or hit first read with no min
-    if (tags[bx].buff.size() || (opt::min <= 0 && tags[bx].count == 1)) {   
-
-      // need to establish a new writer?
-      std::string bname = opt::analysis_id + "." + bx + ".bam";
-      if (!tags[bx].w.Open(bname)) {
-	std::cerr << "Could not open BAM: " << bname << std::endl;
-	exit(EXIT_FAILURE);
+
+    const size_t min = std::max(opt::min, 1);
+    BXRecordArena records; // reused from bucket to bucket
+    std::vector<uint32_t> ids;
+    std::vector<uint32_t> order;
+    bam1_t b;
+    for (size_t i = 0; i < buckets->size(); ++i) {
+
+      buckets->read(i, records, ids);
+      if (opt::verbose)
+	std::cerr << "...bucket " << (i + 1) << " of " << buckets->size() << ": "
+		  << SeqLib::AddCommas(records.size()) << " reads" << std::endl;
+
+      // group by barcode, keeping input order within one
+      order.resize(ids.size());
+      for (uint32_t j = 0; j < order.size(); ++j)
+	order[j] = j;
+      std::stable_sort(order.begin(), order.end(),
+		       [&](uint32_t x, uint32_t y) { return ids[x] < ids[y]; });
+
+      for (size_t j = 0; j < order.size();) {
+	const uint32_t id = ids[order[j]];
+	size_t k = j;
+	while (k < order.size() && ids[order[k]] == id)
+	  ++k;
+	if (acc.counts[id] >= min && !opt::grouped.empty()) {
+	  grouped.Begin();
+	  for (; j < k; ++j) {
+	    records.view(order[j], b);
+	    if (!grouped.Write(&b)) {
+	      std::cerr << "failed to write read " << bam_get_qname(&b) << " to " << opt::grouped << std::endl;
+	      exit(EXIT_FAILURE);
+	    }
+	  }
+	  grouped.End(acc.barcodes.name(id));
+	} else if (acc.counts[id] >= min) {
+	  // a whole barcode per output, compressed on the -@ threads
+	  std::string bname = opt::analysis_id + "." + acc.barcodes.name(id) + ".bam";
+	  std::cerr << "creating new output BAM: " << bname << std::endl;
+	  const size_t out = fanout.Add(bname);
+	  for (; j < k; ++j) {
+	    records.view(order[j], b);
+	    fanout.Write(out, &b);
+	  }
+	  fanout.Finish(out);
+	}
+	j = k;
       }
-      
-      std::cerr << "creating new output BAM: " << bname << std::endl;
-      tags[bx].w.SetHeader(reader.Header());
-      tags[bx].w.WriteHeader();
-      for (const auto& rr : tags[bx].buff)
-	tags[bx].w.WriteRecord(rr);
-      tags[bx].buff.clear();
-      continue;
     }
-    
-    if (!tags[bx].w.WriteRecord(r)) {
-      std::cerr << "failed to write read " << r << " to BAM for " << bx << std::endl;
+
+    if (!fanout.Close())
+      exit(EXIT_FAILURE);
+    if (!opt::grouped.empty() && !grouped.Close()) {
+      std::cerr << "Failed to write " << opt::grouped << " or its index" << std::endl;
       exit(EXIT_FAILURE);
     }
-    
   }
 
   // print the final counts to std::out
-  for (const auto& b : tags)
-    std::cout << b.first << "\t" << b.second.count << std::endl;
+  for (uint32_t i = 0; i < acc.counts.size(); ++i)
+    std::cout << acc.barcodes.name(i) << "\t" << acc.counts[i] << std::endl;
   
 }
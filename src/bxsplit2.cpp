@@ -1,6 +1,10 @@
 #include "bxsplit2.h"
 
 #include "bxcommon.h"
+#include "bxaux.h"
+#include "bxshard.h"
+#include "bxspill.h"
+#include "bxreader.h"
 #include <string>
 #include <getopt.h>
 #include <iostream>
@@ -9,7 +13,7 @@
 #include <set>
 #include <unordered_map>
 #include <sys/stat.h>
-#include "SeqLib/BamReader.h"
+#include <cerrno>
 #include "SeqLib/BamWriter.h"
 
 
@@ -64,43 +68,113 @@ void parseSplit2Options(int argc, char** argv) {
     }
 }
 
+// the barcodes of one reference, sorted
+struct BXBarcodeSet {
+
+    std::set<std::string> barcodes;
+
+    void merge(const BXBarcodeSet& o) {
+        barcodes.insert(o.barcodes.begin(), o.barcodes.end());
+    }
+
+    void save(BXSpillWriter& w) const {
+        w.put<uint64_t>(barcodes.size());
+        for (const auto& b : barcodes)
+            w.put(b);
+    }
+
+    void load(BXSpillReader& r) {
+        uint64_t n = 0;
+        r.get(n);
+        std::string b;
+        for (uint64_t i = 0; i < n; ++i) {
+            r.get(b);
+            barcodes.insert(barcodes.end(), b);
+        }
+    }
+};
+
+// barcodes seen on each reference, one per shard thread when running sharded
+class RefBarcodes final : public BXAnalysis {
+
+public:
+
+    BXSpillMap<std::string, BXBarcodeSet> tags { sizeof(BXBarcodeSet) + 64 };
+    uint16_t bx_tag = auxTag("BX");
+
+    void add(const SeqLib::BamRecord& r) override {
+        char buf[32];
+        size_t len = 0;
+        const char* bx = scanAux(r.raw(), bx_tag).text(buf, len);
+        if (!bx || !len)
+            return;
+        // a set node and the string
+        if (tags.get(r.ChrName()).barcodes.insert(std::string(bx, len)).second)
+            tags.grew(len + 80);
+    }
+
+    void merge(RefBarcodes& o) {
+        o.tags.forEach([&](const std::string& chr, const BXBarcodeSet& s) {
+            tags.get(chr).merge(s);
+        });
+    }
+
+    void merge(BXAnalysis& o) override {
+        merge(static_cast<RefBarcodes&>(o));
+    }
+
+    BXAnalysis* clone() const override {
+        return new RefBarcodes(*this);
+    }
+
+    // one <chr>.txt per reference in the folder, which is made if needed
+    void write(const std::string& folder) override {
+        if (mkdir(folder.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH) && errno != EEXIST) {
+            std::cerr << "Failed to create output folder: " << folder << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        tags.forEach([&](const std::string& chr, const BXBarcodeSet& s) {
+            std::string out_file = folder + "/" + chr + ".txt";
+            std::ofstream out(out_file.c_str(), std::ofstream::out);
+            for (auto tag : s.barcodes) {
+                out << tag << "\n";
+            }
+        });
+    }
+};
+
+BXAnalysis* newRefBarcodeAnalysis() {
+    return new RefBarcodes();
+}
+
 void runSplitByReference(int argc, char** argv) {
     parseSplit2Options(argc, argv);
 
     // open the BAM
-    SeqLib::BamReader reader;
+    BXReader reader;
     if (!reader.Open(opt::bam)) {
         std::cerr << "Failed to open bam: " << opt::bam << std::endl;
         exit(EXIT_FAILURE);
     }
+    attachThreadPool(reader);
 
     int err_code = mkdir(opt::out_folder.c_str(), S_IRWXU | S_IRWXG | S_IROTH | S_IXOTH);
     if (err_code)
         exit(EXIT_FAILURE);
 
-    // make a collection of writers
-    std::unordered_map<std::string, std::set<std::string>> tags;
-    // loop and write
-    SeqLib::BamRecord r;
-    size_t count = 0;
-    bool hit = false;
-    while (reader.GetNextRecord(r)) {
-        std::string bx;
-        r.GetTag("BX", bx);
-        if (bx.empty()) {
-            continue;
-        } else {
-            hit = true;
-        }
-        tags[r.ChrName()].insert(bx);
+    // collect the barcodes per reference
+    RefBarcodes refs;
+    const std::vector<BXShard> shards = shardBam(opt::bam, true);
+    if (shards.size()) {
+        if (opt::verbose)
+            std::cerr << "...reading " << shards.size() << " regions on " << threadCount() << " threads" << std::endl;
+        runSharded(opt::bam, shards, refs);
+    } else {
+        SeqLib::BamRecord r;
+        while (readRecord(reader, r))
+            refs.add(r);
     }
 
-    for (auto chr : tags) {
-        std::string out_file = opt::out_folder + "/" + chr.first + ".txt";
-        std::ofstream out(out_file.c_str(), std::ofstream::out);
-        for (auto tag : chr.second) {
-            out << tag << "\n";
-        }
-    }
+    refs.write(opt::out_folder);
 
 }
\ No newline at end of file
@@ -3,4 +3,9 @@
 
 void parseSplit2Options(int argc, char** argv);
 void runSplitByReference(int argc, char** argv);
+
+#include "bxanalysis.h"
+
+// the accumulator of bxtools split-by-ref; write() takes the output folder
+BXAnalysis* newRefBarcodeAnalysis();
 #endif
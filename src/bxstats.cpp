@@ -1,25 +1,31 @@
 #include "bxstats.h"
 
 #include "bxcommon.h"
+#include "bxdict.h"
+#include "bxaux.h"
+#include "bxshard.h"
+#include "bxreader.h"
 
 #include <getopt.h>
 #include <iostream>
 #include <sstream>
+#include <cstring>
 
-#include "SeqLib/BamReader.h"
 
 namespace opt {
 
   static std::string bam; // the bam to analyze
   static bool verbose = false; 
   static std::string tag = "BX"; // tag to split by
+  static bool estimate_names = false; // count reads by distinct names, not flags
 }
 
-static const char* shortopts = "hvt:";
+static const char* shortopts = "hvt:n";
 static const struct option longopts[] = {
   { "help",                    no_argument, NULL, 'h' },
   { "tag",                     required_argument, NULL, 't' },
   { "bam",                     required_argument, NULL, 'b' },
+  { "estimate-names",          no_argument, NULL, 'n' },
   { NULL, 0, NULL, 0 }
 };
 
@@ -30,65 +36,141 @@ static const char *STAT_USAGE_MESSAGE =
 "  General options\n"
 "  -v, --verbose                        Set verbose output\n"
 "  -t, --tag                            Collect stats by a tag other than BX (e.g. MI)\n"
+"  -n, --estimate-names                 Count reads as distinct read names (HyperLogLog estimate,\n"
+"                                       ~2% error) rather than primary first-in-pair records,\n"
+"                                       for input where the flags cannot be trusted\n"
+"\n"
+"  Output columns, after the read and barcode counts (-1 where there are no values)\n"
+"  BX count median_isize median_mapq median_as isize_p10 isize_p90 mapq_p10 mapq_p90\n"
+"  as_p10 as_p90 isize_mean isize_sd mapq_mean mapq_sd as_mean as_sd\n"
+"  Medians and percentiles are interpolated (10 and 11 give a median of 10.5)\n"
 "\n";
 
-static void parseOptions(int argc, char** argv);
+// Everything stats collects. One per shard thread when the BAM is indexed
+// and -@ is given, merged at the end
+class StatAccumulator final : public BXAnalysis {
 
-void runStat(int argc, char** argv) {
-  
-  parseOptions(argc, argv);
+ public:
 
-  // open the BAM
-  SeqLib::BamReader reader;
-  if (!reader.Open(opt::bam)) {
-    std::cerr << "Failed to open bam: " << opt::bam << std::endl;
-    exit(EXIT_FAILURE);
+  BXDict barcodes;
+  BXSpillMap<uint32_t, BXStat> bxstats;
+  uint16_t aux_tags[2];
+
+  // "Number of reads" is the number of templates: primary records that are
+  // unpaired or first in pair, or an estimate of the distinct read names
+  bool estimate_names;
+  uint64_t templates = 0;
+  BXDistinct names;
+
+  StatAccumulator(const std::string& tag, bool estimate)
+    : bxstats(sizeof(BXStat) + 64), estimate_names(estimate) {
+    aux_tags[0] = auxTag(tag);
+    aux_tags[1] = auxTag("AS");
   }
 
-  std::unordered_map<std::string, BXStat> bxstats;
-  std::unordered_set<std::string> read_ids;
-  std::unordered_set<std::string> barcodes;
-
-
-  // loop and collect
-  SeqLib::BamRecord r;
-  size_t count = 0;
-  while (reader.GetNextRecord(r)) {
-    read_ids.insert(r.Qname());
-    std::string bx;
-    bool tag_present = r.GetZTag(opt::tag, bx);
-    BXLOOPCHECK(r, bxstats.size(), opt::tag)
-    if (!tag_present)
-      continue;
-    barcodes.insert(bx);
-    ++bxstats[bx].count;
-    bxstats[bx].bx = bx;
+  void add(const SeqLib::BamRecord& r) override {
+
+    const bam1_t* b = r.raw();
+    if (estimate_names)
+      names.add(bam_get_qname(b), strlen(bam_get_qname(b)));
+    else if (!(b->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)) &&
+	     (!(b->core.flag & BAM_FPAIRED) || (b->core.flag & BAM_FREAD1)))
+      ++templates;
+
+    // the barcode and AS tags come from one walk of the aux block
+    BXAux aux[2];
+    scanAux(r.raw(), aux_tags, 2, aux);
+    const BXAux& bx = aux[0];
+    const BXAux& as = aux[1];
+    if (!bx.isString())
+      return;
+    BXStat& s = bxstats.get(barcodes.intern(bx.str(), bx.len));
+    const size_t bytes = s.bytes();
+    ++s.count;
     if (r.PairMappedFlag() && !r.Interchromosomal())
-      bxstats[bx].isize.push_back(std::abs(r.InsertSize()));
+      s.addInsertSize(std::abs(r.InsertSize()));
     if (r.MappedFlag())
-      bxstats[bx].mapq.push_back(std::abs(r.MapQuality()));
-
-    int as_int = -1;
-    float as_float = -1;
-    std::string as_string = "NA";
-    if (r.GetIntTag("AS", as_int))
-      bxstats[bx].as.push_back(as_int);
-    else if (r.GetFloatTag("AS", as_float))
-      bxstats[bx].as.push_back(as_float);
-    else if (r.GetZTag("AS", as_string)) {
+      s.addMapq(std::abs(r.MapQuality()));
+
+    if (as.isInt())
+      s.addAS(static_cast<int32_t>(as.toInt()));
+    else if (as.isFloat())
+      s.addAS(as.toFloat());
+    else if (as.isString()) {
+      const std::string as_string(as.str(), as.len);
       try {
-	bxstats[bx].as.push_back(std::stof(as_string));
+	s.addAS(std::stof(as_string));
       } catch (...) {
 	std::cerr << "Could not convert AS:Z val of " << as_string << " to float" << std::endl;
       }
     }
+    bxstats.grew(s.bytes() - bytes);
+  }
+
+  void merge(StatAccumulator& o) {
+    templates += o.templates;
+    names.merge(o.names);
+    o.bxstats.forEach([&](uint32_t i, const BXStat& s) {
+	bxstats.get(barcodes.intern(o.barcodes.name(i))).merge(s);
+      });
+  }
+
+  void merge(BXAnalysis& o) override {
+    merge(static_cast<StatAccumulator&>(o));
+  }
+
+  BXAnalysis* clone() const override {
+    return new StatAccumulator(*this);
+  }
+
+  void write(const std::string& out) override {
+    std::ofstream file;
+    std::ostream& os = openOutput(out, file);
+    os << "Number of reads: " << (estimate_names ? names.estimate() : templates) << std::endl;
+    os << "Number of barcodes: " << barcodes.size() << std::endl;
+    bxstats.forEach([&](uint32_t i, const BXStat& s) {
+	os << barcodes.name(i) << "\t" << s << std::endl;
+      });
+  }
+};
 
+BXAnalysis* newStatAnalysis(const std::string& tag, bool estimate_names) {
+  return new StatAccumulator(tag, estimate_names);
+}
+
+static void parseOptions(int argc, char** argv);
+
+void runStat(int argc, char** argv) {
+  
+  parseOptions(argc, argv);
+
+  StatAccumulator acc(opt::tag, opt::estimate_names);
+
+  const std::vector<BXShard> shards = shardBam(opt::bam, true);
+  if (shards.size()) {
+    if (opt::verbose)
+      std::cerr << "...reading " << shards.size() << " regions on " << threadCount() << " threads" << std::endl;
+    runSharded(opt::bam, shards, acc);
+  } else {
+
+    // open the BAM
+    BXReader reader;
+    if (!reader.Open(opt::bam)) {
+      std::cerr << "Failed to open bam: " << opt::bam << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    attachThreadPool(reader);
+
+    // loop and collect
+    SeqLib::BamRecord r;
+    size_t count = 0;
+    while (readRecord(reader, r)) {
+      BXLOOPCHECK(r, acc.barcodes.size(), opt::tag)
+      acc.add(r);
+    }
   }
 
-  std::cout << "Number of reads: " << read_ids.size() << std::endl;
-  std::cout << "Number of barcodes: " << barcodes.size() << std::endl;
-  for (const auto& b : bxstats)
-    std::cout << b.second << std::endl;
+  acc.write("-");
 
 }
 
@@ -107,6 +189,7 @@ static void parseOptions(int argc, char** argv) {
     switch (c) {
     case 'v': opt::verbose = true; break;
     case 'h': help = true; break;
+    case 'n': opt::estimate_names = true; break;
     }
   }
 
@@ -117,34 +200,22 @@ static void parseOptions(int argc, char** argv) {
 
 }
 
-//http://stackoverflow.com/questions/2114797/compute-median-of-values-stored-in-vector-c
-template <class T>
-static double CalcMHWScore(std::vector<T> scores) {
-  double median;
-  size_t size = scores.size();
-
-  std::sort(scores.begin(), scores.end());
-
-  if (size  % 2 == 0)
-      median = (scores[size / 2 - 1] + scores[size / 2]) / 2;
-  else 
-      median = scores[size / 2];
-
-  return median;
+template <class M>
+static void printMoments(std::ostream& out, const M& m) {
+  if (m.count())
+    out << "\t" << m.mean() << "\t" << m.sd();
+  else
+    out << "\t-1\t-1";
 }
 
 std::ostream& operator<<(std::ostream& out, const BXStat& b) {
-  double isize_med = -1;
-  double mapq_med = -1;
-  double as_med = -1;
-  if (b.isize.size())
-    isize_med = CalcMHWScore(b.isize);
-  if (b.mapq.size())
-    mapq_med = CalcMHWScore(b.mapq);
-  if (b.as.size())
-    as_med = CalcMHWScore(b.as);
-  out << b.bx << "\t" << b.count << "\t" << isize_med << "\t" << mapq_med 
-      << "\t" << as_med;
+  out << b.count << "\t" << b.isize.quantile(0.5) << "\t" << b.mapq.quantile(0.5)
+      << "\t" << b.as.quantile(0.5);
+  out << "\t" << b.isize.quantile(0.1) << "\t" << b.isize.quantile(0.9)
+      << "\t" << b.mapq.quantile(0.1) << "\t" << b.mapq.quantile(0.9)
+      << "\t" << b.as.quantile(0.1) << "\t" << b.as.quantile(0.9);
+  printMoments(out, b.isize_moments);
+  printMoments(out, b.mapq_moments);
+  printMoments(out, b.as_moments);
   return out;
 }
-
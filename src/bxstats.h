@@ -7,16 +7,87 @@
 #include <algorithm>
 #include <sstream>
 
+#include "bxsketch.h"
+
+#include "bxanalysis.h"
+
 void runStat(int argc, char** argv);
 
+// the accumulator of bxtools stats, collecting by the given tag
+BXAnalysis* newStatAnalysis(const std::string& tag, bool estimate_names = false);
+
+// per-barcode stats, keyed by BXDict id (label lives in the dict). All
+// summaries are fixed size, so memory is per barcode, not per read
 struct BXStat {
 
-  std::string bx; // label
-  size_t count;   // number of reads
-  std::vector<int> isize; // insert size
-  std::vector<int> mapq;  // mapping quality
-  std::vector<float> as;  // alignment quality
+  size_t count = 0; // number of reads
+  BXQuantiles isize; // insert size
+  BXHistogram mapq;  // mapping quality
+  BXQuantiles as;    // alignment quality
+  BXIntMoments isize_moments;
+  BXIntMoments mapq_moments;
+  BXMoments as_moments;
+
+  void addInsertSize(int v) {
+    isize.add(v);
+    isize_moments.add(v);
+  }
+
+  void addMapq(int v) {
+    mapq.add(v);
+    mapq_moments.add(v);
+  }
+
+  void addAS(float v) {
+    as.add(v);
+    as_moments.add(v);
+  }
+
+  // Fold in the stats of the same barcode from a later shard or spilled
+  // run. The integer moments and MAPQ histogram merge exactly, and AS
+  // values are replayed while o still holds them all, so the result only
+  // differs from reading serially in memory when o alone had 256 or more
+  // insert sizes or AS values for the barcode.
+  void merge(const BXStat& o) {
+    count += o.count;
+    isize.merge(o.isize);
+    mapq.merge(o.mapq);
+    isize_moments.merge(o.isize_moments);
+    mapq_moments.merge(o.mapq_moments);
+    if (o.as.exact())
+      o.as.forEachValue([this](float v) { as_moments.add(v); });
+    else
+      as_moments.merge(o.as_moments);
+    as.merge(o.as);
+  }
+
+  // heap memory of the summaries
+  size_t bytes() const {
+    return isize.bytes() + mapq.bytes() + as.bytes();
+  }
+
+  // for BXSpillMap
+  void save(BXSpillWriter& w) const {
+    w.put(count);
+    isize.save(w);
+    mapq.save(w);
+    as.save(w);
+    isize_moments.save(w);
+    mapq_moments.save(w);
+    as_moments.save(w);
+  }
+
+  void load(BXSpillReader& r) {
+    r.get(count);
+    isize.load(r);
+    mapq.load(r);
+    as.load(r);
+    isize_moments.load(r);
+    mapq_moments.load(r);
+    as_moments.load(r);
+  }
   
+  // count, medians, p10 / p90 and mean / sd of insert size, MAPQ and AS
   friend std::ostream& operator<<(std::ostream& out, const BXStat& b);
 
 };
@@ -1,43 +1,77 @@
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <functional>
 #include <iostream>
 #include <string>
+#include <queue>
 #include <vector>
 #include <unordered_set>
+#include <utility>
 #include <getopt.h>
+#include <unistd.h>
+
+#include "htslib/bgzf.h"
 
-#include "SeqLib/BamReader.h"
 #include "SeqLib/BamWriter.h"
 #include "bxcommon.h"
+#include "bxdict.h"
+#include "bxbarcode.h"
+#include "bxaux.h"
+#include "bxpipeline.h"
 #include "bxsubsample.h"
+#include "bxreader.h"
+#include "bxshard.h"
+#include "bxspill.h"
 
 
 namespace opt {
 
     static std::string bam; // the bam to split
-    static double ratio; // the bam to split
+    static double ratio = -1; // fraction of the barcodes to keep
     static std::string out_bam; // unique prefix for output
     static bool verbose = false;
+    static uint64_t seed = 0; // of the barcode hash
+    static bool exact = false; // the first ratio * total barcodes, in two passes
+    static size_t max_reads = 0; // read pairs per barcode, 0 for no cap
+    static size_t total = 0; // reads in all, 0 for no target
 }
 
 
-static const char* shortopts = "hvro:";
+static const char* shortopts = "hvr:o:s:ek:n:";
 static const struct option longopts[] = {
         { "help",                    no_argument, NULL, 'h' },
         { "out-bam",                 required_argument, NULL, 'o' },
         { "ratio",                   required_argument, NULL, 'r' },
         { "verbose",                 no_argument, NULL, 'v' },
+        { "seed",                    required_argument, NULL, 's' },
+        { "exact",                   no_argument, NULL, 'e' },
+        { "max-reads",               required_argument, NULL, 'k' },
+        { "total",                   required_argument, NULL, 'n' },
         { NULL, 0, NULL, 0 }
 };
 
 
 static const char *SUBSAMPLE_USAGE_MESSAGE =
         "Usage: bxtools subsample <BAM> -r <float> -o <out-BAM> \n"
-                "Description: subsample bam files by excluding (1-r)*total_barcodes\n"
+                "Description: subsample bam files, keeping the reads of a fraction r of the barcodes.\n"
+                "             A barcode is kept when a seeded 64-bit hash of it falls below r, in one\n"
+                "             pass (so <BAM> can be - for stdin), and the same barcodes are kept on\n"
+                "             every run and machine. Reads without a BX tag are kept\n"
                 "\n"
                 "  General options\n"
                 "  -v, --verbose                        Select verbosity level (0-4). Default: 0 \n"
                 "  -h, --help                           Display this help and exit\n"
                 "  -o, --out-bam                        Output bam-file\n"
-                "  -r, --ratio                          Output bam-file\n"
+                "  -r, --ratio                          Fraction of the barcodes to keep (0-1)\n"
+                "  -s, --seed                           Seed of the barcode hash, for other subsets [0]\n"
+                "  -e, --exact                          Keep exactly r * total barcodes, the first ones in order of\n"
+                "                                       appearance. Takes a first pass to count them\n"
+                "  -k, --max-reads                      Keep at most k read pairs per barcode, chosen uniformly\n"
+                "  -n, --total                          Keep about n reads in all, chosen uniformly\n"
+                "\n"
+                "  With -k or -n, reads are picked by a seeded hash of their name, so mates (and secondary\n"
+                "  alignments) are kept or dropped together. -r is then optional\n"
                 "\n";
 
 void parseSubsampleOptions(int argc, char** argv) {
@@ -58,71 +92,268 @@ void parseSubsampleOptions(int argc, char** argv) {
             case 'o': arg >> opt::out_bam; break;
             case 'r': arg >> opt::ratio; break;
             case 'v': opt::verbose = true; break;
+            case 'h': help = true; break;
+            case 's': arg >> opt::seed; break;
+            case 'e': opt::exact = true; break;
+            case 'k': arg >> opt::max_reads; break;
+            case 'n': arg >> opt::total; break;
         }
     }
 
+    if (opt::ratio < 0 && (opt::max_reads || opt::total))
+        opt::ratio = 1;
+
+    if (!die && !help && (opt::ratio < 0 || opt::ratio > 1)) {
+        std::cerr << "Ratio (-r) must be between 0 and 1" << std::endl;
+        die = true;
+    }
+
+    if (!die && opt::exact && opt::bam == "-") {
+        std::cerr << "--exact reads the BAM twice and can't read from stdin" << std::endl;
+        exit(EXIT_FAILURE);
+    }
+
     if (die || help) {
         std::cerr << "\n" << SUBSAMPLE_USAGE_MESSAGE;
         die ? exit(EXIT_FAILURE) : exit(EXIT_SUCCESS);
     }
 }
 
-void fillBarcodeSet(std::unordered_set<std::string> &barcodes) {
-    SeqLib::BamReader reader;
-    if (!reader.Open(opt::bam)) {
-        std::cerr << "Failed to open bam: " << opt::bam << std::endl;
-        exit(EXIT_FAILURE);
+// the barcodes of a shard, ids in order of first appearance
+struct BarcodeSet {
+
+    void add(const SeqLib::BamRecord& r) {
+        char buf[32];
+        size_t len = 0;
+        const char* bx = scanAux(r.raw(), tag).text(buf, len);
+        if (bx && len)
+            barcodes.intern(bx, len);
+    }
+
+    // in shard order, so the ids stay in order of first appearance
+    void merge(const BarcodeSet& o) {
+        for (uint32_t i = 0; i < o.barcodes.size(); ++i)
+            barcodes.intern(o.barcodes.name(i));
+    }
+
+    uint16_t tag = auxTag("BX");
+    BXDict barcodes;
+};
+
+void fillBarcodeSet(BXDict &barcodes) {
+    BarcodeSet acc;
+    const std::vector<BXShard> shards = shardBam(opt::bam, true);
+    if (shards.size()) {
+        if (opt::verbose)
+            std::cerr << "...reading " << shards.size() << " regions on " << threadCount() << " threads" << std::endl;
+        runShardedInOrder(opt::bam, shards, acc);
+    } else {
+        BXReader reader;
+        if (!reader.Open(opt::bam)) {
+            std::cerr << "Failed to open bam: " << opt::bam << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        attachThreadPool(reader);
+        SeqLib::BamRecord r;
+        while (readRecord(reader, r))
+            acc.add(r);
+        reader.Close();
+    }
+    std::swap(barcodes, acc.barcodes);
+}
+
+// The k names with the smallest hashes seen so far, ie a uniform sample
+// of k of them. Only the hashes are held: a max-heap of at most k.
+class BXBottomK {
+
+ public:
+
+    explicit BXBottomK(size_t k) : m_k(k) {}
+
+    // could a name with this hash still end up in the sample?
+    bool candidate(uint64_t h) const { return m_heap.size() < m_k || h <= m_heap.top(); }
+
+    void add(uint64_t h) {
+        if (m_heap.size() < m_k) {
+            m_heap.push(h);
+        } else if (h < m_heap.top()) {
+            m_heap.pop();
+            m_heap.push(h);
+        }
     }
+
+    // the names kept in the end are those hashed at or below this
+    uint64_t threshold() const { return m_heap.size() < m_k ? UINT64_MAX : m_heap.top(); }
+
+ private:
+
+    size_t m_k;
+    std::priority_queue<uint64_t> m_heap;
+};
+
+// -k / -n in one pass over the input. A read is hashed by name, and goes
+// into its barcode's bottom-k (if it is the first of a primary pair) and,
+// with -n alone, the overall bottom-n (if primary). Reads that could still
+// be picked are written to a temp file with their hash, in input order:
+// with -n alone a small share of the input once the heap fills, but with
+// -k nearly all of it, as any read of a barcode can still displace one of
+// its picks. When the input ends the thresholds are final, and that file
+// is replayed keeping the reads at or below them. With both -k and -n, the
+// n are drawn from the reads that survive the caps, by one replay to take
+// the bottom-n of their hashes and a second to write them. Memory is the
+// heaps, not the reads, and the input can be stdin.
+template <class Keep>
+static void capReads(BXReader& reader, SeqLib::BamWriter& writer, const Keep& keep_barcode) {
+
+    const uint16_t bx_tag = auxTag("BX");
+    BXDict barcodes;
+    std::vector<BXBottomK> per_barcode;
+    BXBottomK total(opt::total);
+
+    FILE* f = openSpillFile();
+    BGZF* out = bgzf_dopen(dup(fileno(f)), "w1");
+    if (!out)
+        spillError("open");
+
+    char buf[32];
+    size_t nread = 0;
     SeqLib::BamRecord r;
-    while (reader.GetNextRecord(r)) {
-        std::string bx;
-        r.GetTag("BX", bx);
-        if (bx.empty()) {
+    while (readRecord(reader, r)) {
+
+        ++nread;
+        const bam1_t* b = r.raw();
+        size_t len = 0;
+        const char* bx = scanAux(b, bx_tag).text(buf, len);
+        if (bx && len && !keep_barcode(bx, len))
             continue;
-        } else {
-            barcodes.insert(bx);
+
+        const char* name = bam_get_qname(b);
+        const uint64_t h = hashBarcode(name, strlen(name), opt::seed);
+        const uint16_t flag = b->core.flag;
+        const bool primary = !(flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY));
+        bool candidate = true;
+        if (opt::total && !opt::max_reads) {
+            candidate = total.candidate(h);
+            if (primary)
+                total.add(h);
+        }
+
+        // reads without a barcode are not capped
+        uint32_t id = BXDict::npos;
+        if (opt::max_reads && bx && len) {
+            id = barcodes.intern(bx, len);
+            if (id == per_barcode.size())
+                per_barcode.push_back(BXBottomK(opt::max_reads));
+            candidate = per_barcode[id].candidate(h) && candidate;
+            if (primary && (!(flag & BAM_FPAIRED) || (flag & BAM_FREAD1)))
+                per_barcode[id].add(h);
         }
+
+        if (candidate && (bgzf_write(out, &id, sizeof(id)) != sizeof(id) ||
+                          bgzf_write(out, &h, sizeof(h)) != sizeof(h) || bam_write1(out, b) < 0))
+            spillError("write");
     }
-    reader.Close();
+    if (bgzf_close(out) < 0)
+        spillError("write");
+
+    std::vector<uint64_t> thresholds(per_barcode.size());
+    for (size_t i = 0; i < per_barcode.size(); ++i)
+        thresholds[i] = per_barcode[i].threshold();
+    std::vector<BXBottomK>().swap(per_barcode);
+
+    // the reads of the temp file still picked by their barcode, in order
+    auto replay = [&](const std::function<void(uint64_t)>& keep) {
+        BGZF* in = bgzf_dopen(dup(fileno(f)), "r");
+        if (!in || bgzf_seek(in, 0, SEEK_SET) < 0)
+            spillError("read");
+        uint32_t id;
+        uint64_t h;
+        ssize_t n;
+        while ((n = bgzf_read(in, &id, sizeof(id))) == sizeof(id)) {
+            if (bgzf_read(in, &h, sizeof(h)) != sizeof(h) || bam_read1(in, reuseRecord(r)) < 0)
+                spillError("read");
+            if (id == BXDict::npos || h <= thresholds[id])
+                keep(h);
+        }
+        if (n != 0)
+            spillError("read");
+        bgzf_close(in);
+    };
+
+    if (opt::total && opt::max_reads)
+        replay([&](uint64_t h) {
+            if (!(r.raw()->core.flag & (BAM_FSECONDARY | BAM_FSUPPLEMENTARY)))
+                total.add(h);
+        });
+    const uint64_t total_threshold = opt::total ? total.threshold() : UINT64_MAX;
+
+    size_t nkept = 0;
+    replay([&](uint64_t h) {
+        if (h > total_threshold)
+            return;
+        if (!writeRecord(writer, r)) {
+            std::cerr << "failed to write read " << r.Qname() << " to " << opt::out_bam << std::endl;
+            exit(EXIT_FAILURE);
+        }
+        ++nkept;
+    });
+    fclose(f);
+
+    if (opt::verbose)
+        std::cerr << "...kept " << SeqLib::AddCommas(nkept) << " of " << SeqLib::AddCommas(nread) << " reads" << std::endl;
 }
 
 void runSubsample(int argc, char** argv) {
     parseSubsampleOptions(argc, argv);
-    std::unordered_set<std::string> barcodes;
-    fillBarcodeSet(barcodes);
-    int total_barcodes = barcodes.size();
-    int target_barcodes = total_barcodes * opt::ratio;
-    std::cout << target_barcodes << " out of " << total_barcodes << " will be kept" << std::endl;
-    std::unordered_set<std::string> barcodes_to_keep;
-    int i = 0;
-    for (auto barcode : barcodes) {
-        barcodes_to_keep.insert(barcode);
-        i++;
-        if (i == target_barcodes) {
-            break;
-        }
+    BXDict barcodes;
+    uint32_t keep_below = 0;
+    if (opt::exact) {
+        fillBarcodeSet(barcodes);
+        int total_barcodes = barcodes.size();
+        int target_barcodes = total_barcodes * opt::ratio;
+        std::cout << target_barcodes << " out of " << total_barcodes << " will be kept" << std::endl;
+        // ids are dense and in order of appearance, so keep the first target_barcodes of them
+        keep_below = target_barcodes;
     }
+    // else keep the barcodes whose hash is in the lowest ratio of the 64-bit range
+    const bool keep_all = opt::ratio >= 1;
+    const uint64_t threshold = keep_all ? 0 : static_cast<uint64_t>(std::ldexp(opt::ratio, 64));
+    auto keep_barcode = [&](const char* bx, size_t len) {
+        return opt::exact ? barcodes.find(bx, len) < keep_below
+                          : keep_all || hashBarcode(bx, len, opt::seed) < threshold;
+    };
+
     // opeen the BAM
-    SeqLib::BamReader reader;
+    BXReader reader;
     if (!reader.Open(opt::bam)) {
         std::cerr << "Failed to open bam: " << opt::bam << std::endl;
         exit(EXIT_FAILURE);
     }
+    attachThreadPool(reader);
     SeqLib::BamWriter writer;
     writer.Open(opt::out_bam);
+    attachThreadPool(writer);
     writer.SetHeader(reader.Header());
     writer.WriteHeader();
-    SeqLib::BamRecord r;
 
-    while (reader.GetNextRecord(r)) {
-        std::string bx;
-        r.GetTag("BX", bx);
-        if (bx.empty()) {
-            writer.WriteRecord(r);
-        } else {
-            if (barcodes_to_keep.find(bx) != barcodes_to_keep.end()) {
-                writer.WriteRecord(r);
+    if (opt::max_reads || opt::total) {
+        capReads(reader, writer, keep_barcode);
+    } else {
+        // reads without a barcode are kept
+        const uint16_t bx_tag = auxTag("BX");
+        BXPipeline pipeline(reader, writer);
+        const bool ok = pipeline.Run([&](BXBatch& batch) {
+            char buf[32];
+            for (size_t i = 0; i < batch.records.size(); ++i) {
+                size_t len = 0;
+                const char* bx = scanAux(batch.records[i].raw(), bx_tag).text(buf, len);
+                if (bx && len && !keep_barcode(bx, len))
+                    batch.keep[i] = 0;
             }
+        });
+        if (!ok) {
+            std::cerr << "failed to write read to " << opt::out_bam << std::endl;
+            exit(EXIT_FAILURE);
         }
     }
 
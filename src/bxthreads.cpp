@@ -0,0 +1,78 @@
+#include "bxthreads.h"
+
+#include <cstring>
+#include <cstdlib>
+#include <iostream>
+
+#include "htslib/thread_pool.h"
+
+static int nthreads = 1;
+
+// one pool for the whole process, shared by every writer
+static SeqLib::ThreadPool& sharedPool() {
+  static SeqLib::ThreadPool pool(nthreads);
+  return pool;
+}
+
+// and one for the readers and other plain htslib files: SeqLib's pool
+// cannot be attached to them, so reading and writing run up to 2N threads
+static htsThreadPool* readerPool() {
+  static htsThreadPool pool = { hts_tpool_init(nthreads), 0 };
+  return &pool;
+}
+
+int threadCount() {
+  return nthreads;
+}
+
+void setThreadCount(int n) {
+  nthreads = n < 1 ? 1 : n;
+}
+
+void parseThreadOptions(int& argc, char** argv) {
+
+  int j = 1;
+  for (int i = 1; i < argc; ++i) {
+    const char* val = nullptr;
+    if (!strcmp(argv[i], "-@") || !strcmp(argv[i], "--threads")) {
+      if (i + 1 >= argc) {
+	std::cerr << "Option " << argv[i] << " requires a thread count" << std::endl;
+	exit(EXIT_FAILURE);
+      }
+      val = argv[++i];
+    } else if (!strncmp(argv[i], "--threads=", 10)) {
+      val = argv[i] + 10;
+    } else if (!strncmp(argv[i], "-@", 2)) {
+      val = argv[i] + 2;
+    } else {
+      argv[j++] = argv[i];
+      continue;
+    }
+
+    char* end = nullptr;
+    long n = strtol(val, &end, 10);
+    if (end == val || *end != '\0' || n < 1) {
+      std::cerr << "Invalid thread count: " << val << std::endl;
+      exit(EXIT_FAILURE);
+    }
+    setThreadCount(n);
+  }
+
+  argc = j;
+  argv[argc] = nullptr;
+}
+
+void attachThreadPool(BXReader& reader) {
+  if (nthreads > 1 && reader.fp())
+    hts_set_thread_pool(reader.fp(), readerPool());
+}
+
+void attachThreadPool(SeqLib::BamWriter& writer) {
+  if (nthreads > 1)
+    writer.SetThreadPool(sharedPool());
+}
+
+void attachThreadPool(BGZF* fp) {
+  if (nthreads > 1 && fp)
+    bgzf_thread_pool(fp, readerPool()->pool, 0);
+}
@@ -0,0 +1,27 @@
+#ifndef BXTOOLS_THREADS_H__
+#define BXTOOLS_THREADS_H__
+
+#include "htslib/bgzf.h"
+#include "SeqLib/BamWriter.h"
+
+#include "bxreader.h"
+
+// Pull the global -@/--threads option out of argv (anywhere on the
+// command line) so that the subcommand parsers never see it.
+void parseThreadOptions(int& argc, char** argv);
+
+// number of threads requested with -@ (1 means no pool)
+int threadCount();
+void setThreadCount(int n);
+
+// Attach a shared htslib thread pool to an opened reader / writer, so
+// that BGZF inflate and deflate run on the pool. No-op with -@ 1. The
+// writers share a SeqLib::ThreadPool, which does not hand out its
+// htsThreadPool, and the readers another, so there are up to 2N threads.
+void attachThreadPool(BXReader& reader);
+void attachThreadPool(SeqLib::BamWriter& writer);
+
+// and to a plain BGZF file (compressed FASTQ output, say)
+void attachThreadPool(BGZF* fp);
+
+#endif
@@ -1,13 +1,19 @@
 #include "bxtile.h"
 
+#include <algorithm>
 #include <getopt.h>
 #include <iostream>
+#include <memory>
 #include <sstream>
 
-#include "SeqLib/BamReader.h"
 #include "SeqLib/GenomicRegionCollection.h"
 
 #include "bxcommon.h"
+#include "bxdict.h"
+#include "bxaux.h"
+#include "bxshard.h"
+#include "bxspill.h"
+#include "bxreader.h"
 
 namespace opt {
 
@@ -51,71 +57,176 @@ public:
   BXRegion(const std::string c, const std::string p1, const std::string p2, 
 	   const SeqLib::BamHeader& h) : GenomicRegion(c, p1, p2, h) {}
 
-  std::unordered_map<std::string, size_t> counts;
+  // (BXDict id, reads), in id order so that the output does not depend on
+  // hashing or on how the counts were put together
+  std::vector<std::pair<uint32_t, size_t>> counts;
 
-  std::string ToBEDString(const SeqLib::BamHeader& h) const {
+  std::string ToBEDString(const SeqLib::BamHeader& h, const BXDict& barcodes) const {
     std::string out = h.IDtoName(chr) + "\t" + std::to_string(pos1) + 
       "\t" + std::to_string(pos2);
     if (counts.size())
       out += "\t";
     for (const auto& b : counts)
-      out +=  b.first + "_" + std::to_string(b.second) + ",";
+      out +=  barcodes.name(b.first) + "_" + std::to_string(b.second) + ",";
     if (counts.size())
       out.pop_back(); // erase last comma
     return out;
   }
 };
 
+typedef SeqLib::GenomicRegionCollection<BXRegion> BXTiles;
+
+// the barcode counts of one tile, keyed by BXDict id
+struct BXTileCounts {
+
+  std::unordered_map<uint32_t, size_t> counts;
+
+  void merge(const BXTileCounts& o) {
+    for (const auto& b : o.counts)
+      counts[b.first] += b.second;
+  }
+
+  std::vector<std::pair<uint32_t, size_t>> sorted() const {
+    std::vector<std::pair<uint32_t, size_t>> v(counts.begin(), counts.end());
+    std::sort(v.begin(), v.end());
+    return v;
+  }
+
+  void save(BXSpillWriter& w) const {
+    w.put(sorted());
+  }
+
+  void load(BXSpillReader& r) {
+    std::vector<std::pair<uint32_t, size_t>> v;
+    r.get(v);
+    counts.clear();
+    counts.insert(v.begin(), v.end());
+  }
+};
+
+// Per-tile barcode counts, kept sparse by tile index so that each shard
+// thread only holds the tiles its reads touched. The tiles themselves are
+// shared between copies
+class TileAccumulator final : public BXAnalysis {
+
+ public:
+
+  SeqLib::BamHeader hdr;
+  std::shared_ptr<BXTiles> tiles;
+  BXDict barcodes;
+  BXSpillMap<int, BXTileCounts> counts; // by tile index
+  size_t bxcount = 0;
+  uint16_t tile_tag = 0;
+
+  TileAccumulator(const SeqLib::BamHeader& h, const std::string& tag,
+		  int width, int overlap, const std::string& bed)
+    : hdr(h), counts(sizeof(BXTileCounts) + 64), tile_tag(auxTag(tag)) {
+    if (!bed.empty()) {
+      tiles.reset(new BXTiles());
+      tiles->ReadBED(bed, hdr);
+      tiles->CreateTreeMap();
+    } else {
+      // tile it
+      std::cerr << "...creating tiles with width " << 
+	SeqLib::AddCommas(width) << " and overlap " << SeqLib::AddCommas(overlap) << std::endl;
+      tiles.reset(new BXTiles(width, overlap, hdr.GetHeaderSequenceVector()));
+      std::cerr << "...created " << SeqLib::AddCommas(tiles->size()) << " tiles" << std::endl;
+      std::cerr << "...sorting and creating interval tree" << std::endl;
+      tiles->CreateTreeMap();
+    }
+  }
+
+  void add(const SeqLib::BamRecord& r) override {
+    char buf[32];
+    size_t len = 0;
+    const char* bx = scanAux(r.raw(), tile_tag).text(buf, len);
+    if (!bx || !len || !r.MappedFlag())
+      return;
+
+    std::vector<int> bins = tiles->FindOverlappedIntervals(r.AsGenomicRegion(), true);
+    const uint32_t id = barcodes.intern(bx, len);
+    for (const auto& b : bins) 
+      if (++counts.get(b).counts[id] == 1)
+	counts.grew(48); // hash node
+    ++bxcount;
+  }
+
+  void merge(TileAccumulator& o) {
+    std::vector<uint32_t> ids(o.barcodes.size());
+    for (uint32_t i = 0; i < ids.size(); ++i)
+      ids[i] = barcodes.intern(o.barcodes.name(i));
+    o.counts.forEach([&](int t, const BXTileCounts& oc) {
+	for (const auto& b : oc.counts)
+	  counts.get(t).counts[ids[b.first]] += b.second;
+      });
+    bxcount += o.bxcount;
+  }
+
+  void merge(BXAnalysis& o) override {
+    merge(static_cast<TileAccumulator&>(o));
+  }
+
+  BXAnalysis* clone() const override {
+    return new TileAccumulator(*this);
+  }
+
+  void write(const std::string& out) override {
+    std::ofstream file;
+    std::ostream& os = openOutput(out, file);
+
+    // the counts come in tile order, so one tile's worth is held at a time
+    size_t next = 0;
+    auto writeTo = [&](size_t end) {
+      for (; next < end; ++next) {
+	BXRegion& g = (*tiles)[next];
+	os << g.ToBEDString(hdr, barcodes) << std::endl;
+	std::vector<std::pair<uint32_t, size_t>>().swap(g.counts);
+      }
+    };
+    counts.forEach([&](int t, const BXTileCounts& c) {
+	writeTo(t);
+	(*tiles)[t].counts = c.sorted();
+	writeTo(t + 1);
+      });
+    writeTo(tiles->size());
+  }
+};
+
+BXAnalysis* newTileAnalysis(const SeqLib::BamHeader& hdr, const std::string& tag,
+			    int width, int overlap, const std::string& bed) {
+  return new TileAccumulator(hdr, tag, width, overlap, bed);
+}
+
 static void parseOptions(int argc, char** argv);
 
 void runTile(int argc, char** argv) {
   
   parseOptions(argc, argv);
 
-  SeqLib::BamReader reader;
+  BXReader reader;
   BXOPEN(reader, opt::bam);
   SeqLib::BamHeader hdr = reader.Header();
 
-  SeqLib::GenomicRegionCollection<BXRegion> * tiles = nullptr;
-  if (!opt::bed.empty()) {
-    tiles = new SeqLib::GenomicRegionCollection<BXRegion>();
-    tiles->ReadBED(opt::bed, hdr);
-    tiles->CreateTreeMap();
-  } else {
-    // tile it
-    std::cerr << "...creating tiles with width " << 
-      SeqLib::AddCommas(opt::width) << " and overlap " << SeqLib::AddCommas(opt::overlap) << std::endl;
-    tiles = new SeqLib::GenomicRegionCollection<BXRegion>(opt::width, opt::overlap, hdr.GetHeaderSequenceVector());
-    std::cerr << "...created " << SeqLib::AddCommas(tiles->size()) << " tiles" << std::endl;
-    std::cerr << "...sorting and creating interval tree" << std::endl;
-    tiles->CreateTreeMap();
-  }
+  TileAccumulator acc(hdr, opt::tag, opt::width, opt::overlap, opt::bed);
 
   std::cerr << "...reading input" << std::endl;
-  SeqLib::BamRecord r;
-  size_t count = 0; 
-  size_t bxcount = 0;
-  while (reader.GetNextRecord(r)) {
-    std::string bx;
-    r.GetTag(opt::tag, bx);
-    BXLOOPCHECK(r, bxcount, opt::tag);
-    if (bx.empty())
-      continue;
-
-    if (r.MappedFlag()) {
-      std::vector<int> bins = tiles->FindOverlappedIntervals(r.AsGenomicRegion(), true);
-      for (const auto& b : bins) 
-	++(*tiles)[b].counts[bx];
-      ++bxcount;
+
+  // unplaced reads are skipped anyway, so no shard for them
+  const std::vector<BXShard> shards = shardBam(opt::bam, false);
+  if (shards.size()) {
+    if (opt::verbose)
+      std::cerr << "...reading " << shards.size() << " regions on " << threadCount() << " threads" << std::endl;
+    runSharded(opt::bam, shards, acc);
+  } else {
+    SeqLib::BamRecord r;
+    size_t count = 0; 
+    while (readRecord(reader, r)) {
+      BXLOOPCHECK(r, acc.bxcount, opt::tag);
+      acc.add(r);
     }
-      
   }
 
-  for (const auto& b : *tiles)
-    std::cout << b.ToBEDString(hdr) << std::endl;
-
-  if (tiles)
-    delete tiles;
+  acc.write("-");
   
 }
 
@@ -1,6 +1,17 @@
 #ifndef BXTOOLS_TILE_H__
 #define BXTOOLS_TILE_H__
 
+#include <string>
+
+#include "SeqLib/BamHeader.h"
+
+#include "bxanalysis.h"
+
 void runTile(int argc, char** argv);
 
+// the accumulator of bxtools tile: width/overlap tiles of the genome, or the
+// regions of a BED file if one is given
+BXAnalysis* newTileAnalysis(const SeqLib::BamHeader& hdr, const std::string& tag,
+			    int width, int overlap, const std::string& bed);
+
 #endif
@@ -19,11 +19,27 @@
 #include <bxbamtofastq.h>
 #include <bxfindsv.hpp>
 #include <bxamfilter.h>
+#include <bxindex.h>
+#include <bxfetch.h>
+#include <bxmulti.h>
+#include <bxthreads.h>
+#include <bxprofile.h>
+#include <bxspill.h>
 
 static const char *USAGE_MESSAGE =
 "Program: bxtools \n"
 "Contact: Jeremiah Wala [ jwala@broadinstitute.org ]\n"
 "Usage: snowman <command> [options]\n\n"
+"Global options:\n"
+"           -@, --threads  Number of threads [1]: one pool of N for BGZF reading\n"
+"                          and one of N for writing, so up to 2N for BGZF\n"
+"           --profile[=trace.json]  Report time spent per stage (read, tags, write,\n"
+"                          command logic); optionally write a Chrome/Perfetto trace\n"
+"           --max-mem      Memory for the per-barcode tables of stats, tile, mol,\n"
+"                          split-by-ref, multi and amfilter (e.g. 4G); beyond it they\n"
+"                          spill sorted runs to $TMPDIR and merge them at the end;\n"
+"                          for extract, the matched reads held before they are\n"
+"                          written out (default 256M)\n\n"
 "Commands:\n"
 "           split          Split a BAM into multiple BAMs, one per BX tag\n"
 "           bamtofastq     Extract reads from bam file with BX barcode\n"
@@ -34,6 +50,9 @@ static const char *USAGE_MESSAGE =
 "           mol            Output BED with footprint of each molecule (from MI tag)\n"
 "           convert        Flip the BX tag and chromosome, so as to allow for a BX-sorted and indexable BAM\n"
 "           extract        Extract reads from BAM-file with given barcodes\n"
+"           index          Write a barcode index (.bxi) for a BAM\n"
+"           fetch          Fetch the reads of given barcodes using the barcode index\n"
+"           multi          Run stats, tile, mol and split-by-ref together in one pass\n"
 "           filter         Filter reads from BAM-file by quality\n"
 "           split-by-ref   Create list of barcodes for each reference sequence \n"
 "           subsample      Create list of barcodes for each reference sequence \n"
@@ -42,11 +61,17 @@ static const char *USAGE_MESSAGE =
 
 int main(int argc, char** argv) {
 
+  // global options are stripped here, before the subcommand parses argv
+  parseThreadOptions(argc, argv);
+  parseProfileOptions(argc, argv);
+  parseMemoryOptions(argc, argv);
+
   if (argc <= 1) {
     std::cerr << USAGE_MESSAGE;
     return 0;
   } else {
     std::string command(argv[1]);
+    startProfile(argv[1]);
     if (command == "help" || command == "--help") {
       std::cerr << USAGE_MESSAGE;
       return 0;
@@ -78,6 +103,12 @@ int main(int argc, char** argv) {
       runFindSV(argc - 1, argv + 1);
     } else if (command == "amfilter") {
       runAmFilter(argc - 1, argv + 1);
+    } else if (command == "index") {
+      runIndex(argc - 1, argv + 1);
+    } else if (command == "fetch") {
+      runFetch(argc - 1, argv + 1);
+    } else if (command == "multi") {
+      runMulti(argc - 1, argv + 1);
     }
     else {
       std::cerr << USAGE_MESSAGE;